@@ -0,0 +1,45 @@
+#ifndef CACHE_FILE_H
+#define CACHE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// What the caches that keep things on disk between runs share: the shader
+// binaries in ShaderProgram.cpp and the cooked textures in TextureCache.cpp
+// (chapter 18) both read their files whole and check them with a hash.
+
+// 64-bit FNV-1a: start from fnvBasis, and feed each piece through in turn
+static const uint64_t fnvBasis = 14695981039346656037ull;
+
+inline uint64_t hashBytes(uint64_t hash, const void * data, size_t size)
+{
+    const unsigned char * bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the whole file, false if it can't be read
+inline bool readFile(const std::string & path, std::vector<unsigned char> & contents)
+{
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    bool ok = false;
+    long size;
+    if (!fseek(fp, 0, SEEK_END) && (size = ftell(fp)) >= 0 && !fseek(fp, 0, SEEK_SET)) {
+        contents.resize((size_t)size);
+        ok = fread(contents.data(), 1, contents.size(), fp) == contents.size();
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+#endif
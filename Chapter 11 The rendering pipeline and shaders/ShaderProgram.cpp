@@ -0,0 +1,852 @@
+#include "ShaderProgram.h"
+#include "CacheFile.h"
+#include <chrono>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef GL_PROGRAM_BINARY_FORMATS
+#define GL_PROGRAM_BINARY_FORMATS 0x87FF
+#endif
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// over both sources, each with its terminating 0, which keeps ("ab", "c")
+// apart from ("a", "bc")
+static uint64_t hashSources(const GLchar * vertex, const GLchar * fragment)
+{
+    uint64_t hash = hashBytes(fnvBasis, vertex, strlen(vertex) + 1);
+    return hashBytes(hash, fragment, strlen(fragment) + 1);
+}
+
+// the whole info log, however long it is
+static std::string shaderLog(GLuint shader)
+{
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    if (length <= 0)
+        return std::string();
+
+    std::vector<GLchar> messages(length);
+    glGetShaderInfoLog(shader, length, 0, &messages[0]);
+    return std::string(&messages[0]);
+}
+
+static std::string programLog(GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+    if (length <= 0)
+        return std::string();
+
+    std::vector<GLchar> messages(length);
+    glGetProgramInfoLog(program, length, 0, &messages[0]);
+    return std::string(&messages[0]);
+}
+
+// Hands a shader to the driver to compile, without waiting to hear back.
+static GLuint startShader(GLenum type, const std::string & source)
+{
+    const GLchar * text = source.c_str();
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &text, 0);
+    glCompileShader(shader);
+    return shader;
+}
+
+// Whether a started shader compiled, printing why not if it didn't. Only
+// asked once linking has failed, since asking waits for the compile.
+static bool compiled(GLuint shader, GLenum type)
+{
+    GLint compilationStatus;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compilationStatus);
+    if (compilationStatus == GL_FALSE) {
+        std::cout << (type == GL_VERTEX_SHADER ? "Vertex" : "Fragment")
+                  << " shader :: compile error\n" << shaderLog(shader);
+        return false;
+    }
+    return true;
+}
+
+// -------------- what the driver has
+
+#ifndef GL_NUM_EXTENSIONS
+#define GL_NUM_EXTENSIONS 0x821D
+#endif
+
+typedef const GLubyte * (APIENTRY * GetStringiFn)(GLenum name, GLuint index);
+
+// Whether the context is at least this version of GL.
+static bool versionAtLeast(int major, int minor)
+{
+    static int contextMajor = -1, contextMinor = 0;
+    if (contextMajor < 0) {
+        const char * version = (const char *)glGetString(GL_VERSION);
+        if (!version || sscanf(version, "%d.%d", &contextMajor, &contextMinor) != 2)
+            contextMajor = contextMinor = 0;
+    }
+    return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
+
+// Whether the driver lists this extension, by its whole name. From GL 3.0
+// they're asked for one at a time, since core contexts (all there is on
+// macOS past 2.1) turn down glGetString(GL_EXTENSIONS) with an error.
+static bool hasExtension(const char * name)
+{
+    GetStringiFn getStringi = versionAtLeast(3, 0) ?
+        (GetStringiFn)glfwGetProcAddress("glGetStringi") : nullptr;
+    if (getStringi) {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++) {
+            const char * extension = (const char *)getStringi(GL_EXTENSIONS, (GLuint)i);
+            if (extension && strcmp(extension, name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    const char * extensions = (const char *)glGetString(GL_EXTENSIONS);
+    size_t length = strlen(name);
+    for (const char * at = extensions; at && (at = strstr(at, name)); at += length)
+        if ((at == extensions || at[-1] == ' ') && (at[length] == ' ' || at[length] == '\0'))
+            return true;
+    return false;
+}
+
+// -------------- parallel compiles
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (APIENTRY * MaxShaderCompilerThreadsFn)(GLuint count);
+
+// Whether the driver can tell if a program is done without waiting for it
+// (GL_KHR_parallel_shader_compile, or GL_ARB_parallel_shader_compile before
+// it). The first time, it's also told to use as many threads as it likes,
+// rather than the one it might otherwise stick to.
+static bool parallelCompile()
+{
+    static bool checked = false;
+    static bool available = false;
+    if (checked)
+        return available;
+    checked = true;
+
+    MaxShaderCompilerThreadsFn maxThreads = nullptr;
+    if (hasExtension("GL_KHR_parallel_shader_compile"))
+        maxThreads = (MaxShaderCompilerThreadsFn)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if (hasExtension("GL_ARB_parallel_shader_compile"))
+        maxThreads = (MaxShaderCompilerThreadsFn)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+    if (!maxThreads)
+        return false;
+
+    maxThreads(0xFFFFFFFF);
+    available = true;
+    return true;
+}
+
+// -------------- program binaries
+
+// Not in every platform's GL headers (the legacy contexts on macOS stop at
+// 2.1), so these come from the driver at runtime.
+typedef void (APIENTRY * GetProgramBinaryFn)(GLuint program, GLsizei bufSize, GLsizei * length,
+                                             GLenum * binaryFormat, void * binary);
+typedef void (APIENTRY * ProgramBinaryFn)(GLuint program, GLenum binaryFormat,
+                                          const void * binary, GLsizei length);
+typedef void (APIENTRY * ProgramParameteriFn)(GLuint program, GLenum pname, GLint value);
+
+struct BinaryApi {
+    GetProgramBinaryFn getProgramBinary;
+    ProgramBinaryFn programBinary;
+    ProgramParameteriFn programParameteri;
+    std::vector<GLint> formats; // the binary formats glProgramBinary takes
+    uint64_t driverHash;        // GL vendor, renderer and version
+};
+
+// The entry points, or nullptr if the driver has no binaries (GL 4.1, or
+// GL_ARB_get_program_binary before it) or no formats to offer. Looked up
+// once, on the first program.
+static const BinaryApi * binaryApi()
+{
+    static BinaryApi api;
+    static bool checked = false;
+    static bool available = false;
+    if (checked)
+        return available ? &api : nullptr;
+    checked = true;
+
+    if (!versionAtLeast(4, 1) && !hasExtension("GL_ARB_get_program_binary"))
+        return nullptr;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    api.getProgramBinary = (GetProgramBinaryFn)glfwGetProcAddress("glGetProgramBinary");
+    api.programBinary = (ProgramBinaryFn)glfwGetProcAddress("glProgramBinary");
+    api.programParameteri = (ProgramParameteriFn)glfwGetProcAddress("glProgramParameteri");
+    if (formats <= 0 || !api.getProgramBinary || !api.programBinary || !api.programParameteri)
+        return nullptr;
+
+    api.formats.resize(formats);
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, api.formats.data());
+
+    api.driverHash = fnvBasis;
+    const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : names) {
+        const char * value = (const char *)glGetString(name);
+        if (value)
+            api.driverHash = hashBytes(api.driverHash, value, strlen(value) + 1);
+    }
+
+    available = true;
+    return &api;
+}
+
+// What starts every binary file, followed by both sources (without their
+// terminating 0s) and then length bytes of binary.
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;     // binaryFormat, from glGetProgramBinary
+    uint64_t sourceHash; // hashSources()
+    uint64_t driverHash; // BinaryApi::driverHash
+    uint64_t vertexLength;
+    uint64_t fragmentLength;
+    uint64_t length;
+    uint64_t binaryHash; // hashBytes() of the binary
+};
+
+static const char binaryMagic[8] = { 'G', 'L', 'P', 'R', 'O', 'G', 'B', 'N' };
+static const uint32_t binaryVersion = 2;
+
+static std::string binaryPath(const std::string & directory, uint64_t sourceHash,
+                              uint64_t driverHash)
+{
+    uint64_t key = hashBytes(hashBytes(fnvBasis, &sourceHash, sizeof(sourceHash)),
+                             &driverHash, sizeof(driverHash));
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+// Hands the binary file at path to the driver as a new program, without
+// waiting to hear whether it took it. Returns 0 if there's no file, it's for
+// other sources (compared in full, not just by hash) or another driver, or
+// it's in a format the driver no longer lists.
+static GLuint startBinary(const BinaryApi & api, const std::string & path, uint64_t sourceHash,
+                          const std::string & vertex, const std::string & fragment)
+{
+    std::vector<unsigned char> contents;
+    if (!readFile(path, contents) || contents.size() < sizeof(BinaryHeader))
+        return 0;
+
+    BinaryHeader header;
+    memcpy(&header, contents.data(), sizeof(header));
+    const char * sources = (const char *)contents.data() + sizeof(header);
+    size_t sourcesLength = vertex.size() + fragment.size();
+    if (memcmp(header.magic, binaryMagic, sizeof(binaryMagic)) != 0 ||
+        header.version != binaryVersion ||
+        header.sourceHash != sourceHash ||
+        header.driverHash != api.driverHash ||
+        header.vertexLength != vertex.size() ||
+        header.fragmentLength != fragment.size() ||
+        contents.size() - sizeof(header) < sourcesLength ||
+        header.length != contents.size() - sizeof(header) - sourcesLength ||
+        vertex.compare(0, vertex.size(), sources, vertex.size()) != 0 ||
+        fragment.compare(0, fragment.size(), sources + vertex.size(), fragment.size()) != 0)
+        return 0;
+
+    const unsigned char * binary = (const unsigned char *)sources + sourcesLength;
+    if (header.binaryHash != hashBytes(fnvBasis, binary, (size_t)header.length))
+        return 0;
+
+    // glProgramBinary() would turn an unknown format down with an error
+    bool known = false;
+    for (GLint format : api.formats)
+        known = known || (GLenum)format == header.format;
+    if (!known)
+        return 0;
+
+    GLuint program = glCreateProgram();
+    api.programBinary(program, header.format, binary, (GLsizei)header.length);
+    return program;
+}
+
+// Saves a linked program's binary to path. Written off to the side and
+// renamed into place, so nothing ever reads half a file. Failing to write
+// it only costs the next run a compile.
+static void saveBinary(const BinaryApi & api, const std::string & path, GLuint program,
+                       uint64_t sourceHash, const std::string & vertex,
+                       const std::string & fragment)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<unsigned char> binary(length);
+    GLenum format = 0;
+    api.getProgramBinary(program, length, &length, &format, binary.data());
+    if (length <= 0)
+        return;
+
+    BinaryHeader header;
+    memcpy(header.magic, binaryMagic, sizeof(binaryMagic));
+    header.version = binaryVersion;
+    header.format = format;
+    header.sourceHash = sourceHash;
+    header.driverHash = api.driverHash;
+    header.vertexLength = vertex.size();
+    header.fragmentLength = fragment.size();
+    header.length = (uint64_t)length;
+    header.binaryHash = hashBytes(fnvBasis, binary.data(), (size_t)length);
+
+    std::string directory = path.substr(0, path.rfind('/'));
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+
+    std::string temp = path + ".tmp";
+    if (FILE * fp = fopen(temp.c_str(), "wb")) {
+        bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                       fwrite(vertex.data(), 1, vertex.size(), fp) == vertex.size() &&
+                       fwrite(fragment.data(), 1, fragment.size(), fp) == fragment.size() &&
+                       fwrite(binary.data(), 1, (size_t)length, fp) == (size_t)length;
+        if (fclose(fp) == 0 && written) {
+#ifdef _WIN32
+            remove(path.c_str());
+#endif
+            if (rename(temp.c_str(), path.c_str()) == 0)
+                return;
+        }
+        remove(temp.c_str());
+    }
+}
+
+// -------------- UniformTable
+
+UniformTable::UniformTable(GLuint program)
+{
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    if (count <= 0 || maxLength <= 0)
+        return;
+
+    std::vector<GLchar> name(maxLength);
+    for (GLint i = 0; i < count; i++) {
+        GLsizei length = 0;
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, i, maxLength, &length, &size, &type, &name[0]);
+
+        Uniform uniform;
+        uniform.name.assign(&name[0], length);
+        uniform.location = glGetUniformLocation(program, uniform.name.c_str());
+        uniform.type = type;
+        uniform.known = false;
+        if (uniform.location < 0) // built-ins, such as gl_ModelViewMatrix
+            continue;
+
+        size_t bracket = uniform.name.find('[');
+        if (bracket != std::string::npos)
+            uniform.name.erase(bracket);
+        uniforms.push_back(uniform);
+    }
+}
+
+int UniformTable::find(const char * name) const
+{
+    for (size_t i = 0; i < uniforms.size(); i++)
+        if (uniforms[i].name == name)
+            return (int)i;
+    return -1;
+}
+
+// Whether GL needs to hear about this value, noting it as the uniform's if
+// so. Counts the call either way.
+bool UniformTable::changed(int uniform, const void * value, size_t size)
+{
+    if (uniform < 0 || uniform >= (int)uniforms.size())
+        return false;
+
+    Uniform & entry = uniforms[uniform];
+    if (entry.known && memcmp(entry.value, value, size) == 0) {
+        skipCount++;
+        return false;
+    }
+
+    memcpy(entry.value, value, size);
+    entry.known = true;
+    uploadCount++;
+    return true;
+}
+
+void UniformTable::set(int uniform, GLfloat x)
+{
+    if (changed(uniform, &x, sizeof(x)))
+        glUniform1f(uniforms[uniform].location, x);
+}
+
+void UniformTable::set(int uniform, GLfloat x, GLfloat y)
+{
+    const GLfloat value[] = { x, y };
+    if (changed(uniform, value, sizeof(value)))
+        glUniform2fv(uniforms[uniform].location, 1, value);
+}
+
+void UniformTable::set(int uniform, GLfloat x, GLfloat y, GLfloat z)
+{
+    const GLfloat value[] = { x, y, z };
+    if (changed(uniform, value, sizeof(value)))
+        glUniform3fv(uniforms[uniform].location, 1, value);
+}
+
+void UniformTable::set(int uniform, GLfloat x, GLfloat y, GLfloat z, GLfloat w)
+{
+    const GLfloat value[] = { x, y, z, w };
+    if (changed(uniform, value, sizeof(value)))
+        glUniform4fv(uniforms[uniform].location, 1, value);
+}
+
+void UniformTable::set(int uniform, GLint x)
+{
+    if (changed(uniform, &x, sizeof(x)))
+        glUniform1i(uniforms[uniform].location, x);
+}
+
+void UniformTable::setMatrix(int uniform, const GLfloat * matrix)
+{
+    if (changed(uniform, matrix, 16 * sizeof(GLfloat)))
+        glUniformMatrix4fv(uniforms[uniform].location, 1, GL_FALSE, matrix);
+}
+
+void UniformTable::forget()
+{
+    for (Uniform & uniform : uniforms)
+        uniform.known = false;
+}
+
+// -------------- ShaderCache
+
+uint64_t ShaderCache::keyFor(const GLchar * vertex, const GLchar * fragment) const
+{
+    // the hash of the sources, unless some other pair already has it
+    uint64_t key = hashSources(vertex, fragment);
+    for (;;) {
+        auto it = programs.find(key);
+        if (it == programs.end() ||
+            (it->second.vertex == vertex && it->second.fragment == fragment))
+            return key;
+        key++;
+    }
+}
+
+// Gets the driver going on an entry's program, from its binary if there's
+// one and fromBinary, or else from its sources.
+void ShaderCache::start(Entry & entry, bool fromBinary)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    const BinaryApi * api = binaryDirectory.empty() ? nullptr : binaryApi();
+    parallelCompile();
+
+    entry.program = 0;
+    entry.shaderVertex = entry.shaderFragment = 0;
+    entry.timings.fromBinary = false;
+    if (api && fromBinary)
+        entry.program = startBinary(*api, binaryPath(binaryDirectory, entry.sourceHash, api->driverHash),
+                                    entry.sourceHash, entry.vertex, entry.fragment);
+
+    if (entry.program) {
+        entry.timings.fromBinary = true;
+    } else {
+        entry.shaderVertex = startShader(GL_VERTEX_SHADER, entry.vertex);
+        entry.shaderFragment = startShader(GL_FRAGMENT_SHADER, entry.fragment);
+
+        entry.program = glCreateProgram();
+        glAttachShader(entry.program, entry.shaderVertex);
+        glAttachShader(entry.program, entry.shaderFragment);
+        if (api)
+            api->programParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(entry.program);
+    }
+
+    entry.pending = true;
+    entry.timings.submitSeconds += secondsSince(begin);
+}
+
+// Waits for a started entry's program and tidies up after it. Returns false
+// (with entry.program 0) if it didn't link; a binary the driver turns down
+// is built again from source first.
+bool ShaderCache::finish(Entry & entry)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    GLint linkStatus;
+    glGetProgramiv(entry.program, GL_LINK_STATUS, &linkStatus);
+    entry.timings.waitSeconds += secondsSince(begin);
+    entry.pending = false;
+
+    if (entry.timings.fromBinary) {
+        if (linkStatus != GL_FALSE) {
+            entry.uniforms = UniformTable(entry.program);
+            return true;
+        }
+
+        glDeleteProgram(entry.program);
+        start(entry, false);
+        return finish(entry);
+    }
+
+    // only now, if it failed, is it worth asking which step it was
+    bool linked = (linkStatus != GL_FALSE);
+    if (!linked) {
+        bool vertexCompiled = compiled(entry.shaderVertex, GL_VERTEX_SHADER);
+        bool fragmentCompiled = compiled(entry.shaderFragment, GL_FRAGMENT_SHADER);
+        if (vertexCompiled && fragmentCompiled)
+            std::cout << "Shader program :: link error\n" << programLog(entry.program);
+    }
+
+    // the program keeps what it needs; the shaders go once they're detached
+    glDetachShader(entry.program, entry.shaderVertex);
+    glDetachShader(entry.program, entry.shaderFragment);
+    glDeleteShader(entry.shaderVertex);
+    glDeleteShader(entry.shaderFragment);
+    entry.shaderVertex = entry.shaderFragment = 0;
+
+    if (!linked) {
+        glDeleteProgram(entry.program);
+        entry.program = 0;
+        return false;
+    }
+
+    entry.uniforms = UniformTable(entry.program);
+
+    const BinaryApi * api = binaryDirectory.empty() ? nullptr : binaryApi();
+    if (api)
+        saveBinary(*api, binaryPath(binaryDirectory, entry.sourceHash, api->driverHash),
+                   entry.program, entry.sourceHash, entry.vertex, entry.fragment);
+    return true;
+}
+
+GLuint ShaderCache::program(const GLchar * vertex, const GLchar * fragment)
+{
+    uint64_t key = keyFor(vertex, fragment);
+    auto it = programs.find(key);
+    if (it != programs.end()) {
+        Entry & entry = it->second;
+        if (!entry.pending) {
+            cacheHits++;
+            return entry.program;
+        }
+
+        // started by prepare()
+        if (!finish(entry)) {
+            programs.erase(it);
+            return 0;
+        }
+        builds++;
+        return entry.program;
+    }
+
+    Entry entry = Entry();
+    entry.vertex = vertex;
+    entry.fragment = fragment;
+    entry.sourceHash = hashSources(vertex, fragment);
+    start(entry, true);
+    if (!finish(entry))
+        return 0;
+
+    builds++;
+    return programs.emplace(key, std::move(entry)).first->second.program;
+}
+
+void ShaderCache::prepare(const GLchar * vertex, const GLchar * fragment)
+{
+    uint64_t key = keyFor(vertex, fragment);
+    if (programs.find(key) != programs.end())
+        return;
+
+    Entry entry = Entry();
+    entry.vertex = vertex;
+    entry.fragment = fragment;
+    entry.sourceHash = hashSources(vertex, fragment);
+    start(entry, true);
+    programs.emplace(key, std::move(entry));
+}
+
+bool ShaderCache::ready(const GLchar * vertex, const GLchar * fragment)
+{
+    auto it = programs.find(keyFor(vertex, fragment));
+    if (it == programs.end() || !it->second.pending || !parallelCompile())
+        return true;
+
+    GLint completionStatus = GL_TRUE;
+    glGetProgramiv(it->second.program, GL_COMPLETION_STATUS_KHR, &completionStatus);
+    return completionStatus != GL_FALSE;
+}
+
+bool ShaderCache::timings(const GLchar * vertex, const GLchar * fragment,
+                          ShaderTimings & timings) const
+{
+    auto it = programs.find(keyFor(vertex, fragment));
+    if (it == programs.end())
+        return false;
+
+    timings = it->second.timings;
+    return true;
+}
+
+UniformTable & ShaderCache::uniforms(GLuint program)
+{
+    for (auto & it : programs)
+        if (program && it.second.program == program && !it.second.pending)
+            return it.second.uniforms;
+
+    static UniformTable none;
+    return none;
+}
+
+void ShaderCache::clear()
+{
+    for (auto & it : programs) {
+        glDeleteShader(it.second.shaderVertex); // still there if pending
+        glDeleteShader(it.second.shaderFragment);
+        glDeleteProgram(it.second.program);
+    }
+    programs.clear();
+}
+
+ShaderCache & ShaderCache::shared()
+{
+    static ShaderCache cache;
+    return cache;
+}
+
+// -------------- loadProgram
+
+GLuint loadProgram(const GLchar * vertex, const GLchar * fragment)
+{
+    ShaderCache & cache = ShaderCache::shared();
+    unsigned hits = cache.hits();
+
+    GLuint program = cache.program(vertex, fragment);
+    if (!program)
+        return 0;
+
+    ShaderTimings timings;
+    if (cache.hits() != hits) {
+        std::cout << "Shader :: program " << program << " from cache\n";
+    } else if (cache.timings(vertex, fragment, timings)) {
+        std::cout << "Shader :: program " << program
+                  << (timings.fromBinary ? " loaded from its binary in " : " built in ")
+                  << (timings.submitSeconds + timings.waitSeconds) * 1000 << " ms ("
+                  << timings.waitSeconds * 1000 << " ms of it waiting)\n";
+    }
+    return program;
+}
+
+// -------------- FrameUniforms
+
+#ifndef GL_UNIFORM_BUFFER
+#define GL_UNIFORM_BUFFER 0x8A11
+#endif
+#ifndef GL_INVALID_INDEX
+#define GL_INVALID_INDEX 0xFFFFFFFFu
+#endif
+
+typedef GLuint (APIENTRY * GetUniformBlockIndexFn)(GLuint program, const GLchar * name);
+typedef void (APIENTRY * UniformBlockBindingFn)(GLuint program, GLuint index, GLuint binding);
+typedef void (APIENTRY * BindBufferBaseFn)(GLenum target, GLuint index, GLuint buffer);
+
+struct BlockApi {
+    GetUniformBlockIndexFn getUniformBlockIndex;
+    UniformBlockBindingFn uniformBlockBinding;
+    BindBufferBaseFn bindBufferBase;
+};
+
+// The entry points, or nullptr if the driver has no uniform blocks (GL 3.1,
+// or GL_ARB_uniform_buffer_object before it). Looked up once.
+static const BlockApi * blockApi()
+{
+    static BlockApi api;
+    static bool checked = false;
+    static bool available = false;
+    if (checked)
+        return available ? &api : nullptr;
+    checked = true;
+
+    if (!versionAtLeast(3, 1) && !hasExtension("GL_ARB_uniform_buffer_object"))
+        return nullptr;
+
+    api.getUniformBlockIndex = (GetUniformBlockIndexFn)glfwGetProcAddress("glGetUniformBlockIndex");
+    api.uniformBlockBinding = (UniformBlockBindingFn)glfwGetProcAddress("glUniformBlockBinding");
+    api.bindBufferBase = (BindBufferBaseFn)glfwGetProcAddress("glBindBufferBase");
+    if (!api.getUniformBlockIndex || !api.uniformBlockBinding || !api.bindBufferBase)
+        return nullptr;
+
+    available = true;
+    return &api;
+}
+
+FrameUniforms::FrameUniforms(bool block)
+{
+    const BlockApi * api = block ? blockApi() : nullptr;
+    if (!api)
+        return;
+
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Data), &data, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    api->bindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+}
+
+// The GLSL version a shader asks for, 110 (GLSL's default) without #version.
+static int glslVersion(const GLchar * shader)
+{
+    const char * version = strstr(shader, "#version");
+    int number = 110;
+    if (version)
+        sscanf(version + strlen("#version"), "%d", &number);
+    return number;
+}
+
+// Whether both shaders can declare the block: GLSL 1.40 has them, older
+// GLSL only through the extension.
+bool FrameUniforms::blockFor(const GLchar * vertex, const GLchar * fragment) const
+{
+    if (!usingBlock())
+        return false;
+    if (glslVersion(vertex) >= 140 && glslVersion(fragment) >= 140)
+        return true;
+    return hasExtension("GL_ARB_uniform_buffer_object");
+}
+
+std::string FrameUniforms::source(const GLchar * shader, bool block) const
+{
+    // GLSL wants #version first, and #extension before any declaration
+    std::string text = shader;
+    size_t version = text.find("#version");
+    size_t at = version == std::string::npos ? 0 : text.find('\n', version);
+    at = at == std::string::npos ? text.size() : at + 1;
+
+    if (block)
+        text.insert(at, std::string(glslVersion(shader) < 140 ?
+                        "#extension GL_ARB_uniform_buffer_object : enable\n" : "") +
+                        "layout(std140) uniform FrameData { mat4 view; mat4 projection; float time; };\n");
+    else
+        text.insert(at, "uniform mat4 view;\n"
+                        "uniform mat4 projection;\n"
+                        "uniform float time;\n");
+    return text;
+}
+
+void FrameUniforms::prepare(const GLchar * vertex, const GLchar * fragment)
+{
+    bool block = blockFor(vertex, fragment);
+    ShaderCache::shared().prepare(source(vertex, block).c_str(), source(fragment, block).c_str());
+}
+
+GLuint FrameUniforms::program(const GLchar * vertex, const GLchar * fragment)
+{
+    bool block = blockFor(vertex, fragment);
+    GLuint result = loadProgram(source(vertex, block).c_str(), source(fragment, block).c_str());
+    if (!result && block) {
+        std::cout << "Shader :: building it again with plain uniforms for the frame\n";
+        result = loadProgram(source(vertex, false).c_str(), source(fragment, false).c_str());
+    }
+    if (result)
+        known(result);
+    return result;
+}
+
+void FrameUniforms::set(GLfloat time, const GLfloat * view, const GLfloat * projection)
+{
+    Data next = data;
+    memcpy(next.view, view, sizeof(next.view));
+    memcpy(next.projection, projection, sizeof(next.projection));
+    next.time = time;
+    if (memcmp(&next, &data, sizeof(Data)) == 0)
+        return;
+
+    data = next;
+    if (usingBlock()) {
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Data), &data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        uploadCount++;
+    }
+}
+
+// The program's entry, made the first time it's seen: its block tied to the
+// binding, or, if it has none (built without, or before blocks were
+// turned on), its uniforms looked up.
+FrameUniforms::Program & FrameUniforms::known(GLuint program)
+{
+    auto it = programs.find(program);
+    if (it != programs.end())
+        return it->second;
+
+    Program entry = { false, nullptr, -1, -1, -1 };
+    if (usingBlock()) {
+        const BlockApi * api = blockApi();
+        GLuint index = api->getUniformBlockIndex(program, "FrameData");
+        if (index != GL_INVALID_INDEX) {
+            api->uniformBlockBinding(program, index, binding);
+            entry.block = true;
+        }
+    }
+    if (!entry.block) {
+        entry.uniforms = &ShaderCache::shared().uniforms(program);
+        entry.time = entry.uniforms->find("time");
+        entry.view = entry.uniforms->find("view");
+        entry.projection = entry.uniforms->find("projection");
+    }
+    return programs.emplace(program, entry).first->second;
+}
+
+void FrameUniforms::use(GLuint program)
+{
+    glUseProgram(program);
+    if (!program)
+        return;
+
+    Program & entry = known(program);
+    if (entry.block)
+        return;
+
+    // the table skips whatever this program already has
+    UniformTable & uniforms = *entry.uniforms;
+    unsigned before = uniforms.uploads();
+    uniforms.set(entry.time, data.time);
+    uniforms.setMatrix(entry.view, data.view);
+    uniforms.setMatrix(entry.projection, data.projection);
+    uploadCount += uniforms.uploads() - before;
+}
@@ -0,0 +1,267 @@
+#ifndef SHADER_PROGRAM_H
+#define SHADER_PROGRAM_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <GLFW/glfw3.h>
+
+// Compiles and links a vertex + fragment shader pair into a GL program, the
+// way every chapter used to by hand, and remembers the result.
+//
+// Programs are keyed by a hash of both sources, so asking for the same pair
+// again (say, vertex120 and raster120 from two places) hands back the
+// program already linked instead of compiling it a second time. The sources
+// are kept alongside, so two pairs that happen to hash alike are still told
+// apart (the second one just goes under the next key along).
+//
+// Linked programs are also saved to disk as program binaries (where the
+// driver supports glGetProgramBinary, GL 4.1 or GL_ARB_get_program_binary),
+// one file per program in a cache directory, shadercache/ by default. The
+// file is named after a hash of the sources and of the GL vendor, renderer
+// and version, so a new driver just misses and the name doesn't depend on
+// which programs were asked for first. Its header repeats both hashes plus
+// one of the binary, and the sources themselves come next, compared in full
+// before the binary is used. The next run hands the binary straight to
+// glProgramBinary instead of compiling; if the file doesn't match, or the
+// driver turns the binary down (which it may at any time), the sources are
+// compiled as usual and the file is written again.
+//
+// Nothing waits on the driver until the program is actually needed: both
+// shaders are compiled and the program linked without asking for any
+// status in between, and only the link status is checked (the compile
+// statuses and logs are only looked at if that failed). With prepare(), the
+// building starts early and program() collects it later, so the driver can
+// compile while the caller gets on with other things, such as uploading
+// buffers or waiting on a TextureLoader. Drivers with
+// GL_KHR_parallel_shader_compile are asked to use as many threads as they
+// like, and ready() can then tell whether program() would still wait.
+//
+// Programs belong to the GL context that was current when they were built;
+// everything here has to be called on that context's thread, with it
+// current. Nothing is deleted until clear(), since the cache can't know
+// when the context goes away.
+
+// The active uniforms of one linked program, listed once from
+// GL_ACTIVE_UNIFORMS when it's linked, each with the value last set on it
+// through here. Setting a uniform to the value it already has skips the
+// glUniform*() call altogether, so a render loop can set everything every
+// frame and only pay for what changed.
+//
+// Uniforms are looked up by name once, with find(), and set by the index it
+// returns; -1 (not an active uniform, e.g. misspelled or optimized away) is
+// quietly ignored, as glUniform*() ignores location -1. Like glUniform*(),
+// setting needs the program in use (glUseProgram). A uniform set some other
+// way, or a program linked again, leaves the table out of date; call
+// forget() then.
+
+class UniformTable {
+public:
+    UniformTable() = default;
+    explicit UniformTable(GLuint program);
+
+    // the uniform's index, or -1 if the program has no such active uniform
+    // (arrays answer to their plain name, without the [0])
+    int find(const char * name) const;
+
+    int count() const { return (int)uniforms.size(); }
+    const std::string & name(int uniform) const { return uniforms[uniform].name; }
+    GLint location(int uniform) const { return uniforms[uniform].location; }
+    GLenum type(int uniform) const { return uniforms[uniform].type; }
+
+    void set(int uniform, GLfloat x);
+    void set(int uniform, GLfloat x, GLfloat y);
+    void set(int uniform, GLfloat x, GLfloat y, GLfloat z);
+    void set(int uniform, GLfloat x, GLfloat y, GLfloat z, GLfloat w);
+    void set(int uniform, GLint x); // ints, bools and samplers
+    void setMatrix(int uniform, const GLfloat * matrix); // one mat4, column-major
+
+    // makes the next set() of every uniform go through to GL
+    void forget();
+
+    // glUniform*() calls made and skipped since resetCounters(), e.g. a
+    // frame's worth
+    unsigned uploads() const { return uploadCount; }
+    unsigned skipped() const { return skipCount; }
+    void resetCounters() { uploadCount = skipCount = 0; }
+
+private:
+    struct Uniform {
+        std::string name;
+        GLint location;
+        GLenum type;
+        bool known;              // whether value holds what GL has
+        unsigned char value[64]; // as last set, up to a mat4
+    };
+
+    bool changed(int uniform, const void * value, size_t size);
+
+    std::vector<Uniform> uniforms;
+    unsigned uploadCount = 0;
+    unsigned skipCount = 0;
+};
+
+// What it took to build one program, on the calling thread.
+struct ShaderTimings {
+    double submitSeconds; // handing the sources (or binary) to the driver
+    double waitSeconds;   // then waiting for the link status
+    bool fromBinary;      // loaded from disk, no compile
+};
+
+class ShaderCache {
+public:
+    ShaderCache() = default;
+
+    ShaderCache(const ShaderCache &) = delete;
+    ShaderCache & operator=(const ShaderCache &) = delete;
+
+    // The linked program for this pair of sources, built the first time
+    // it's asked for (or collected, after prepare()). Returns 0 if either
+    // shader fails to compile or the program fails to link; the failure is
+    // printed (whole info log) to std::cout, and isn't remembered, so asking
+    // again tries again.
+    GLuint program(const GLchar * vertex, const GLchar * fragment);
+
+    // Starts building the program for this pair of sources, without waiting
+    // for any of it; program() picks it up from there. Does nothing if it's
+    // already built or started.
+    void prepare(const GLchar * vertex, const GLchar * fragment);
+
+    // Whether program() would have the result without waiting on the
+    // driver. Always true without GL_KHR_parallel_shader_compile, since
+    // there's then no asking without waiting.
+    bool ready(const GLchar * vertex, const GLchar * fragment);
+
+    // How long the program for this pair took to build; false if it's not
+    // in the cache.
+    bool timings(const GLchar * vertex, const GLchar * fragment, ShaderTimings & timings) const;
+
+    // The uniform table of a program the cache built, made when it was
+    // linked, which stays where it is until clear(); one that's always
+    // empty for any other program.
+    UniformTable & uniforms(GLuint program);
+
+    // how many programs were built, and how many requests the cache answered
+    unsigned built() const { return builds; }
+    unsigned hits() const { return cacheHits; }
+
+    // Where program binaries go between runs; "" turns them off. The
+    // directory is created the first time a binary is saved.
+    void setBinaryDirectory(const std::string & directory) { binaryDirectory = directory; }
+
+    // deletes every program; the context they were built on must be current
+    void clear();
+
+    // the cache shared by the whole process
+    static ShaderCache & shared();
+
+private:
+    struct Entry {
+        std::string vertex;
+        std::string fragment;
+        uint64_t sourceHash;   // hashSources(), which names the binary file
+        GLuint program;
+        GLuint shaderVertex;   // while a build from source is pending
+        GLuint shaderFragment;
+        bool pending;          // started, but not checked on yet
+        ShaderTimings timings;
+        UniformTable uniforms;
+    };
+
+    uint64_t keyFor(const GLchar * vertex, const GLchar * fragment) const;
+    void start(Entry & entry, bool fromBinary);
+    bool finish(Entry & entry);
+
+    std::unordered_map<uint64_t, Entry> programs;
+    std::string binaryDirectory = "shadercache";
+    unsigned builds = 0;
+    unsigned cacheHits = 0;
+};
+
+// ShaderCache::shared().program(vertex, fragment), which also prints how
+// long the program took to build or load, or that it came from the cache.
+GLuint loadProgram(const GLchar * vertex, const GLchar * fragment);
+
+// The values every program needs once per frame, time, view and projection,
+// kept in one std140 uniform block:
+//
+//     layout(std140) uniform FrameData { mat4 view; mat4 projection; float time; };
+//
+// in one uniform buffer on binding point FrameUniforms::binding. set()
+// writes the buffer once a frame, however many programs read it, and use()
+// makes a program current with its block tied to that binding.
+//
+// Where the driver has no uniform blocks (GL 3.1, or
+// GL_ARB_uniform_buffer_object; the legacy contexts on macOS go without), or
+// when turned off to compare, the same three are plain uniforms instead, and
+// use() sets them on each program through its UniformTable, so the values go
+// up once per program. The same goes for a pair of shaders whose GLSL can't
+// declare the block: #version 140 and up can, older ones only where the
+// driver lists GL_ARB_uniform_buffer_object. prepare() and program() build
+// shaders with whichever declarations apply added just after their #version
+// line, so the shaders just use view, projection and time without declaring
+// them; a pair that fails to build with the block is built again without.
+//
+// The buffer belongs to the GL context current when this was made, and is
+// left to go with it. What's looked up for each program holds on to its
+// UniformTable, so a FrameUniforms mustn't outlive a ShaderCache::clear().
+
+class FrameUniforms {
+public:
+    static const GLuint binding = 0;
+
+    // block false sticks to plain uniforms even where blocks are available
+    explicit FrameUniforms(bool block = true);
+
+    FrameUniforms(const FrameUniforms &) = delete;
+    FrameUniforms & operator=(const FrameUniforms &) = delete;
+
+    bool usingBlock() const { return buffer != 0; }
+
+    // ShaderCache::shared().prepare() for this pair of shaders, with the
+    // frame's declarations added
+    void prepare(const GLchar * vertex, const GLchar * fragment);
+
+    // loadProgram() for this pair of shaders, with the frame's declarations
+    // added; collects what prepare() started, and looks up its block or its
+    // uniforms then, so use() has nothing left to look up. 0 if it fails to
+    // build either way.
+    GLuint program(const GLchar * vertex, const GLchar * fragment);
+
+    // this frame's values; view and projection are mat4s, column-major
+    void set(GLfloat time, const GLfloat * view, const GLfloat * projection);
+
+    // glUseProgram(program), with the frame's values in place for it; a
+    // program that didn't come from program() is looked up the first time
+    void use(GLuint program);
+
+    // buffer writes or glUniform*() calls made since resetCounters()
+    unsigned uploads() const { return uploadCount; }
+    void resetCounters() { uploadCount = 0; }
+
+private:
+    struct Data {               // std140: each mat4 four vec4 columns
+        GLfloat view[16];       // offset 0
+        GLfloat projection[16]; // offset 64
+        GLfloat time;           // offset 128
+        GLfloat padding[3];     // blocks round up to a vec4
+    };
+
+    struct Program {
+        bool block;                 // reads the buffer through FrameData
+        UniformTable * uniforms;    // ShaderCache's, without a block
+        int time, view, projection; // indices into uniforms
+    };
+
+    bool blockFor(const GLchar * vertex, const GLchar * fragment) const;
+    std::string source(const GLchar * shader, bool block) const;
+    Program & known(GLuint program);
+
+    Data data = Data();     // as in the buffer, if there is one
+    GLuint buffer = 0;
+    std::unordered_map<GLuint, Program> programs;
+    unsigned uploadCount = 0;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <string>
 #include <GLFW/glfw3.h>
 #include <math.h>
+#include "ShaderProgram.h"
 
 // 1.50 in out
 
@@ -102,75 +103,14 @@ int main() {
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
 
-    // file io
-    const char* source;
-
-//    std::ifstream file;
-//    std::string fileText;
-//
-//    try {
-//        file.open("vertex_shader.txt", std::ios::binary);
-//        if (file.is_open()) {
-//            file >> fileText;
-//            source = fileText.c_str();
-//        } else {
-//            std::cout << "file is not open";
-//            exit(1);
-//        }
-//    } catch (...) {
-//        std::cout << "file error";
-//        exit(1);
-//    }
-    
-    source = vertex120;
-    
-    // OGL setup
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-
-    GLint compilationStatus;
+    // shaders, compiled and linked by ShaderProgram.h
     
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-
-//    // file io
-//    file.open("fragment_shader.txt");
-//    file >> fileText;
-//    source = fileText.c_str();
-    source = raster120;
-
-    // OGL setup
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
+    GLuint shaderProgram = loadProgram(vertex120, raster120);
+    if (!shaderProgram)
         exit(1);
-    }
-
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    GLint linkStatus;
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
-        exit(1);
-    }
     
     glUseProgram(shaderProgram);
+    UniformTable & uniforms = ShaderCache::shared().uniforms(shaderProgram);
     
     // VBO
     
@@ -213,7 +153,7 @@ int main() {
 
     // uniforms
     
-    GLuint attributeMatrix = glGetUniformLocation(shaderProgram, "matrix");
+    int uniformMatrix = uniforms.find("matrix");
     
     const GLfloat matrix[] = {
         0.5,0,0,0,
@@ -222,7 +162,7 @@ int main() {
         0,0,0,1
     };
     
-    glUniformMatrix4fv(attributeMatrix, 1, GL_FALSE, matrix);
+    uniforms.setMatrix(uniformMatrix, matrix);
     
     // render loop
     while (!glfwWindowShouldClose(window))
@@ -247,7 +187,7 @@ int main() {
     glDeleteBuffers(1, &vertexBuffer);
     glDeleteBuffers(1, &colorBuffer);
     //glDeleteVertexArrays(1, &vertex_array);
-    glDeleteProgram(shaderProgram);
+    ShaderCache::shared().clear();
     
     glfwTerminate();
 }
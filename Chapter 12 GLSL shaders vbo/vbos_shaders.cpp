@@ -3,6 +3,7 @@
 #include <string>
 #include <GLFW/glfw3.h>
 #include <math.h>
+#include "ShaderProgram.h"
 #define GL_SILENCE_DEPRECATION 1
 
 // vertex shader source
@@ -58,54 +59,11 @@ int main()
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
     
-    const char* source;
-    GLint compilationStatus;
-    
-    // ------------- VERTEX SHADER
-    
-    source = vertex120;
-    
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-    
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
-    // ---------- FRAGMENT SHADER
-    
-    source = raster120;
-    
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
     // ------------- SHADER PROGRAM
     
-    GLint linkStatus;
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
+    GLuint shaderProgram = loadProgram(vertex120, raster120);
+    if (!shaderProgram)
         exit(1);
-    }
     
     glUseProgram(shaderProgram);
     
@@ -0,0 +1,792 @@
+// Benchmarks for bmpread and the texture modules built on it.
+//
+//     ./bench            runs every case
+//     ./bench mem ...    runs just the cases named
+//     ./bench list       lists them
+//
+// Built with BENCH_SHADERS (make bench-gl, which needs GLFW), there's also
+// a shaders case, for the shader cache in chapter 11.
+//
+// Bitmaps are generated (see SyntheticBitmap.h) into the current directory
+// and removed afterwards, so run it somewhere with a few hundred MB free.
+// Times are the best of as many runs as fit in about a third of a second,
+// which keeps the noise of a busy machine out of the numbers. The cases also
+// check their output as they go, and it exits with 1 if any check failed.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bmpread.h"
+#include "SyntheticBitmap.h"
+#include "TextureCache.h"
+#include "TextureCompress.h"
+#include "TextureLoader.h"
+
+#ifdef BENCH_SHADERS
+#include <dirent.h>
+#include "ShaderProgram.h"
+#endif
+
+// -------------- timing
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// best time of one call to run, in seconds
+static double bestOf(const std::function<void()> & run, double budget = 0.3)
+{
+    double best = 1e30;
+    auto start = std::chrono::steady_clock::now();
+    int runs = 0;
+    do {
+        auto one = std::chrono::steady_clock::now();
+        run();
+        double seconds = secondsSince(one);
+        if (seconds < best)
+            best = seconds;
+        runs++;
+    } while (runs < 3 || secondsSince(start) < budget);
+    return best;
+}
+
+static void printRow(const std::string & what, double seconds, double megabytes)
+{
+    char line[160];
+    snprintf(line, sizeof(line), "  %-46s %9.3f ms %9.1f MB/s", what.c_str(), seconds * 1000,
+             megabytes / seconds);
+    std::cout << line << "\n";
+}
+
+// the bytes of each line's pixels, without the padding after them
+static bool samePixels(const bmpread_t & a, const bmpread_t & b)
+{
+    if (a.width != b.width || a.height != b.height || a.flags != b.flags)
+        return false;
+
+    size_t pixels = (size_t)a.width * ((a.flags & BMPREAD_ALPHA) ? 4 : 3);
+    size_t line = (a.flags & BMPREAD_BYTE_ALIGN) ? pixels : (pixels + 3) & ~(size_t)3;
+    for (int y = 0; y < a.height; y++)
+        if (memcmp(a.data + y * line, b.data + y * line, pixels) != 0)
+            return false;
+    return true;
+}
+
+static volatile unsigned sink; // keeps reads the compiler would drop
+
+static int failures; // checks that failed, for the exit status
+
+// Reads one byte per cache line, which is enough to have the pages of a
+// mapping read in, as uploading them would.
+static void touch(const unsigned char * data, size_t size)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < size; i += 64)
+        sum += data[i];
+    sink = sum;
+}
+
+static BitmapSpec spec(int width, int height, int bits)
+{
+    BitmapSpec result = { width, height, bits, false, { 0, 0, 0, 0 } };
+    return result;
+}
+
+// -------------- mem: bmpread() against bmpread_mem() and bmpread_mmap()
+
+static void benchMem(const std::string & path, const std::vector<unsigned char> & contents)
+{
+    bmpread_t reference;
+    if (!bmpread(path.c_str(), BMPREAD_ANY_SIZE, &reference)) {
+        std::cout << "  " << path << ": not a bitmap bmpread() takes, skipped\n";
+        return;
+    }
+
+    bmpread_t fromMem = {}, fromMap = {};
+    bool same = bmpread_mem(contents.data(), contents.size(), BMPREAD_ANY_SIZE, &fromMem) &&
+                bmpread_mmap(path.c_str(), BMPREAD_ANY_SIZE, &fromMap) &&
+                samePixels(reference, fromMem) && samePixels(reference, fromMap);
+    std::cout << "  " << path << ", " << reference.width << "x" << reference.height
+              << (same ? ": output identical\n" : ": OUTPUT DIFFERS\n");
+    failures += !same;
+    bmpread_free(&reference);
+    bmpread_free(&fromMem);
+    bmpread_free(&fromMap);
+
+    double megabytes = contents.size() / 1e6;
+    printRow("bmpread()", bestOf([&] {
+        bmpread_t bitmap;
+        bmpread(path.c_str(), BMPREAD_ANY_SIZE, &bitmap);
+        bmpread_free(&bitmap);
+    }), megabytes);
+    printRow("bmpread_mmap()", bestOf([&] {
+        bmpread_t bitmap;
+        bmpread_mmap(path.c_str(), BMPREAD_ANY_SIZE, &bitmap);
+        bmpread_free(&bitmap);
+    }), megabytes);
+    printRow("bmpread_mem(), already in memory", bestOf([&] {
+        bmpread_t bitmap;
+        bmpread_mem(contents.data(), contents.size(), BMPREAD_ANY_SIZE, &bitmap);
+        bmpread_free(&bitmap);
+    }), megabytes);
+}
+
+static void caseMem()
+{
+    std::vector<unsigned char> contents;
+    if (FILE * fp = fopen("texture.bmp", "rb")) {
+        unsigned char buffer[65536];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+            contents.insert(contents.end(), buffer, buffer + got);
+        fclose(fp);
+        benchMem("texture.bmp", contents);
+    }
+
+    const int sizes[] = { 256, 1024, 4096 };
+    for (int size : sizes) {
+        std::string path = "bench-" + std::to_string(size) + ".bmp";
+        contents = makeBitmap(spec(size, size, 24));
+        if (writeFile(path, contents))
+            benchMem(path, contents);
+        remove(path.c_str());
+    }
+}
+
+// -------------- cooked: the texture cache, cold and warm
+
+// whether every level of a and b holds the same pixels, and blocks
+static bool sameLevels(const CookedTexture & a, const CookedTexture & b)
+{
+    if (!a.loaded() || !b.loaded() || a.levels() != b.levels())
+        return false;
+
+    for (int level = 0; level < a.levels(); level++)
+        if (memcmp(a.data(level), b.data(level), a.lineLength(level) * a.height(level)) != 0 ||
+            a.blocksSize(level) != b.blocksSize(level) ||
+            memcmp(a.blocks(level), b.blocks(level), a.blocksSize(level)) != 0)
+            return false;
+    return true;
+}
+
+static void caseCooked()
+{
+    const unsigned workers = 4;
+
+    const int sizes[] = { 512, 2048, 4096 };
+    for (int size : sizes) {
+        std::string path = "bench-cooked-" + std::to_string(size) + ".bmp";
+        std::string sidecar = path + ".cooked";
+        std::vector<unsigned char> contents = makeBitmap(spec(size, size, 24));
+        if (!writeFile(path, contents))
+            continue;
+        std::cout << "  " << size << "x" << size << ", 24-bit\n";
+
+        // the mips made in bands on a few workers, against one thread
+        for (unsigned flags : { BMPREAD_ANY_SIZE, BMPREAD_ANY_SIZE | BMPREAD_ALPHA,
+                                BMPREAD_ANY_SIZE | CookedTexture::Blocks,
+                                BMPREAD_ANY_SIZE | BMPREAD_ALPHA | CookedTexture::Blocks }) {
+            remove(sidecar.c_str());
+            CookedTexture serial;
+            serial.load(path, flags);
+            remove(sidecar.c_str());
+            TextureLoader loader(workers);
+            CookedTexture parallel = loader.loadCooked(path, flags).get();
+            if (!sameLevels(serial, parallel)) {
+                std::cout << "  MIPS DIFFER on " << workers << " workers"
+                          << ((flags & BMPREAD_ALPHA) ? ", RGBA" : ", RGB")
+                          << ((flags & CookedTexture::Blocks) ? ", blocks\n" : "\n");
+                failures++;
+            }
+        }
+
+        double megabytes = contents.size() / 1e6;
+        printRow("bmpread(), level 0 only", bestOf([&] {
+            bmpread_t bitmap;
+            bmpread(path.c_str(), BMPREAD_ANY_SIZE, &bitmap);
+            bmpread_free(&bitmap);
+        }), megabytes);
+
+        // cold: no sidecar, so decode, build the mips and write it
+        bool cooked = true;
+        printRow("CookedTexture::load(), cold", bestOf([&] {
+            remove(sidecar.c_str());
+            CookedTexture texture;
+            cooked &= texture.load(path, BMPREAD_ANY_SIZE) && !texture.cacheHit();
+        }), megabytes);
+
+        printRow("CookedTexture::load(), cold, BC1 too", bestOf([&] {
+            remove(sidecar.c_str());
+            CookedTexture texture;
+            texture.load(path, BMPREAD_ANY_SIZE | CookedTexture::Blocks);
+        }), megabytes);
+
+        // warm: map the sidecar that's there, once there's one without blocks
+        CookedTexture().load(path, BMPREAD_ANY_SIZE);
+        bool hit = true;
+        printRow("CookedTexture::load(), warm", bestOf([&] {
+            CookedTexture texture;
+            hit &= texture.load(path, BMPREAD_ANY_SIZE) && texture.cacheHit();
+        }), megabytes);
+        printRow("CookedTexture::load(), warm, all read", bestOf([&] {
+            CookedTexture texture;
+            texture.load(path, BMPREAD_ANY_SIZE);
+            for (int level = 0; level < texture.levels(); level++)
+                touch(texture.data(level), texture.lineLength(level) * texture.height(level));
+        }), megabytes);
+
+        // the way a program starts up: a loader, one texture, waiting for it
+        printRow("TextureLoader startup, cold", bestOf([&] {
+            remove(sidecar.c_str());
+            TextureLoader loader;
+            loader.loadCooked(path, BMPREAD_ANY_SIZE).get();
+        }), megabytes);
+        printRow("TextureLoader startup, warm", bestOf([&] {
+            TextureLoader loader;
+            loader.loadCooked(path, BMPREAD_ANY_SIZE).get();
+        }), megabytes);
+        printRow("TextureLoader(" + std::to_string(workers) + ") startup, cold", bestOf([&] {
+            remove(sidecar.c_str());
+            TextureLoader loader(workers);
+            loader.loadCooked(path, BMPREAD_ANY_SIZE).get();
+        }), megabytes);
+
+        if (!cooked || !hit)
+            std::cout << "  (the sidecar wasn't " << (cooked ? "used" : "cooked")
+                      << " every time)\n";
+        remove(sidecar.c_str());
+        remove(path.c_str());
+    }
+}
+
+// -------------- compress: BC1 and BC3 at each quality, and their round trip
+
+// below this, a smooth image has come back from its blocks wrong, not lossy
+static const double minimumPsnr = 35;
+
+// a smooth image, as a texture would mostly be: gradients with a little
+// noise on them, and an alpha ramp for BC3 to keep
+static std::vector<unsigned char> smoothPixels(int width, int height, int channels)
+{
+    std::vector<unsigned char> pixels((size_t)width * height * channels);
+    uint32_t state = 1;
+    unsigned char * p = pixels.data();
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++, p += channels) {
+            int noise = (int)(nextRandom(state) % 9) - 4;
+            int values[4] = { x * 255 / width, y * 255 / height,
+                              (x + y) * 255 / (width + height), 255 - y * 255 / height };
+            for (int c = 0; c < channels; c++)
+                p[c] = (unsigned char)std::max(0, std::min(255, values[c] + (c < 3 ? noise : 0)));
+        }
+    }
+    return pixels;
+}
+
+// PSNR of blocks decoded with decompressBlocks() against the pixels they
+// came from, over the channels the format keeps
+static double roundTripPsnr(const std::vector<unsigned char> & pixels, int width, int height,
+                            int channels, const std::vector<unsigned char> & blocks,
+                            BlockFormat format)
+{
+    std::vector<unsigned char> decoded = decompressBlocks(blocks.data(), width, height, format);
+    int compared = (format == BlockFormat::BC3) ? 4 : 3;
+    double squares = 0;
+    for (size_t i = 0; i < (size_t)width * height; i++)
+        for (int c = 0; c < compared; c++) {
+            int difference = pixels[i * channels + c] - decoded[i * 4 + c];
+            squares += difference * difference;
+        }
+
+    double mse = squares / ((double)width * height * compared);
+    return (mse > 0) ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+static void caseCompress()
+{
+    struct Format {
+        const char * name;
+        BlockFormat format;
+        int channels;
+    };
+    const Format formats[] = { { "BC1", BlockFormat::BC1, 3 }, { "BC3", BlockFormat::BC3, 4 } };
+    const struct {
+        const char * name;
+        CompressQuality quality;
+    } qualities[] = { { "fast", CompressQuality::Fast }, { "normal", CompressQuality::Normal },
+                      { "high", CompressQuality::High } };
+
+    // the last isn't a multiple of 4, so the edge blocks get padded
+    const int sizes[][2] = { { 256, 256 }, { 1024, 1024 }, { 1022, 766 } };
+    for (const auto & size : sizes) {
+        for (const Format & format : formats) {
+            std::vector<unsigned char> pixels = smoothPixels(size[0], size[1], format.channels);
+            for (const auto & quality : qualities) {
+                // the fastest of a few runs; the PSNR is the same every time
+                CompressStats best = {};
+                std::vector<unsigned char> blocks;
+                for (int run = 0; run < 3; run++) {
+                    CompressStats stats = {};
+                    blocks = compressBlocks(pixels.data(), size[0], size[1],
+                                            (size_t)size[0] * format.channels, format.channels,
+                                            format.format, quality.quality, 0, &stats);
+                    if (stats.megapixelsPerSecond > best.megapixelsPerSecond)
+                        best = stats;
+                }
+
+                char line[160];
+                snprintf(line, sizeof(line), "  %-46s %9.1f MP/s %9.2f dB",
+                         (std::string(format.name) + " " + quality.name + ", " +
+                          std::to_string(size[0]) + "x" + std::to_string(size[1])).c_str(),
+                         best.megapixelsPerSecond, best.psnr);
+                std::cout << line << "\n";
+
+                double psnr = roundTripPsnr(pixels, size[0], size[1], format.channels, blocks,
+                                            format.format);
+                if (psnr < minimumPsnr) {
+                    std::cout << "  ROUND TRIP BELOW " << minimumPsnr << " dB\n";
+                    failures++;
+                }
+            }
+        }
+    }
+}
+
+// -------------- raw: bmpread_raw() against decoding with bmpread()
+
+static void caseRaw()
+{
+    const int sizes[] = { 512, 4096 };
+    for (int size : sizes) {
+        std::string path = "bench-raw-" + std::to_string(size) + ".bmp";
+        std::vector<unsigned char> contents = makeBitmap(spec(size, size, 24));
+        if (!writeFile(path, contents))
+            continue;
+
+        // the raw pixels are BGR, with the file's padding; compare them as such
+        bmpread_raw_t raw;
+        bmpread_t bitmap = {};
+        bool same = bmpread_raw(path.c_str(), BMPREAD_ANY_SIZE, &raw) &&
+                    bmpread(path.c_str(), BMPREAD_ANY_SIZE, &bitmap);
+        for (int y = 0; same && y < size; y++) {
+            const unsigned char * line = raw.data + y * raw.line_len;
+            const unsigned char * rgb = bitmap.data + (size_t)y * size * 3;
+            for (int x = 0; same && x < size; x++)
+                same = line[x * 3] == rgb[x * 3 + 2] && line[x * 3 + 1] == rgb[x * 3 + 1] &&
+                       line[x * 3 + 2] == rgb[x * 3];
+        }
+        bmpread_raw_free(&raw);
+        bmpread_free(&bitmap);
+        std::cout << "  " << size << "x" << size << ", 24-bit"
+                  << (same ? ": same pixels\n" : ": PIXELS DIFFER\n");
+        failures += !same;
+
+        double megabytes = contents.size() / 1e6;
+        printRow("bmpread()", bestOf([&] {
+            bmpread_t bitmap;
+            bmpread(path.c_str(), BMPREAD_ANY_SIZE, &bitmap);
+            bmpread_free(&bitmap);
+        }), megabytes);
+        printRow("bmpread_raw()", bestOf([&] {
+            bmpread_raw_t raw;
+            bmpread_raw(path.c_str(), BMPREAD_ANY_SIZE, &raw);
+            bmpread_raw_free(&raw);
+        }), megabytes);
+        printRow("bmpread_raw(), then every cache line", bestOf([&] {
+            bmpread_raw_t raw;
+            bmpread_raw(path.c_str(), BMPREAD_ANY_SIZE, &raw);
+            touch(raw.data, raw.line_len * raw.height);
+            bmpread_raw_free(&raw);
+        }), megabytes);
+        remove(path.c_str());
+    }
+}
+
+// -------------- alloc: a batch of small loads, malloc() against an arena
+
+// Hands out blocks from one buffer, front to back, and takes nothing back
+// until reset; the way a loader might keep a batch of textures until they're
+// uploaded.
+struct Arena {
+    std::vector<unsigned char> buffer;
+    size_t used = 0;
+
+    static void * alloc(void * user, size_t size)
+    {
+        Arena * arena = (Arena *)user;
+        size = (size + 15) & ~(size_t)15;
+        if (size > arena->buffer.size() - arena->used)
+            return nullptr;
+        void * block = arena->buffer.data() + arena->used;
+        arena->used += size;
+        return block;
+    }
+};
+
+static void caseAlloc()
+{
+    const int loads = 1000;
+    const int sizes[] = { 16, 32, 64, 128 };
+
+    std::vector<std::vector<unsigned char>> files;
+    double megabytes = 0;
+    for (int i = 0; i < loads; i++) {
+        int size = sizes[i % 4];
+        if (files.size() < 16)
+            files.push_back(makeBitmap(spec(size, size, 24), i + 1));
+        megabytes += files[i % 16].size() / 1e6;
+    }
+
+    std::vector<bmpread_t> batch(loads);
+    printRow("1000 loads, malloc()", bestOf([&] {
+        for (int i = 0; i < loads; i++) {
+            const std::vector<unsigned char> & file = files[i % 16];
+            bmpread_mem(file.data(), file.size(), BMPREAD_ANY_SIZE, &batch[i]);
+        }
+        for (bmpread_t & bitmap : batch)
+            bmpread_free(&bitmap);
+    }), megabytes);
+
+    Arena arena;
+    arena.buffer.resize(64 << 20);
+    bmpread_allocator_t allocator = { Arena::alloc, nullptr, &arena };
+    bool fits = true;
+    printRow("1000 loads, arena", bestOf([&] {
+        arena.used = 0;
+        for (int i = 0; i < loads; i++) {
+            const std::vector<unsigned char> & file = files[i % 16];
+            fits &= bmpread_mem_with_allocator(file.data(), file.size(), BMPREAD_ANY_SIZE,
+                                               &allocator, &batch[i]) != 0;
+        }
+        for (bmpread_t & bitmap : batch)
+            bmpread_free(&bitmap); // no release, so this just clears it
+    }), megabytes);
+    if (!fits)
+        std::cout << "  (the arena ran out; make it bigger)\n";
+}
+
+// -------------- decode: every decoder, by bit depth and layout
+
+struct Layout {
+    const char * name;
+    int bits;
+    uint32_t masks[4];
+};
+
+// in the order SelectDecode*() picks them: palettes, the SIMD layouts, then
+// the general bitfield decoders for any other masks
+static const Layout layouts[] = {
+    { "1-bit",                    1, { 0, 0, 0, 0 } },
+    { "4-bit",                    4, { 0, 0, 0, 0 } },
+    { "8-bit",                    8, { 0, 0, 0, 0 } },
+    { "24-bit",                  24, { 0, 0, 0, 0 } },
+    { "16-bit R5G6B5",           16, { 0xf800, 0x07e0, 0x001f, 0 } },
+    { "16-bit A1R5G5B5",         16, { 0x7c00, 0x03e0, 0x001f, 0x8000 } },
+    { "32-bit X8R8G8B8",         32, { 0xff0000, 0xff00, 0xff, 0 } },
+    { "32-bit A8R8G8B8",         32, { 0xff0000, 0xff00, 0xff, 0xff000000 } },
+    { "16-bit A4R4G4B4, general", 16, { 0x0f00, 0x00f0, 0x000f, 0xf000 } },
+    { "32-bit A2R10G10B10, general", 32, { 0x3ff00000, 0xffc00, 0x3ff, 0xc0000000 } },
+    { "32-bit A8B8G8R8, general", 32, { 0xff, 0xff00, 0xff0000, 0xff000000 } },
+};
+
+static void caseDecode()
+{
+    const int sizes[][2] = { { 256, 256 }, { 1024, 1024 }, { 4000, 1000 } };
+    for (const Layout & layout : layouts) {
+        for (const auto & size : sizes) {
+            BitmapSpec bitmap = { size[0], size[1], layout.bits, false,
+                                  { layout.masks[0], layout.masks[1],
+                                    layout.masks[2], layout.masks[3] } };
+            std::vector<unsigned char> contents = makeBitmap(bitmap);
+
+            // RGBA only at the middle size, which is enough to tell it apart
+            for (unsigned flags : { BMPREAD_ANY_SIZE, BMPREAD_ANY_SIZE | BMPREAD_ALPHA }) {
+                if ((flags & BMPREAD_ALPHA) && size[0] != 1024)
+                    continue;
+
+                // MB/s of output, which is the same for every layout
+                int channels = (flags & BMPREAD_ALPHA) ? 4 : 3;
+                double megabytes = (double)size[0] * size[1] * channels / 1e6;
+                printRow(std::string(layout.name) + ", " + std::to_string(size[0]) + "x" +
+                         std::to_string(size[1]) + (channels == 4 ? ", RGBA" : ", RGB"),
+                         bestOf([&] {
+                    bmpread_t out = {};
+                    bmpread_mem(contents.data(), contents.size(), flags, &out);
+                    bmpread_free(&out);
+                }, 0.2), megabytes);
+            }
+        }
+    }
+}
+
+// -------------- palette: 1-, 4- and 8-bit bitmaps
+
+static void casePalette()
+{
+    const int bitDepths[] = { 1, 4, 8 };
+    const int sizes[] = { 1024, 4096 };
+    for (int bits : bitDepths) {
+        for (int size : sizes) {
+            std::vector<unsigned char> contents = makeBitmap(spec(size, size, bits));
+            // MB/s of output here, since the files are a fraction of its size
+            double megabytes = (double)size * size * 3 / 1e6;
+            printRow(std::to_string(size) + "x" + std::to_string(size) + ", " +
+                     std::to_string(bits) + "-bit, to RGB", bestOf([&] {
+                bmpread_t bitmap;
+                bmpread_mem(contents.data(), contents.size(), BMPREAD_ANY_SIZE, &bitmap);
+                bmpread_free(&bitmap);
+            }), megabytes);
+        }
+    }
+}
+
+// -------------- threads: BMPREAD_THREADED on 1 to 8 threads
+
+static void caseThreads()
+{
+    std::cout << "  (" << std::thread::hardware_concurrency()
+              << " CPUs here; more threads than that only shows the overhead)\n";
+
+    const int sizes[] = { 4096, 8192, 16384 };
+    for (int size : sizes) {
+        std::vector<unsigned char> contents = makeBitmap(spec(size, size, 24));
+        double megabytes = contents.size() / 1e6;
+        std::cout << "  " << size << "x" << size << ", 24-bit, from memory\n";
+
+        bmpread_t reference;
+        bmpread_set_max_threads(1);
+        if (!bmpread_mem(contents.data(), contents.size(),
+                         BMPREAD_ANY_SIZE | BMPREAD_THREADED, &reference)) {
+            std::cout << "  not enough memory, skipped\n";
+            continue;
+        }
+
+        for (unsigned threads = 1; threads <= 8; threads *= 2) {
+            bmpread_set_max_threads(threads);
+            bmpread_t bitmap;
+            bool same = bmpread_mem(contents.data(), contents.size(),
+                                    BMPREAD_ANY_SIZE | BMPREAD_THREADED, &bitmap) &&
+                        samePixels(reference, bitmap);
+            bmpread_free(&bitmap);
+            failures += !same;
+
+            printRow(std::to_string(threads) + (threads == 1 ? " thread" : " threads") +
+                     (same ? "" : " (OUTPUT DIFFERS)"), bestOf([&] {
+                bmpread_t bitmap;
+                bmpread_mem(contents.data(), contents.size(),
+                            BMPREAD_ANY_SIZE | BMPREAD_THREADED, &bitmap);
+                bmpread_free(&bitmap);
+            }), megabytes);
+        }
+        bmpread_set_max_threads(0);
+        bmpread_free(&reference);
+    }
+}
+
+// -------------- shaders: program startup, with and without the binary cache
+
+#ifdef BENCH_SHADERS
+
+static const GLchar * benchVertex = R"END(
+#version 120
+attribute vec3 position;
+attribute vec3 color;
+attribute vec2 inUvs;
+varying vec3 outColor;
+varying vec2 outUvs;
+uniform mat4 matrix;
+uniform mat4 view;
+uniform mat4 projection;
+uniform float time;
+void main()
+{
+    float co = cos(time * VARIANT);
+    float si = sin(time * VARIANT);
+    mat4 rotationY = mat4(co, 0, si, 0,  0, 1, 0, 0,  -si, 0, co, 0,  0, 0, 0, 1);
+    outUvs = inUvs;
+    outColor = color;
+    gl_Position = projection * view * matrix * rotationY * vec4(position, 1.);
+}
+)END";
+
+static const GLchar * benchFragment = R"END(
+#version 120
+varying vec3 outColor;
+varying vec2 outUvs;
+uniform sampler2D tex;
+void main()
+{
+    vec4 texel = texture2D(tex, outUvs * VARIANT);
+    gl_FragColor = vec4(outColor, 1.) / 2. + texel / 2.;
+}
+)END";
+
+// The shader with VARIANT defined just after its #version line, and a
+// comment that makes each run's sources new to every cache there is.
+static std::string variant(const GLchar * shader, int n, int run)
+{
+    std::string text = shader;
+    size_t at = text.find('\n', text.find("#version")) + 1;
+    return text.insert(at, "#define VARIANT " + std::to_string(n) + ".\n// run " +
+                           std::to_string(run) + "\n");
+}
+
+static void removeDirectory(const std::string & directory)
+{
+    if (DIR * dir = opendir(directory.c_str())) {
+        while (dirent * entry = readdir(dir))
+            if (entry->d_name[0] != '.')
+                remove((directory + "/" + entry->d_name).c_str());
+        closedir(dir);
+    }
+    remove(directory.c_str());
+}
+
+static void printStartup(const std::string & what, double seconds, int programs)
+{
+    char line[160];
+    snprintf(line, sizeof(line), "  %-46s %9.3f ms %9.3f ms/program", what.c_str(),
+             seconds * 1000, seconds * 1000 / programs);
+    std::cout << line << "\n";
+}
+
+// A program's worth of shaders built one after another, the way a program
+// starts up, with no binaries on disk (cold) and with the ones the last
+// cold run left (warm). Drivers may keep a cache of their own behind
+// glCompileShader() (Mesa does, and only offers binaries while it's on), so
+// every cold run gets sources neither has seen.
+static void caseShaders()
+{
+    const int count = 8;
+    const std::string directory = "bench-shadercache";
+
+    if (!glfwInit()) {
+        std::cout << "  no GLFW, skipped\n";
+        return;
+    }
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow * window = glfwCreateWindow(64, 64, "bench", 0, 0);
+    if (!window) {
+        std::cout << "  no GL context, skipped\n";
+        glfwTerminate();
+        return;
+    }
+    glfwMakeContextCurrent(window);
+    std::cout << "  " << glGetString(GL_RENDERER) << ", " << glGetString(GL_VERSION) << ", "
+              << count << " programs\n";
+
+    std::vector<std::string> vertex(count), fragment(count);
+    int run = 0;
+
+    // every program built, or collected after all were started, and how
+    // many of them came from their binaries
+    int built = 0, fromBinary = 0;
+    auto startup = [&](bool cold, bool prepared) {
+        if (cold) {
+            removeDirectory(directory);
+            run++;
+            for (int i = 0; i < count; i++) {
+                vertex[i] = variant(benchVertex, i + 1, run);
+                fragment[i] = variant(benchFragment, i + 1, run);
+            }
+        }
+        ShaderCache cache;
+        cache.setBinaryDirectory(directory);
+        if (prepared)
+            for (int i = 0; i < count; i++)
+                cache.prepare(vertex[i].c_str(), fragment[i].c_str());
+
+        built = fromBinary = 0;
+        for (int i = 0; i < count; i++) {
+            ShaderTimings timings;
+            if (cache.program(vertex[i].c_str(), fragment[i].c_str()) &&
+                cache.timings(vertex[i].c_str(), fragment[i].c_str(), timings)) {
+                built++;
+                fromBinary += timings.fromBinary;
+            }
+        }
+        glFinish();
+        cache.clear();
+    };
+
+    printStartup("cold, from source", bestOf([&] { startup(true, false); }, 1), count);
+    printStartup("cold, all prepared first", bestOf([&] { startup(true, true); }, 1), count);
+
+    startup(true, false);
+    printStartup("warm, from binaries", bestOf([&] { startup(false, false); }, 1), count);
+    printStartup("warm, all prepared first", bestOf([&] { startup(false, true); }, 1), count);
+
+    if (built != count)
+        std::cout << "  (only " << built << " of the programs built)\n";
+    else if (fromBinary != count)
+        std::cout << "  (" << fromBinary << " of " << count
+                  << " warm programs came from binaries; the driver may have none)\n";
+
+    removeDirectory(directory);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+}
+
+#endif
+
+// -------------- cases
+
+struct Case {
+    const char * name;
+    const char * what;
+    void (*run)();
+};
+
+static const Case cases[] = {
+    { "mem", "bmpread() against bmpread_mem() and bmpread_mmap(), 24-bit", caseMem },
+    { "decode", "every decoder, 1 to 32 bits, MB/s of output", caseDecode },
+    { "cooked", "the cooked texture cache, cold and warm, 24-bit", caseCooked },
+    { "compress", "BC1 and BC3 at each quality, PSNR and MP/s", caseCompress },
+    { "raw", "bmpread_raw() against bmpread(), 24-bit", caseRaw },
+    { "alloc", "1000 small 24-bit loads, malloc() against an arena", caseAlloc },
+    { "palette", "1-, 4- and 8-bit bitmaps, MB/s of RGB output", casePalette },
+    { "threads", "BMPREAD_THREADED on 1 to 8 threads, 4K to 16K", caseThreads },
+#ifdef BENCH_SHADERS
+    { "shaders", "shader program startup, cold and warm binary cache", caseShaders },
+#endif
+};
+
+int main(int argc, char ** argv)
+{
+    std::vector<const Case *> chosen;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "list")) {
+            for (const Case & c : cases)
+                std::cout << c.name << "\t" << c.what << "\n";
+            return 0;
+        }
+
+        const Case * found = nullptr;
+        for (const Case & c : cases)
+            if (!strcmp(argv[i], c.name))
+                found = &c;
+        if (!found) {
+            std::cout << "no case " << argv[i] << " (try: list)\n";
+            return 1;
+        }
+        chosen.push_back(found);
+    }
+
+    if (chosen.empty())
+        for (const Case & c : cases)
+            chosen.push_back(&c);
+
+    for (const Case * c : chosen) {
+        std::cout << c->name << ": " << c->what << "\n";
+        c->run();
+    }
+    return failures ? 1 : 0;
+}
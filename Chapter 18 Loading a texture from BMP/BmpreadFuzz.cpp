@@ -0,0 +1,184 @@
+// Feeds arbitrary bytes to bmpread_mem(), under every kind of flag it
+// takes, and reads every byte of whatever it hands back, so a sanitizer
+// sees any read past the input or write past the output.
+//
+// Built as a libFuzzer target (make fuzz, which needs clang) it starts from
+// the files in fuzz_corpus/: small valid bitmaps at each bit depth and
+// layout, RLE ones, and some cut short. Built with BMPREAD_FUZZ_REPLAY
+// (make fuzz-replay, any compiler with AddressSanitizer) it gets a main()
+// of its own instead, which runs each file named on the command line, then
+// a fixed number of mutations of them, the same ones on every run.
+
+#include <stdint.h>
+#include <string.h>
+#include "bmpread.h"
+
+static const unsigned flagSets[] = {
+    0,
+    BMPREAD_ANY_SIZE,
+    BMPREAD_ANY_SIZE | BMPREAD_ALPHA,
+    BMPREAD_ANY_SIZE | BMPREAD_TOP_DOWN | BMPREAD_BYTE_ALIGN,
+    BMPREAD_ANY_SIZE | BMPREAD_THREADED,
+    BMPREAD_ANY_SIZE | BMPREAD_SCALE_1_2,
+    BMPREAD_ANY_SIZE | BMPREAD_SCALE_1_8 | BMPREAD_ALPHA,
+    BMPREAD_POT_NEXT,
+    BMPREAD_POT_NEAREST | BMPREAD_ALPHA,
+    BMPREAD_POT_PAD | BMPREAD_BYTE_ALIGN,
+};
+
+static uint32_t little(const uint8_t * data, int bytes)
+{
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+// Whether the header asks for more than 4M pixels (up to 16M once the
+// power-of-two flags round both sides up). bmpread() will try to allocate
+// that much, which is right, but only wastes the fuzzer's memory.
+static bool tooBig(const uint8_t * data, size_t size)
+{
+    if (size < 18)
+        return false;
+
+    uint32_t infoSize = little(data + 14, 4);
+    int64_t width, height;
+    if (infoSize == 12 && size >= 22) {
+        width = (int16_t)little(data + 18, 2);
+        height = (int16_t)little(data + 20, 2);
+    } else if (size >= 26) {
+        width = (int32_t)little(data + 18, 4);
+        height = (int32_t)little(data + 22, 4);
+    } else {
+        return false;
+    }
+
+    width = width < 0 ? -width : width;
+    height = height < 0 ? -height : height;
+    return width * height > ((int64_t)1 << 22);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    if (tooBig(data, size))
+        return 0;
+
+    for (unsigned flags : flagSets) {
+        bmpread_t bmp;
+        if (!bmpread_mem(data, size, flags, &bmp))
+            continue;
+
+        size_t channels = (bmp.flags & BMPREAD_ALPHA) ? 4 : 3;
+        size_t line = bmp.width * channels;
+        if (!(bmp.flags & BMPREAD_BYTE_ALIGN))
+            line = (line + 3) & ~(size_t)3;
+
+        volatile unsigned char sum = 0;
+        for (size_t i = 0; i < line * bmp.height; i++)
+            sum ^= bmp.data[i];
+
+        bmpread_free(&bmp);
+    }
+    return 0;
+}
+
+#ifdef BMPREAD_FUZZ_REPLAY
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "CacheFile.h"
+
+static const int mutationsPerFile = 2000;
+
+// xorshift32, so every run tries the same inputs
+static uint32_t nextRandom(uint32_t & state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// what a header field is most likely to be wrong with
+static const uint32_t interesting[] = {
+    0, 1, 2, 3, 4, 8, 12, 15, 16, 24, 31, 32, 40, 54, 56, 108, 124,
+    0x7f, 0x80, 0xff, 0x100, 0xffff, 0x10000, 0x3fffffff, 0x40000000,
+    0x7fffffff, 0x80000000u, 0xfffffff8u, 0xfffffffeu, 0xffffffffu,
+};
+
+static void mutate(std::vector<uint8_t> & data, const std::vector<std::vector<uint8_t> > & files,
+                   uint32_t & state)
+{
+    int changes = 1 + nextRandom(state) % 4;
+    for (int i = 0; i < changes && !data.empty(); i++) {
+        size_t at = nextRandom(state) % data.size();
+        uint32_t value = interesting[nextRandom(state) % (sizeof(interesting) / sizeof(interesting[0]))];
+        switch (nextRandom(state) % 6) {
+        case 0: // flip a bit
+            data[at] ^= (uint8_t)(1u << (nextRandom(state) % 8));
+            break;
+        case 1: // any byte
+            data[at] = (uint8_t)nextRandom(state);
+            break;
+        case 2: // a header field, 4 bytes at an even offset
+            at = 2 + 2 * (nextRandom(state) % 34);
+            if (at + 4 <= data.size())
+                memcpy(&data[at], &value, 4);
+            break;
+        case 3: // the bit depth, or the RLE escapes in the pixels
+            if (data.size() >= 30 && nextRandom(state) % 2)
+                memcpy(&data[28], &value, 2);
+            else
+                data[at] = (uint8_t)(nextRandom(state) % 3);
+            break;
+        case 4: // cut short
+            data.resize(at);
+            break;
+        case 5: { // the end of another file on this one
+            const std::vector<uint8_t> & other = files[nextRandom(state) % files.size()];
+            size_t from = other.empty() ? 0 : nextRandom(state) % other.size();
+            data.resize(at);
+            data.insert(data.end(), other.begin() + from, other.end());
+            break;
+        }
+        }
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    std::vector<std::vector<uint8_t> > files;
+    for (int i = 1; i < argc; i++) {
+        std::vector<unsigned char> contents;
+        if (!readFile(argv[i], contents)) {
+            std::cout << "can't read " << argv[i] << "\n";
+            return 1;
+        }
+        files.push_back(contents);
+    }
+    if (files.empty()) {
+        std::cout << "usage: " << argv[0] << " file.bmp...\n";
+        return 1;
+    }
+
+    uint32_t state = 1;
+    size_t inputs = 0;
+    for (const std::vector<uint8_t> & file : files) {
+        LLVMFuzzerTestOneInput(file.data(), file.size());
+        inputs++;
+
+        for (int i = 0; i < mutationsPerFile; i++) {
+            std::vector<uint8_t> data = file;
+            mutate(data, files, state);
+            LLVMFuzzerTestOneInput(data.data(), data.size());
+            inputs++;
+        }
+    }
+
+    std::cout << inputs << " inputs from " << files.size() << " files, no crashes\n";
+    return 0;
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Checks bmpread's SIMD decoders against its portable ones, bit for bit.
+//
+// The Makefile builds bmpread.c three times: as usual (AVX2 where the CPU
+// has it), with BMPREAD_NO_AVX2 (SSSE3), and with BMPREAD_NO_SIMD (the
+// portable decoders), the last two with their entry points renamed so all
+// three fit in one program. Every layout with a SIMD decoder (24-bit, and
+// the 16- and 32-bit bitfield layouts GetBitfieldLayout() knows) is decoded
+// at each width from 1 pixel to one more than two of the widest kernel's
+// steps (32 pixels), so every length of leftover at the end of a line comes
+// up, stored both bottom-up and top-down, to RGB and RGBA.
+// Only the pixels are compared, not the padding after each line.
+
+#include <iostream>
+#include <string.h>
+#include "bmpread.h"
+#include "SyntheticBitmap.h"
+
+extern "C" {
+int bmpread_mem_ssse3(const void * bmp_data, size_t bmp_size, unsigned int flags,
+                      bmpread_t * p_bmp_out);
+void bmpread_free_ssse3(bmpread_t * p_bmp);
+int bmpread_mem_scalar(const void * bmp_data, size_t bmp_size, unsigned int flags,
+                       bmpread_t * p_bmp_out);
+void bmpread_free_scalar(bmpread_t * p_bmp);
+}
+
+static const int maxWidth = 2 * 32 + 1;
+
+struct Layout {
+    const char * name;
+    int bits;
+    uint32_t masks[4];
+};
+
+static const Layout layouts[] = {
+    { "24-bit",              24, { 0, 0, 0, 0 } },
+    { "32-bit X8R8G8B8",     32, { 0xff0000, 0xff00, 0xff, 0 } },
+    { "32-bit A8R8G8B8",     32, { 0xff0000, 0xff00, 0xff, 0xff000000 } },
+    { "16-bit R5G6B5",       16, { 0xf800, 0x07e0, 0x001f, 0 } },
+    { "16-bit X1R5G5B5",     16, { 0x7c00, 0x03e0, 0x001f, 0 } },
+    { "16-bit A1R5G5B5",     16, { 0x7c00, 0x03e0, 0x001f, 0x8000 } },
+};
+
+// whether a and b hold the same pixels, ignoring line padding
+static bool samePixels(const bmpread_t & a, const bmpread_t & b)
+{
+    if (a.width != b.width || a.height != b.height)
+        return false;
+
+    size_t pixels = (size_t)a.width * ((a.flags & BMPREAD_ALPHA) ? 4 : 3);
+    size_t line = (pixels + 3) & ~(size_t)3;
+    for (int y = 0; y < a.height; y++)
+        if (memcmp(a.data + y * line, b.data + y * line, pixels) != 0)
+            return false;
+    return true;
+}
+
+int main()
+{
+    int checked = 0, failed = 0;
+
+    for (const Layout & layout : layouts) {
+        for (int width = 1; width <= maxWidth; width++) {
+            for (int topDown = 0; topDown < 2; topDown++) {
+                BitmapSpec spec = { width, 3, layout.bits, topDown != 0,
+                                    { layout.masks[0], layout.masks[1],
+                                      layout.masks[2], layout.masks[3] } };
+                std::vector<unsigned char> file = makeBitmap(spec, (uint32_t)width * 7919 + topDown);
+
+                const unsigned flagSets[] = { BMPREAD_ANY_SIZE, BMPREAD_ANY_SIZE | BMPREAD_ALPHA };
+                for (unsigned flags : flagSets) {
+                    bmpread_t simd = {}, ssse3 = {}, scalar = {};
+                    bool ok = bmpread_mem(file.data(), file.size(), flags, &simd) &&
+                              bmpread_mem_ssse3(file.data(), file.size(), flags, &ssse3) &&
+                              bmpread_mem_scalar(file.data(), file.size(), flags, &scalar) &&
+                              samePixels(simd, scalar) && samePixels(ssse3, scalar);
+                    if (!ok) {
+                        std::cout << "FAILED: " << layout.name << ", " << width << " wide, "
+                                  << (topDown ? "top-down" : "bottom-up")
+                                  << ((flags & BMPREAD_ALPHA) ? ", RGBA\n" : ", RGB\n");
+                        failed++;
+                    }
+                    checked++;
+
+                    bmpread_free(&simd);
+                    bmpread_free_ssse3(&ssse3);
+                    bmpread_free_scalar(&scalar);
+                }
+            }
+        }
+    }
+
+    std::cout << checked << " decodes checked against the portable decoders, "
+              << failed << " failed\n";
+    return failed ? 1 : 0;
+}
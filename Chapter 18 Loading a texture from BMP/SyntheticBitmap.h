@@ -0,0 +1,101 @@
+#ifndef SYNTHETIC_BITMAP_H
+#define SYNTHETIC_BITMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Bitmap files made up on the spot, for the benchmark and the tests: random
+// pixels (and palette) at whatever size, bit depth and bitfield layout
+// bmpread() takes, laid out the way a paint program would write them.
+//
+// 16- and 32-bit files with masks get a version 4 info header (108 bytes),
+// which is where bmpread() looks for them; everything else gets the plain
+// Windows 3 one (40 bytes).
+
+struct BitmapSpec {
+    int width;
+    int height;
+    int bits;          // 1, 4, 8, 16, 24 or 32
+    bool topDown;      // top line stored first (a negative height)
+    uint32_t masks[4]; // R, G, B, A for 16 and 32 bits; all 0 for none
+};
+
+// xorshift32, so every run makes the same files
+inline uint32_t nextRandom(uint32_t & state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+inline void putLittle(std::vector<unsigned char> & out, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out.push_back((unsigned char)(value >> (8 * i)));
+}
+
+inline std::vector<unsigned char> makeBitmap(const BitmapSpec & spec, uint32_t seed = 1)
+{
+    bool masked = (spec.bits == 16 || spec.bits == 32) &&
+                  (spec.masks[0] | spec.masks[1] | spec.masks[2] | spec.masks[3]);
+    uint32_t infoSize = masked ? 108 : 40;
+    uint32_t colors = (spec.bits <= 8) ? 1u << spec.bits : 0;
+    size_t lineLength = (((size_t)spec.width * spec.bits + 31) / 32) * 4;
+    uint32_t dataOffset = 14 + infoSize + colors * 4;
+    size_t fileSize = dataOffset + lineLength * spec.height;
+
+    std::vector<unsigned char> out;
+    out.reserve(fileSize);
+
+    out.push_back('B');
+    out.push_back('M');
+    putLittle(out, (uint32_t)fileSize, 4);
+    putLittle(out, 0, 4);
+    putLittle(out, dataOffset, 4);
+
+    putLittle(out, infoSize, 4);
+    putLittle(out, (uint32_t)spec.width, 4);
+    putLittle(out, (uint32_t)(spec.topDown ? -spec.height : spec.height), 4);
+    putLittle(out, 1, 2); // planes
+    putLittle(out, (uint32_t)spec.bits, 2);
+    putLittle(out, masked ? 3 : 0, 4); // BI_BITFIELDS or BI_RGB
+    putLittle(out, (uint32_t)(lineLength * spec.height), 4);
+    putLittle(out, 2835, 4); // 72 dpi
+    putLittle(out, 2835, 4);
+    putLittle(out, colors, 4);
+    putLittle(out, 0, 4);
+    if (masked) {
+        for (int i = 0; i < 4; i++)
+            putLittle(out, spec.masks[i], 4);
+        while (out.size() < 14 + infoSize)
+            out.push_back(0); // color space and gamma, unused
+    }
+
+    uint32_t state = seed ? seed : 1;
+    for (uint32_t i = 0; i < colors; i++)
+        putLittle(out, nextRandom(state) & 0xffffff, 4);
+
+    // random pixels, padding bytes 0
+    size_t pixelBytes = ((size_t)spec.width * spec.bits + 7) / 8;
+    for (int y = 0; y < spec.height; y++) {
+        for (size_t i = 0; i < lineLength; i++)
+            out.push_back(i < pixelBytes ? (unsigned char)nextRandom(state) : 0);
+    }
+
+    return out;
+}
+
+inline bool writeFile(const std::string & path, const std::vector<unsigned char> & contents)
+{
+    FILE * fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool written = fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+    return fclose(fp) == 0 && written;
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include <OpenGL/OpenGL.h>
 #include <math.h>
 #include "bmpread.h"
+#include "TextureLoader.h"
+#include "ShaderProgram.h"
 
 #define GL_SILENCE_DEPRECATION 1
 
@@ -39,6 +41,11 @@ void main()
 
 int main()
 {
+    // -------------- texture loading, in the background while GL gets set up
+    
+    TextureLoader loader;
+    std::future<CookedTexture> texture = loader.loadCooked("texture.bmp");
+    
     // -------------- init
     
     GLFWwindow * window;
@@ -65,56 +72,11 @@ int main()
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
     
-    const char* source;
-    GLint compilationStatus;
-    
-    // ------------- VERTEX SHADER
-    
-    source = vertex120;
-    
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-    
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
-    // ---------- FRAGMENT SHADER
-    
-    source = raster120;
-    
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
     // ------------- SHADER PROGRAM
+    // (started now and collected further down, so the driver can compile it
+    // while the buffers go up and the texture decodes)
     
-    GLint linkStatus;
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
-        exit(1);
-    }
-    
-    glUseProgram(shaderProgram);
+    ShaderCache::shared().prepare(vertex120, raster120);
     
     // ---------------- VBOs
     
@@ -146,11 +108,20 @@ int main()
     glBindBuffer(GL_ARRAY_BUFFER, uvsData);
     glBufferData(GL_ARRAY_BUFFER, sizeof(uvs), uvs, GL_STATIC_DRAW);
     
+    // ------------- SHADER PROGRAM, collected
+    
+    GLuint shaderProgram = loadProgram(vertex120, raster120);
+    if (!shaderProgram)
+        exit(1);
+    
+    glUseProgram(shaderProgram);
+    UniformTable & uniforms = ShaderCache::shared().uniforms(shaderProgram);
+    
     // ----------------- TEXTURE
 
-    bmpread_t bitmap;
+    CookedTexture bitmap = texture.get();
     
-    if (!bmpread("texture.bmp",0, &bitmap)) {
+    if (!bitmap.loaded()) {
         std::cout << "Texture loading error";
         exit(-1);
     }
@@ -160,15 +131,18 @@ int main()
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texid);
     
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
     //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 5, 5, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*) texture);
-    glTexImage2D(GL_TEXTURE_2D,0,3,bitmap.width,bitmap.height,0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    
+    // every mip level, from the full size down to 1x1
+    for (int level = 0; level < bitmap.levels(); level++)
+        glTexImage2D(GL_TEXTURE_2D,level,3,bitmap.width(level),bitmap.height(level),0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.data(level));
     
-    GLuint attribTex = glGetAttribLocation(shaderProgram, "tex");
-    glUniform1i(attribTex, 0);
+    int uniformTex = uniforms.find("tex");
+    uniforms.set(uniformTex, 0);
     
     // ----------------- attributes
     
@@ -179,9 +153,8 @@ int main()
         0, 0, 0, 1
     };
     
-    GLuint attribMatrix;
-    attribMatrix = glGetUniformLocation(shaderProgram, "matrix");
-    glUniformMatrix4fv(attribMatrix, 1, GL_FALSE, matrix);
+    int uniformMatrix = uniforms.find("matrix");
+    uniforms.setMatrix(uniformMatrix, matrix);
     
     GLuint attribPosition;
     attribPosition = glGetAttribLocation(shaderProgram, "inPosition");
@@ -195,12 +168,10 @@ int main()
     glBindBuffer(GL_ARRAY_BUFFER, uvsData);
     glVertexAttribPointer(attribUvs, 2, GL_FLOAT, GL_FALSE, 0, 0);
     
-    GLuint uniformRes;
-    uniformRes = glGetUniformLocation(shaderProgram, "res");
-    glUniform2f(uniformRes, 600.f, 600.f);
+    int uniformRes = uniforms.find("res");
+    uniforms.set(uniformRes, 600.f, 600.f);
     
-    GLuint uniformTime;
-    uniformTime = glGetUniformLocation(shaderProgram, "time");
+    int uniformTime = uniforms.find("time");
     
     // ----------------- render loop
     while (!glfwWindowShouldClose(window))
@@ -209,7 +180,7 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT);
         
         float time = glfwGetTime();
-        glUniform1f(uniformTime, time);
+        uniforms.set(uniformTime, time);
         
         glDrawArrays(GL_TRIANGLES, 0, 6);
         
@@ -0,0 +1,605 @@
+#include "TextureCache.h"
+#include "CacheFile.h"
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTURE_CACHE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// -------------- files
+
+// size and modification time of a file, false if it isn't there
+static bool statFile(const std::string & path, uint64_t & size, int64_t & time)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || st.st_size < 0)
+        return false;
+
+    size = (uint64_t)st.st_size;
+    time = (int64_t)st.st_mtime;
+    return true;
+}
+
+// maps a whole file read-only, false if it's missing or empty
+static bool mapFile(const std::string & path, const unsigned char * & data, size_t & size)
+{
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void * view = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (view == MAP_FAILED)
+        return false;
+
+    data = (const unsigned char *)view;
+    size = (size_t)st.st_size;
+    return true;
+#else
+    (void)path; (void)data; (void)size;
+    return false; // read into memory instead
+#endif
+}
+
+static void unmapFile(const unsigned char * data, size_t size)
+{
+#ifndef _WIN32
+    munmap((void *)data, size);
+#else
+    (void)data; (void)size;
+#endif
+}
+
+// -------------- levels
+
+static int levelDimension(uint32_t size, int level)
+{
+    return (size >> level) ? (int)(size >> level) : 1;
+}
+
+static size_t levelLineLength(int width, int channels)
+{
+    return ((size_t)width * channels + 3) & ~(size_t)3;
+}
+
+// levels from width x height down to 1x1
+static uint32_t levelCount(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    while ((width | height) >> levels)
+        levels++;
+    return levels;
+}
+
+static size_t alignOffset(size_t offset)
+{
+    return (offset + 15) & ~(size_t)15;
+}
+
+// Halves a pair of lines of 4-channel pixels into one, averaging each 2x2
+// box, with SSE2 doing 4 output pixels at a time.
+static void halveLines4(const unsigned char * row0, const unsigned char * row1,
+                        unsigned char * out, int dstWidth)
+{
+    int x = 0;
+
+#ifdef TEXTURE_CACHE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    for (; x + 4 <= dstWidth; x += 4) {
+        const unsigned char * in0 = row0 + (size_t)x * 8;
+        const unsigned char * in1 = row1 + (size_t)x * 8;
+        __m128i a0 = _mm_loadu_si128((const __m128i *)in0);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(in0 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)in1);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(in1 + 16));
+
+        // each column's two lines added up, two pixels per register
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+        // then each pair of neighbouring pixels
+        __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+        __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+
+        h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+        h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+        _mm_storeu_si128((__m128i *)(out + (size_t)x * 4), _mm_packus_epi16(h0, h1));
+    }
+#endif
+
+    for (; x < dstWidth; x++) {
+        for (int c = 0; c < 4; c++) {
+            size_t i = (size_t)x * 8 + c;
+            out[(size_t)x * 4 + c] = (unsigned char)((row0[i] + row0[i + 4] +
+                                                      row1[i] + row1[i + 4] + 2) >> 2);
+        }
+    }
+}
+
+// The same for 3-channel pixels. Their pairs don't line up with SSE2's
+// registers, so the two lines are added up 16 bytes at a time into sums, and
+// neighbouring pixels are added and rounded after.
+static void halveLines3(const unsigned char * row0, const unsigned char * row1,
+                        unsigned char * out, int dstWidth, uint16_t * sums)
+{
+    size_t bytes = (size_t)dstWidth * 6;
+    size_t i = 0;
+
+#ifdef TEXTURE_CACHE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+        _mm_storeu_si128((__m128i *)(sums + i),
+                         _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+        _mm_storeu_si128((__m128i *)(sums + i + 8),
+                         _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+    }
+#endif
+
+    for (; i < bytes; i++)
+        sums[i] = (uint16_t)(row0[i] + row1[i]);
+
+    for (int x = 0; x < dstWidth; x++) {
+        const uint16_t * in = sums + (size_t)x * 6;
+        unsigned char * p = out + (size_t)x * 3;
+        p[0] = (unsigned char)((in[0] + in[3] + 2) >> 2);
+        p[1] = (unsigned char)((in[1] + in[4] + 2) >> 2);
+        p[2] = (unsigned char)((in[2] + in[5] + 2) >> 2);
+    }
+}
+
+// Where one output pixel (or line) of a level comes from along one axis of
+// the level above, size pixels long: up to 3 pixels from first on, each
+// weighted by how much of it the output pixel's box covers.
+struct Taps {
+    int first;
+    int count;
+    float weights[3];
+};
+
+static Taps getTaps(int size, int i)
+{
+    Taps taps = { 2 * i, 2, { 0.5f, 0.5f, 0.f } };
+
+    if (size == 1) {
+        taps.first = 0;
+        taps.count = 1;
+        taps.weights[0] = 1.f;
+        taps.weights[1] = 0.f;
+    } else if (size % 2 != 0) {
+        // An odd size 2n + 1 halves to n, so each output pixel covers 2 +
+        // 1/n pixels, straddling the ones on either side of its middle pair.
+        float n = (float)(size / 2);
+        taps.count = 3;
+        taps.weights[0] = (n - i) / size;
+        taps.weights[1] = n / size;
+        taps.weights[2] = (i + 1) / (float)size;
+    }
+
+    return taps;
+}
+
+// Sets line to the weighted sum of three lines of bytes, for downsample().
+static void addLines(float * line, const unsigned char * in0, const unsigned char * in1,
+                     const unsigned char * in2, float w0, float w1, float w2, size_t length)
+{
+    size_t i = 0;
+
+#ifdef TEXTURE_CACHE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 v0 = _mm_set1_ps(w0), v1 = _mm_set1_ps(w1), v2 = _mm_set1_ps(w2);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in1 + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(in2 + i));
+        __m128i a16[2] = { _mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero) };
+        __m128i b16[2] = { _mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero) };
+        __m128i c16[2] = { _mm_unpacklo_epi8(c, zero), _mm_unpackhi_epi8(c, zero) };
+
+        // 4 bytes of each line at a time, widened to floats
+        for (int j = 0; j < 4; j++) {
+            __m128i a32 = (j & 1) ? _mm_unpackhi_epi16(a16[j / 2], zero) : _mm_unpacklo_epi16(a16[j / 2], zero);
+            __m128i b32 = (j & 1) ? _mm_unpackhi_epi16(b16[j / 2], zero) : _mm_unpacklo_epi16(b16[j / 2], zero);
+            __m128i c32 = (j & 1) ? _mm_unpackhi_epi16(c16[j / 2], zero) : _mm_unpacklo_epi16(c16[j / 2], zero);
+            __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, _mm_cvtepi32_ps(a32)),
+                                               _mm_mul_ps(v1, _mm_cvtepi32_ps(b32))),
+                                    _mm_mul_ps(v2, _mm_cvtepi32_ps(c32)));
+            _mm_storeu_ps(line + i + j * 4, sum);
+        }
+    }
+#endif
+
+    for (; i < length; i++)
+        line[i] = w0 * in0[i] + w1 * in1[i] + w2 * in2[i];
+}
+
+// Averages src into lines firstRow to endRow of dst, half its size rounded
+// down (but at least 1), each pixel of dst the average of the box of src it
+// covers. Even sizes are plain 2x2 boxes; an odd size can't be split into
+// pairs, so there each box takes in parts of a third line or column, and none
+// of src is left out. Each line of dst only reads src, so separate bands of
+// lines can be done at the same time.
+static void downsample(const unsigned char * src, int srcWidth, int srcHeight, size_t srcLine,
+                       unsigned char * dst, int dstWidth, size_t dstLine,
+                       int channels, int firstRow, int endRow)
+{
+    if (srcWidth % 2 == 0 && srcHeight % 2 == 0) {
+        std::vector<uint16_t> sums(channels == 3 ? (size_t)dstWidth * 6 : 0);
+
+        for (int y = firstRow; y < endRow; y++) {
+            const unsigned char * row0 = src + (size_t)(2 * y) * srcLine;
+            unsigned char * out = dst + (size_t)y * dstLine;
+
+            if (channels == 4)
+                halveLines4(row0, row0 + srcLine, out, dstWidth);
+            else
+                halveLines3(row0, row0 + srcLine, out, dstWidth, sums.data());
+        }
+        return;
+    }
+
+    // Otherwise the box is split into a pass down each column of src, into a
+    // line of floats, and then a pass across that line.
+    std::vector<Taps> columns(dstWidth);
+    for (int x = 0; x < dstWidth; x++)
+        columns[x] = getTaps(srcWidth, x);
+
+    // Every pass takes 3 taps, the unused ones weighing 0, which keeps the
+    // loops simple enough to unroll; line has two spare pixels of 0s at the
+    // end for taps off the edge.
+    size_t length = (size_t)srcWidth * channels;
+    std::vector<float> line(length + 2 * channels, 0.f);
+
+    for (int y = firstRow; y < endRow; y++) {
+        Taps rows = getTaps(srcHeight, y);
+        unsigned char * out = dst + (size_t)y * dstLine;
+
+        const unsigned char * in0 = src + (size_t)rows.first * srcLine;
+        const unsigned char * in1 = (rows.count > 1) ? in0 + srcLine : in0;
+        const unsigned char * in2 = (rows.count > 2) ? in1 + srcLine : in1;
+        float w0 = rows.weights[0], w1 = rows.weights[1], w2 = rows.weights[2];
+
+        addLines(line.data(), in0, in1, in2, w0, w1, w2, length);
+
+        for (int x = 0; x < dstWidth; x++) {
+            const Taps & taps = columns[x];
+            const float * in = line.data() + (size_t)taps.first * channels;
+
+            for (int c = 0; c < channels; c++)
+                out[c] = (unsigned char)(taps.weights[0] * in[c] +
+                                         taps.weights[1] * in[channels + c] +
+                                         taps.weights[2] * in[2 * channels + c] + 0.5f);
+            out += channels;
+        }
+    }
+}
+
+static BlockFormat levelBlockFormat(uint32_t blockFormat)
+{
+    return (blockFormat == 1) ? BlockFormat::BC1 : BlockFormat::BC3;
+}
+
+// checks that a sidecar's header is one we wrote, for these flags, and that
+// every level it points at is inside it
+static bool validSidecar(const unsigned char * data, size_t size, unsigned flags)
+{
+    const CookedTexture::Header * header = (const CookedTexture::Header *)data;
+
+    if (size < sizeof(*header) || memcmp(header->magic, "BMPCOOK", 8) != 0 ||
+        header->version != CookedTexture::Version || header->flags != flags)
+        return false;
+
+    if ((header->channels != 3 && header->channels != 4) ||
+        header->width == 0 || header->width > INT32_MAX ||
+        header->height == 0 || header->height > INT32_MAX ||
+        header->levels == 0 || header->levels > 32)
+        return false;
+
+    uint32_t blockFormat = !(flags & CookedTexture::Blocks) ? 0 : (header->channels == 3) ? 1 : 2;
+    if (header->blockFormat != blockFormat)
+        return false;
+
+    for (int level = 0; level < (int)header->levels; level++) {
+        int width = levelDimension(header->width, level);
+        int height = levelDimension(header->height, level);
+        uint64_t offset = header->offsets[level];
+        uint64_t bytes = (uint64_t)levelLineLength(width, header->channels) * height;
+
+        if (offset % 16 != 0 || offset > size || bytes > size - offset)
+            return false;
+
+        if (blockFormat) {
+            offset = header->blockOffsets[level];
+            bytes = compressedSize(width, height, levelBlockFormat(blockFormat));
+            if (offset % 16 != 0 || offset > size || bytes > size - offset)
+                return false;
+        }
+    }
+
+    return header->levels == levelCount(header->width, header->height);
+}
+
+// -------------- CookedTexture
+
+CookedTexture::CookedTexture() : base(nullptr), size(0), mapped(false), hit(false)
+{
+}
+
+CookedTexture::CookedTexture(CookedTexture && other)
+    : base(other.base), size(other.size), mapped(other.mapped), hit(other.hit),
+      memory(std::move(other.memory))
+{
+    other.base = nullptr;
+    other.mapped = false;
+    other.clear();
+}
+
+CookedTexture & CookedTexture::operator=(CookedTexture && other)
+{
+    if (this != &other) {
+        clear();
+        base = other.base;
+        size = other.size;
+        mapped = other.mapped;
+        hit = other.hit;
+        memory = std::move(other.memory);
+
+        other.base = nullptr;
+        other.mapped = false;
+        other.clear();
+    }
+    return *this;
+}
+
+CookedTexture::~CookedTexture()
+{
+    clear();
+}
+
+void CookedTexture::clear()
+{
+    if (mapped)
+        unmapFile(base, size);
+
+    base = nullptr;
+    size = 0;
+    mapped = false;
+    hit = false;
+    memory.clear();
+}
+
+int CookedTexture::width(int level) const
+{
+    return levelDimension(header().width, level);
+}
+
+int CookedTexture::height(int level) const
+{
+    return levelDimension(header().height, level);
+}
+
+size_t CookedTexture::lineLength(int level) const
+{
+    return levelLineLength(width(level), channels());
+}
+
+const unsigned char * CookedTexture::data(int level) const
+{
+    return base + header().offsets[level];
+}
+
+BlockFormat CookedTexture::blockFormat() const
+{
+    return levelBlockFormat(header().blockFormat);
+}
+
+const unsigned char * CookedTexture::blocks(int level) const
+{
+    return hasBlocks() ? base + header().blockOffsets[level] : nullptr;
+}
+
+size_t CookedTexture::blocksSize(int level) const
+{
+    return hasBlocks() ? compressedSize(width(level), height(level), blockFormat()) : 0;
+}
+
+bool CookedTexture::load(const std::string & path, unsigned flags, const ParallelFor & parallel)
+{
+    clear();
+
+    // the only flags that change what gets cooked
+    flags &= BMPREAD_ALPHA | BMPREAD_ANY_SIZE | BMPREAD_SCALE_MASK | BMPREAD_POT_MASK | Blocks;
+
+    std::string sidecar = path + ".cooked";
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!statFile(path, sourceSize, sourceTime))
+        return false;
+
+    std::vector<unsigned char> contents;
+    bool found = mapFile(sidecar, base, size);
+    if (found) {
+        mapped = true;
+    } else if (readFile(sidecar, contents) && !contents.empty()) {
+        memory.resize((contents.size() + 7) / 8);
+        memcpy(memory.data(), contents.data(), contents.size());
+        base = (const unsigned char *)memory.data();
+        size = contents.size();
+        found = true;
+    }
+
+    if (found && validSidecar(base, size, flags) && header().sourceSize == sourceSize) {
+        if (header().sourceTime == sourceTime) {
+            hit = true;
+            return true;
+        }
+
+        // Touched but maybe not changed, e.g. by a checkout. If the contents
+        // still match, note the new time so they aren't hashed next time.
+        if (readFile(path, contents) &&
+            hashBytes(fnvBasis, contents.data(), contents.size()) == header().sourceHash) {
+            if (FILE * fp = fopen(sidecar.c_str(), "r+b")) {
+                if (!fseek(fp, (long)offsetof(Header, sourceTime), SEEK_SET))
+                    fwrite(&sourceTime, sizeof(sourceTime), 1, fp);
+                fclose(fp);
+            }
+
+            hit = true;
+            return true;
+        }
+    }
+
+    clear();
+    return cook(path, sidecar, flags, parallel);
+}
+
+bool CookedTexture::cook(const std::string & path, const std::string & sidecar, unsigned flags,
+                         const ParallelFor & parallel)
+{
+    std::vector<unsigned char> source;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!statFile(path, sourceSize, sourceTime) || !readFile(path, source))
+        return false;
+
+    bmpread_t bitmap;
+    if (!bmpread_mem(source.data(), source.size(), flags & ~Blocks, &bitmap))
+        return false;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BMPCOOK", 8);
+    header.version = Version;
+    header.flags = flags;
+    header.width = (uint32_t)bitmap.width;
+    header.height = (uint32_t)bitmap.height;
+    header.contentWidth = (uint32_t)bitmap.content_width;
+    header.contentHeight = (uint32_t)bitmap.content_height;
+    header.channels = (flags & BMPREAD_ALPHA) ? 4 : 3;
+    header.sourceSize = source.size();
+    header.sourceTime = sourceTime;
+    header.sourceHash = hashBytes(fnvBasis, source.data(), source.size());
+
+    header.levels = levelCount(header.width, header.height);
+    if (flags & Blocks)
+        header.blockFormat = (header.channels == 3) ? 1 : 2;
+
+    size_t offset = alignOffset(sizeof(header));
+    for (int level = 0; level < (int)header.levels; level++) {
+        header.offsets[level] = offset;
+        offset = alignOffset(offset + levelLineLength(levelDimension(header.width, level),
+                                                      header.channels) *
+                                      levelDimension(header.height, level));
+    }
+    if (header.blockFormat) {
+        for (int level = 0; level < (int)header.levels; level++) {
+            header.blockOffsets[level] = offset;
+            offset = alignOffset(offset + compressedSize(levelDimension(header.width, level),
+                                                         levelDimension(header.height, level),
+                                                         levelBlockFormat(header.blockFormat)));
+        }
+    }
+
+    memory.assign((offset + 7) / 8, 0);
+    base = (const unsigned char *)memory.data();
+    size = offset;
+    memcpy(memory.data(), &header, sizeof(header));
+
+    // level 0 is bmpread()'s output, without its padding bytes (which it
+    // leaves as whatever was in memory)
+    unsigned char * out = (unsigned char *)memory.data();
+    size_t line = levelLineLength(bitmap.width, channels());
+    for (int y = 0; y < bitmap.height; y++)
+        memcpy(out + header.offsets[0] + y * line, bitmap.data + y * line,
+               (size_t)bitmap.width * channels());
+    bmpread_free(&bitmap);
+
+    // Each level is made from the one above, so the levels go one at a time,
+    // but the lines of a big one are split into bands for parallel to share
+    // out. Below about 256 KB a level is done before the bands would start.
+    for (int level = 1; level < levels(); level++) {
+        const unsigned char * src = data(level - 1);
+        int srcWidth = width(level - 1), srcHeight = height(level - 1);
+        size_t srcLine = lineLength(level - 1), dstLine = lineLength(level);
+        unsigned char * dst = out + header.offsets[level];
+        int dstWidth = width(level), dstHeight = height(level), levelChannels = channels();
+
+        auto band = [=](int firstRow, int endRow) {
+            downsample(src, srcWidth, srcHeight, srcLine, dst, dstWidth, dstLine,
+                       levelChannels, firstRow, endRow);
+        };
+        if (parallel && dstLine * dstHeight >= (256 << 10))
+            parallel(dstHeight, band);
+        else
+            band(0, dstHeight);
+    }
+
+    // Blocks are encoded from each level as it's stored, bottom line first,
+    // so they go up the same way round. Each row of blocks (4 lines) is
+    // encoded on its own, so parallel can share them out the same way.
+    for (int level = 0; hasBlocks() && level < levels(); level++) {
+        const unsigned char * pixels = data(level);
+        int levelWidth = width(level), levelHeight = height(level), levelChannels = channels();
+        size_t line = lineLength(level);
+        BlockFormat format = blockFormat();
+        size_t rowSize = compressedSize(levelWidth, 1, format);
+        unsigned char * dst = out + header.blockOffsets[level];
+
+        auto band = [=](int firstRow, int endRow) {
+            int firstLine = firstRow * 4;
+            int lines = std::min(endRow * 4, levelHeight) - firstLine;
+            std::vector<unsigned char> encoded =
+                compressBlocks(pixels + firstLine * line, levelWidth, lines, line,
+                               levelChannels, format, CompressQuality::Normal, 1);
+            memcpy(dst + firstRow * rowSize, encoded.data(), encoded.size());
+        };
+        int rows = (levelHeight + 3) / 4;
+        if (parallel && line * levelHeight >= (256 << 10))
+            parallel(rows, band);
+        else
+            band(0, rows);
+    }
+
+    // Written off to the side and renamed into place, so nothing ever maps
+    // half a sidecar. Failing to write it only costs the next load a cook.
+    std::string temp = sidecar + "." +
+                       std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) +
+                       ".tmp";
+    if (FILE * fp = fopen(temp.c_str(), "wb")) {
+        bool written = fwrite(base, 1, size, fp) == size;
+        if (fclose(fp) == 0 && written) {
+#ifdef _WIN32
+            remove(sidecar.c_str());
+#endif
+            if (rename(temp.c_str(), sidecar.c_str()) == 0)
+                return true;
+        }
+        remove(temp.c_str());
+    }
+
+    return true;
+}
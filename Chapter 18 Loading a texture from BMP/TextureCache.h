@@ -0,0 +1,132 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "bmpread.h"
+#include "TextureCompress.h"
+
+// A texture cooked for upload: the pixels bmpread() decodes out of a bitmap,
+// plus every mip level below them, ready to hand straight to glTexImage2D().
+//
+// The first time a bitmap is loaded it's decoded as usual, and the result is
+// written next to it as a sidecar file (texture.bmp -> texture.bmp.cooked).
+// Later loads just map the sidecar into memory, with no parsing, decoding or
+// swizzling. The sidecar records the bitmap's size, modification time and a
+// hash of its contents; if the size or time changed, the bitmap is hashed
+// again, and the sidecar is cooked again if that doesn't match either.
+//
+// Levels are laid out the way bmpread() lays out its output by default: RGB,
+// or RGBA with BMPREAD_ALPHA, bottom line first, each line padded to a
+// multiple of 4 bytes (so upload with GL_UNPACK_ALIGNMENT 4). Each level is
+// half the size of the one above, rounded down, down to 1x1; each pixel
+// averages the box of the level above it covers, which for odd sizes takes
+// in part of a third line or column so that nothing along the edges is lost.
+// The common even-sized levels are plain 2x2 boxes, vectorized with SSE2.
+// With a BMPREAD_POT_* flag, sizes that aren't powers of 2 are brought to one
+// before any of that, so every level halves evenly.
+//
+// With CookedTexture::Blocks in the flags, every level is also stored block
+// compressed (see TextureCompress.h), BC1 from RGB or BC3 from RGBA, for
+// glCompressedTexImage2D() where the driver has S3TC; the plain levels stay
+// alongside for where it hasn't. Encoding only happens when cooking, so it's
+// paid once per bitmap rather than on every start.
+//
+// Cooking happens on whatever thread calls load(), e.g. a TextureLoader
+// worker by way of loadCooked(). Levels are made one after another, since
+// each comes from the one above, but the lines of each big level can be
+// shared out: given a ParallelFor, load() hands it every level of 256 KB or
+// more, and the pool behind it does bands of lines at once (loadCooked()
+// passes TextureLoader::parallelFor()). The sidecar comes out the same
+// either way.
+
+// Calls body(first, end) over ranges that together cover 0 to count, on as
+// many threads as it likes, and returns once they're all done.
+typedef std::function<void(int count, const std::function<void(int first, int end)> & body)>
+    ParallelFor;
+
+class CookedTexture {
+public:
+    // a flag for load(), along with the BMPREAD_* ones: store block
+    // compressed levels too
+    static const unsigned Blocks = 1u << 16;
+
+    CookedTexture();
+    CookedTexture(CookedTexture && other);
+    CookedTexture & operator=(CookedTexture && other);
+    ~CookedTexture();
+
+    CookedTexture(const CookedTexture &) = delete;
+    CookedTexture & operator=(const CookedTexture &) = delete;
+
+    // Loads the bitmap at path through its sidecar, cooking it first if
+    // there's no valid one. flags as for bmpread(), except that
+    // BMPREAD_TOP_DOWN and BMPREAD_BYTE_ALIGN are ignored (see above), plus
+    // Blocks.
+    // Returns false if the bitmap can't be loaded. A sidecar that can't be
+    // written isn't an error; the cooked texture is just used from memory.
+    // parallel, if given, shares out making the mip levels (see above).
+    bool load(const std::string & path, unsigned flags = 0,
+              const ParallelFor & parallel = ParallelFor());
+
+    // frees the pixels and unmaps the sidecar
+    void clear();
+
+    bool loaded() const { return base != nullptr; }
+    bool cacheHit() const { return hit; } // whether load() used a sidecar
+
+    int channels() const { return (int)header().channels; } // 3 or 4
+    int levels() const { return (int)header().levels; }
+
+    int width(int level = 0) const;
+    int height(int level = 0) const;
+    int contentWidth() const { return (int)header().contentWidth; } // see bmpread_t
+    int contentHeight() const { return (int)header().contentHeight; }
+    size_t lineLength(int level = 0) const; // bytes, padding included
+    const unsigned char * data(int level = 0) const;
+
+    // the block compressed levels, with Blocks; BC1 for 3 channels, BC3 for 4
+    bool hasBlocks() const { return header().blockFormat != 0; }
+    BlockFormat blockFormat() const;
+    const unsigned char * blocks(int level = 0) const;
+    size_t blocksSize(int level = 0) const;
+
+    // The sidecar's header. Stored in the byte order of the machine that
+    // wrote it; a sidecar from a machine with the other order fails the
+    // version check and is simply cooked again.
+    struct Header {
+        char     magic[8];    // "BMPCOOK" and a 0
+        uint32_t version;     // Version below
+        uint32_t flags;       // BMPREAD_* flags the pixels were decoded with, and Blocks
+        uint32_t width;       // of level 0
+        uint32_t height;
+        uint32_t channels;
+        uint32_t levels;
+        uint32_t contentWidth;  // of level 0, as in bmpread_t
+        uint32_t contentHeight;
+        uint32_t blockFormat; // 0 for none, 1 for BC1, 2 for BC3
+        uint64_t sourceSize;  // of the bitmap file, in bytes
+        int64_t  sourceTime;  // its modification time, in seconds
+        uint64_t sourceHash;  // FNV-1a of its contents
+        uint64_t offsets[32]; // where each level starts in the sidecar
+        uint64_t blockOffsets[32]; // and its blocks, with blockFormat
+    };
+
+    static const uint32_t Version = 4;
+
+private:
+    const Header & header() const { return *(const Header *)base; }
+    bool cook(const std::string & path, const std::string & sidecar,
+              unsigned flags, const ParallelFor & parallel);
+
+    const unsigned char * base; // start of the sidecar, mapped or in memory
+    size_t size;
+    bool mapped;                // base is a mapping, not owned below
+    bool hit;
+    std::vector<uint64_t> memory; // a sidecar that was just cooked
+};
+
+#endif
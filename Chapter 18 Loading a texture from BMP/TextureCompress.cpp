@@ -0,0 +1,468 @@
+#include "TextureCompress.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <string.h>
+#include <thread>
+
+// -------------- pixels
+
+// the 4x4 pixels of block (bx, by) as RGBA, repeating the last column and
+// line where the block hangs over the edge
+static void fetchBlock(const unsigned char * pixels, int width, int height,
+                       size_t lineLength, int channels, int bx, int by,
+                       unsigned char block[16][4])
+{
+    for (int y = 0; y < 4; y++) {
+        const unsigned char * line = pixels + (size_t)std::min(by * 4 + y, height - 1) * lineLength;
+
+        for (int x = 0; x < 4; x++) {
+            const unsigned char * pixel = line + (size_t)std::min(bx * 4 + x, width - 1) * channels;
+            unsigned char * out = block[y * 4 + x];
+            out[0] = pixel[0];
+            out[1] = pixel[1];
+            out[2] = pixel[2];
+            out[3] = (channels == 4) ? pixel[3] : 255;
+        }
+    }
+}
+
+static void put16(unsigned char * out, unsigned value)
+{
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+}
+
+static unsigned get16(const unsigned char * in)
+{
+    return in[0] | (unsigned)in[1] << 8;
+}
+
+// -------------- color
+
+static uint16_t pack565(const float color[3])
+{
+    int r = (int)(color[0] * (31.0f / 255.0f) + 0.5f);
+    int g = (int)(color[1] * (63.0f / 255.0f) + 0.5f);
+    int b = (int)(color[2] * (31.0f / 255.0f) + 0.5f);
+    r = std::min(std::max(r, 0), 31);
+    g = std::min(std::max(g, 0), 63);
+    b = std::min(std::max(b, 0), 31);
+    return (uint16_t)(r << 11 | g << 5 | b);
+}
+
+static void unpack565(unsigned color, int rgb[3])
+{
+    int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// The colors a block with endpoints c0, c1 decodes to. BC1 blocks with
+// c0 <= c1 are in 3-color mode, with the last index transparent black; BC3
+// always uses all 4. The encoder only ever writes 4-color blocks.
+static void colorPalette(unsigned c0, unsigned c1, bool fourColors, int palette[4][4])
+{
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    palette[0][3] = palette[1][3] = 255;
+
+    for (int i = 0; i < 3; i++) {
+        if (fourColors || c0 > c1) {
+            palette[2][i] = (2 * palette[0][i] + palette[1][i] + 1) / 3;
+            palette[3][i] = (palette[0][i] + 2 * palette[1][i] + 1) / 3;
+        } else {
+            palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+            palette[3][i] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = (fourColors || c0 > c1) ? 255 : 0;
+}
+
+// Quantizes a pair of endpoints and picks each pixel's nearest color between
+// them. Returns the block's squared error.
+static int fitColors(const unsigned char block[16][4], const float e0[3], const float e1[3],
+                     unsigned & c0, unsigned & c1, uint32_t & indices)
+{
+    c0 = pack565(e0);
+    c1 = pack565(e1);
+    if (c0 < c1)
+        std::swap(c0, c1); // c0 > c1 is what makes it a 4-color block
+
+    int palette[4][4];
+    colorPalette(c0, c1, true, palette);
+    int colors = (c0 == c1) ? 1 : 4; // equal endpoints would read as 3-color
+
+    int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestError = 1 << 30;
+        for (int j = 0; j < colors; j++) {
+            int dr = block[i][0] - palette[j][0];
+            int dg = block[i][1] - palette[j][1];
+            int db = block[i][2] - palette[j][2];
+            int e = dr * dr + dg * dg + db * db;
+            if (e < bestError) {
+                best = j;
+                bestError = e;
+            }
+        }
+        indices |= (uint32_t)best << (2 * i);
+        error += bestError;
+    }
+    return error;
+}
+
+// Fast: the corners of the block's bounding box, inset a little since the
+// extremes are rarely worth a whole endpoint each, on whichever diagonal runs
+// the same way as the colors do.
+static void boxEndpoints(const unsigned char block[16][4], float e0[3], float e1[3])
+{
+    int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 }, sum[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 3; c++) {
+            lo[c] = std::min(lo[c], (int)block[i][c]);
+            hi[c] = std::max(hi[c], (int)block[i][c]);
+            sum[c] += block[i][c];
+        }
+    }
+
+    int axis = 0; // the channel that varies most
+    for (int c = 1; c < 3; c++) {
+        if (hi[c] - lo[c] > hi[axis] - lo[axis])
+            axis = c;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        float inset = (hi[c] - lo[c]) / 16.0f;
+        e0[c] = hi[c] - inset;
+        e1[c] = lo[c] + inset;
+
+        if (c != axis) {
+            int covariance = 0;
+            for (int i = 0; i < 16; i++)
+                covariance += (block[i][axis] * 16 - sum[axis]) * (block[i][c] * 16 - sum[c]);
+            if (covariance < 0)
+                std::swap(e0[c], e1[c]);
+        }
+    }
+}
+
+// Normal: the ends of the block's colors projected onto their principal
+// axis, found by a few rounds of power iteration on the covariance.
+static void axisEndpoints(const unsigned char block[16][4], float e0[3], float e1[3])
+{
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 3; c++)
+            mean[c] += block[i][c];
+    }
+    for (int c = 0; c < 3; c++)
+        mean[c] /= 16;
+
+    float cov[6] = { 0, 0, 0, 0, 0, 0 }; // rr, rg, rb, gg, gb, bb
+    for (int i = 0; i < 16; i++) {
+        float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+    }
+
+    // starting from the bounding box's diagonal converges in fewer rounds
+    float axis[3], start[3];
+    boxEndpoints(block, axis, start);
+    for (int c = 0; c < 3; c++)
+        axis[c] -= start[c];
+    if (axis[0] == 0 && axis[1] == 0 && axis[2] == 0)
+        axis[0] = axis[1] = axis[2] = 1;
+
+    for (int round = 0; round < 8; round++) {
+        float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        float length = std::max(fabsf(x), std::max(fabsf(y), fabsf(z)));
+        if (length < 1e-6f)
+            break; // all one color, or the axis started out orthogonal
+        axis[0] = x / length;
+        axis[1] = y / length;
+        axis[2] = z / length;
+    }
+
+    float norm = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float lo = 0, hi = 0;
+    for (int i = 0; i < 16; i++) {
+        float t = (block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1]
+                + (block[i][2] - mean[2]) * axis[2];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+
+    for (int c = 0; c < 3; c++) {
+        e0[c] = mean[c] + axis[c] * hi / norm;
+        e1[c] = mean[c] + axis[c] * lo / norm;
+    }
+}
+
+// High: with the indices fixed, solves for the endpoints that minimize the
+// squared error, and keeps going while that keeps lowering it.
+static int refineColors(const unsigned char block[16][4], unsigned & c0, unsigned & c1,
+                        uint32_t & indices, int error)
+{
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+    for (int round = 0; round < 4 && error > 0; round++) {
+        float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for (int i = 0; i < 16; i++) {
+            float a = weights[(indices >> (2 * i)) & 3], b = 1 - a;
+            aa += a * a; ab += a * b; bb += b * b;
+            for (int c = 0; c < 3; c++) {
+                ax[c] += a * block[i][c];
+                bx[c] += b * block[i][c];
+            }
+        }
+
+        float det = aa * bb - ab * ab;
+        if (fabsf(det) < 1e-6f)
+            break; // all on one index; nothing to solve
+
+        float e0[3], e1[3];
+        for (int c = 0; c < 3; c++) {
+            e0[c] = (bb * ax[c] - ab * bx[c]) / det;
+            e1[c] = (aa * bx[c] - ab * ax[c]) / det;
+        }
+
+        unsigned n0, n1;
+        uint32_t nIndices;
+        int nError = fitColors(block, e0, e1, n0, n1, nIndices);
+        if (nError >= error)
+            break;
+
+        c0 = n0; c1 = n1; indices = nIndices; error = nError;
+    }
+    return error;
+}
+
+static void encodeColor(const unsigned char block[16][4], CompressQuality quality,
+                        unsigned char out[8])
+{
+    float e0[3], e1[3];
+    if (quality == CompressQuality::Fast)
+        boxEndpoints(block, e0, e1);
+    else
+        axisEndpoints(block, e0, e1);
+
+    unsigned c0, c1;
+    uint32_t indices;
+    int error = fitColors(block, e0, e1, c0, c1, indices);
+    if (quality == CompressQuality::High)
+        refineColors(block, c0, c1, indices, error);
+
+    put16(out, c0);
+    put16(out + 2, c1);
+    put16(out + 4, indices & 0xffff);
+    put16(out + 6, indices >> 16);
+}
+
+// -------------- alpha
+
+// a0 > a1 interpolates 6 values between them; otherwise 4, plus 0 and 255
+static void alphaPalette(int a0, int a1, int palette[8])
+{
+    palette[0] = a0;
+    palette[1] = a1;
+
+    if (a0 > a1) {
+        for (int i = 1; i < 7; i++)
+            palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+    } else {
+        for (int i = 1; i < 5; i++)
+            palette[i + 1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+static int fitAlpha(const unsigned char block[16][4], int a0, int a1, uint64_t & indices)
+{
+    int palette[8];
+    alphaPalette(a0, a1, palette);
+
+    int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestError = 1 << 30;
+        for (int j = 0; j < 8; j++) {
+            int e = (block[i][3] - palette[j]) * (block[i][3] - palette[j]);
+            if (e < bestError) {
+                best = j;
+                bestError = e;
+            }
+        }
+        indices |= (uint64_t)best << (3 * i);
+        error += bestError;
+    }
+    return error;
+}
+
+static void encodeAlpha(const unsigned char block[16][4], CompressQuality quality,
+                        unsigned char out[8])
+{
+    int lo = 255, hi = 0, innerLo = 255, innerHi = 0;
+    for (int i = 0; i < 16; i++) {
+        int a = block[i][3];
+        lo = std::min(lo, a);
+        hi = std::max(hi, a);
+        if (a != 0 && a != 255) {
+            innerLo = std::min(innerLo, a);
+            innerHi = std::max(innerHi, a);
+        }
+    }
+
+    int a0 = hi, a1 = lo;
+    uint64_t indices;
+    int error = fitAlpha(block, a0, a1, indices);
+
+    // blocks mixing fully clear or opaque pixels with partial ones can do
+    // better with the 6-value mode, spending its range on the partial ones
+    if (quality == CompressQuality::High && error > 0 && innerLo <= innerHi) {
+        uint64_t innerIndices;
+        if (fitAlpha(block, innerLo, innerHi, innerIndices) < error) {
+            a0 = innerLo;
+            a1 = innerHi;
+            indices = innerIndices;
+        }
+    }
+
+    out[0] = (unsigned char)a0;
+    out[1] = (unsigned char)a1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// -------------- images
+
+size_t compressedSize(int width, int height, BlockFormat format)
+{
+    if (width <= 0 || height <= 0)
+        return 0;
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * (format == BlockFormat::BC1 ? 8 : 16);
+}
+
+std::vector<unsigned char> compressBlocks(const unsigned char * pixels, int width, int height,
+                                          size_t lineLength, int channels,
+                                          BlockFormat format, CompressQuality quality,
+                                          unsigned threads, CompressStats * stats)
+{
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    std::vector<unsigned char> blocks(compressedSize(width, height, format));
+    if (!pixels || blocks.empty() || (channels != 3 && channels != 4))
+        return std::vector<unsigned char>();
+
+    auto start = std::chrono::steady_clock::now();
+
+    int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    size_t blockSize = (format == BlockFormat::BC1) ? 8 : 16;
+
+    auto encodeRows = [&](int first, int last) {
+        unsigned char block[16][4];
+        for (int by = first; by < last; by++) {
+            unsigned char * out = blocks.data() + (size_t)by * blocksWide * blockSize;
+            for (int bx = 0; bx < blocksWide; bx++, out += blockSize) {
+                fetchBlock(pixels, width, height, lineLength, channels, bx, by, block);
+                if (format == BlockFormat::BC3) {
+                    encodeAlpha(block, quality, out);
+                    encodeColor(block, quality, out + 8);
+                } else {
+                    encodeColor(block, quality, out);
+                }
+            }
+        }
+    };
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    // a thread isn't worth starting for fewer than 8 rows of blocks
+    threads = std::max(1u, std::min(threads, (unsigned)blocksHigh / 8));
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+        workers.emplace_back(encodeRows, (int)(blocksHigh * (size_t)i / threads),
+                             (int)(blocksHigh * (size_t)(i + 1) / threads));
+    encodeRows(0, (int)(blocksHigh / threads));
+    for (std::thread & worker : workers)
+        worker.join();
+
+    if (stats) {
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (stats->seconds > 0)
+            stats->megapixelsPerSecond = (double)width * height / stats->seconds / 1e6;
+
+        std::vector<unsigned char> decoded = decompressBlocks(blocks.data(), width, height, format);
+        int compared = (format == BlockFormat::BC3) ? 4 : 3;
+        double squares = 0;
+        for (int y = 0; y < height; y++) {
+            const unsigned char * source = pixels + (size_t)y * lineLength;
+            const unsigned char * result = decoded.data() + (size_t)y * width * 4;
+            for (int x = 0; x < width; x++, source += channels, result += 4) {
+                for (int c = 0; c < compared; c++) {
+                    int s = (c < channels) ? source[c] : 255;
+                    squares += (s - result[c]) * (s - result[c]);
+                }
+            }
+        }
+
+        double mse = squares / ((double)width * height * compared);
+        stats->psnr = (mse > 0) ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+    }
+
+    return blocks;
+}
+
+std::vector<unsigned char> decompressBlocks(const unsigned char * blocks, int width, int height,
+                                            BlockFormat format)
+{
+    size_t size = compressedSize(width, height, format);
+    if (!blocks || size == 0)
+        return std::vector<unsigned char>();
+
+    std::vector<unsigned char> pixels((size_t)width * height * 4);
+    int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    bool bc3 = (format == BlockFormat::BC3);
+
+    for (int by = 0; by < blocksHigh; by++) {
+        for (int bx = 0; bx < blocksWide; bx++, blocks += bc3 ? 16 : 8) {
+            const unsigned char * color = bc3 ? blocks + 8 : blocks;
+
+            int palette[4][4];
+            unsigned c0 = get16(color), c1 = get16(color + 2);
+            colorPalette(c0, c1, bc3, palette);
+            uint32_t indices = get16(color + 4) | (uint32_t)get16(color + 6) << 16;
+
+            int alphas[8];
+            uint64_t alphaIndices = 0;
+            if (bc3) {
+                alphaPalette(blocks[0], blocks[1], alphas);
+                for (int i = 0; i < 6; i++)
+                    alphaIndices |= (uint64_t)blocks[2 + i] << (8 * i);
+            }
+
+            for (int i = 0; i < 16; i++) {
+                int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+                if (x >= width || y >= height)
+                    continue;
+
+                unsigned char * out = pixels.data() + ((size_t)y * width + x) * 4;
+                const int * decoded = palette[(indices >> (2 * i)) & 3];
+                out[0] = (unsigned char)decoded[0];
+                out[1] = (unsigned char)decoded[1];
+                out[2] = (unsigned char)decoded[2];
+                out[3] = (unsigned char)(bc3 ? alphas[(alphaIndices >> (3 * i)) & 7] : decoded[3]);
+            }
+        }
+    }
+
+    return pixels;
+}
@@ -0,0 +1,57 @@
+#ifndef TEXTURE_COMPRESS_H
+#define TEXTURE_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Block compression of decoded pixels into BC1 (a.k.a. DXT1, for
+// GL_COMPRESSED_RGB_S3TC_DXT1_EXT) or BC3 (DXT5, for
+// GL_COMPRESSED_RGBA_S3TC_DXT5_EXT), to upload with glCompressedTexImage2D()
+// in a quarter (BC3) or an eighth (BC1, from RGBA) of the memory.
+//
+// Input is laid out the way bmpread() and CookedTexture lay out theirs: 3 or
+// 4 bytes per pixel, R, G, B (, A), lineLength bytes from one line to the
+// next. Lines go into blocks in the order they're stored, so bmpread()'s
+// bottom-first output comes out bottom-first, as GL expects. Sizes that
+// aren't multiples of 4 are fine: the blocks along the right and top edges
+// are padded out by repeating their last column and line.
+
+enum class BlockFormat {
+    BC1, // 8 bytes per 4x4 block; color only (alpha is ignored)
+    BC3  // 16 bytes per 4x4 block; color plus interpolated alpha
+};
+
+// Quality presets, trading encode time for PSNR.
+enum class CompressQuality {
+    Fast,   // endpoints from the corners of each block's bounding box
+    Normal, // endpoints along each block's principal axis
+    High    // Normal, then refined by least squares until it stops helping
+};
+
+// What compressBlocks() measured, if asked.
+struct CompressStats {
+    double psnr;              // dB, over R, G, B (and A for BC3)
+    double seconds;           // spent encoding, without the PSNR
+    double megapixelsPerSecond;
+};
+
+// Bytes of BC1 or BC3 data for a width x height image (or mip level).
+size_t compressedSize(int width, int height, BlockFormat format);
+
+// Compresses width x height pixels into BC1 or BC3 blocks, split across
+// threads (0 = one per CPU; small images just use the calling thread). With
+// stats, also decodes the result to measure its PSNR.
+std::vector<unsigned char> compressBlocks(const unsigned char * pixels, int width, int height,
+                                          size_t lineLength, int channels,
+                                          BlockFormat format,
+                                          CompressQuality quality = CompressQuality::Normal,
+                                          unsigned threads = 0,
+                                          CompressStats * stats = nullptr);
+
+// Decodes BC1 or BC3 blocks back into 4-channel RGBA pixels, lines
+// width * 4 bytes long, e.g. to check what compressBlocks() did.
+std::vector<unsigned char> decompressBlocks(const unsigned char * blocks, int width, int height,
+                                            BlockFormat format);
+
+#endif
@@ -0,0 +1,192 @@
+#include "TextureLoader.h"
+#include <atomic>
+#include <memory>
+#include <string.h>
+
+// -------------- Bitmap
+
+static Bitmap decode(const std::string & path, unsigned flags)
+{
+    Bitmap bitmap;
+    bitmap.path = path;
+    bmpread(path.c_str(), flags, &bitmap.bmp);
+    return bitmap;
+}
+
+Bitmap::Bitmap()
+{
+    memset(&bmp, 0, sizeof(bmp));
+}
+
+Bitmap::Bitmap(Bitmap && other) : path(std::move(other.path)), bmp(other.bmp)
+{
+    memset(&other.bmp, 0, sizeof(other.bmp));
+}
+
+Bitmap & Bitmap::operator=(Bitmap && other)
+{
+    if (this != &other) {
+        bmpread_free(&bmp);
+        path = std::move(other.path);
+        bmp = other.bmp;
+        memset(&other.bmp, 0, sizeof(other.bmp));
+    }
+    return *this;
+}
+
+Bitmap::~Bitmap()
+{
+    bmpread_free(&bmp);
+}
+
+// -------------- TextureLoader
+
+TextureLoader::TextureLoader(unsigned threads) : stopping(false)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(&TextureLoader::work, this);
+}
+
+TextureLoader::~TextureLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread & worker : workers)
+        worker.join();
+}
+
+std::future<Bitmap> TextureLoader::load(const std::string & path, unsigned flags)
+{
+    // std::function needs something copyable, which a packaged_task isn't
+    auto task = std::make_shared<std::packaged_task<Bitmap()>>(
+        [path, flags] { return decode(path, flags); });
+    std::future<Bitmap> result = task->get_future();
+
+    queue([task] { (*task)(); });
+    return result;
+}
+
+std::future<CookedTexture> TextureLoader::loadCooked(const std::string & path, unsigned flags)
+{
+    auto task = std::make_shared<std::packaged_task<CookedTexture()>>(
+        [this, path, flags] {
+            CookedTexture texture;
+            texture.load(path, flags,
+                         [this](int count, const std::function<void(int, int)> & body) {
+                             parallelFor(count, body);
+                         });
+            return texture;
+        });
+    std::future<CookedTexture> result = task->get_future();
+
+    queue([task] { (*task)(); });
+    return result;
+}
+
+std::vector<std::future<Bitmap>> TextureLoader::loadAll(const std::vector<std::string> & paths,
+                                                        unsigned flags)
+{
+    std::vector<std::future<Bitmap>> results;
+    results.reserve(paths.size());
+
+    for (const std::string & path : paths)
+        results.push_back(load(path, flags));
+    return results;
+}
+
+void TextureLoader::load(const std::string & path, unsigned flags,
+                         std::function<void(Bitmap)> done)
+{
+    queue([path, flags, done] { done(decode(path, flags)); });
+}
+
+// What the threads doing one parallelFor() share. Helpers that only get to
+// run after every band is taken find nothing left, so it's kept alive by
+// them as well as by the caller.
+struct Bands {
+    int count;
+    int bands;
+    const std::function<void(int, int)> * body; // valid until done == bands
+    std::atomic<int> next;
+    std::atomic<int> done;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+// takes bands until there are none left
+static void runBands(Bands & state)
+{
+    for (int band; (band = state.next++) < state.bands;) {
+        (*state.body)((int)((long long)state.count * band / state.bands),
+                      (int)((long long)state.count * (band + 1) / state.bands));
+
+        if (++state.done == state.bands) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.finished.notify_all();
+        }
+    }
+}
+
+void TextureLoader::parallelFor(int count, const std::function<void(int, int)> & body)
+{
+    int bands = (int)workers.size();
+    if (bands > count)
+        bands = count;
+    if (bands <= 1) {
+        if (count > 0)
+            body(0, count);
+        return;
+    }
+
+    auto state = std::make_shared<Bands>();
+    state->count = count;
+    state->bands = bands;
+    state->body = &body;
+    state->next = 0;
+    state->done = 0;
+
+    for (int i = 1; i < bands; i++)
+        queue([state] { runBands(*state); });
+    runBands(*state);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done == bands; });
+}
+
+void TextureLoader::queue(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void TextureLoader::work()
+{
+    for (;;) {
+        std::function<void()> job;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+            if (jobs.empty())
+                return; // stopping, and nothing left to do
+
+            job = std::move(jobs.front());
+            jobs.pop();
+        }
+
+        job();
+    }
+}
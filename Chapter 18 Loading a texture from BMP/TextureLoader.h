@@ -0,0 +1,88 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bmpread.h"
+#include "TextureCache.h"
+
+// A bitmap decoded by bmpread(), freed with bmpread_free() when it goes away.
+// Move it around like a std::unique_ptr; it can't be copied.
+
+class Bitmap {
+public:
+    Bitmap();
+    Bitmap(Bitmap && other);
+    Bitmap & operator=(Bitmap && other);
+    ~Bitmap();
+
+    Bitmap(const Bitmap &) = delete;
+    Bitmap & operator=(const Bitmap &) = delete;
+
+    // false if the file couldn't be loaded; bmp is then all 0
+    bool loaded() const { return bmp.data != nullptr; }
+
+    std::string path;
+    bmpread_t bmp;
+};
+
+// Decodes bitmaps on a pool of worker threads, so a batch of textures takes
+// about as long as the slowest one instead of all of them added up.
+//
+// Only the decoding happens on the workers. GL calls have to stay on the
+// thread that owns the context, so that thread queues up its loads early,
+// carries on setting up, and then waits on each future right before its
+// glTexImage2D call, in whatever order it likes.
+
+class TextureLoader {
+public:
+    // threads = 0 starts one worker per CPU
+    explicit TextureLoader(unsigned threads = 0);
+
+    // loads still queued are finished before the workers are joined
+    ~TextureLoader();
+
+    TextureLoader(const TextureLoader &) = delete;
+    TextureLoader & operator=(const TextureLoader &) = delete;
+
+    // queues one bitmap, flags as for bmpread()
+    std::future<Bitmap> load(const std::string & path, unsigned flags = 0);
+
+    // queues a whole batch; the futures come back in the same order as paths
+    std::vector<std::future<Bitmap>> loadAll(const std::vector<std::string> & paths,
+                                             unsigned flags = 0);
+
+    // like load(), but through the cooked texture cache in TextureCache.h,
+    // which also gives the texture's mip levels
+    std::future<CookedTexture> loadCooked(const std::string & path, unsigned flags = 0);
+
+    // queues one bitmap and calls done with it on the worker thread once it's
+    // decoded (so no GL calls in there)
+    void load(const std::string & path, unsigned flags,
+              std::function<void(Bitmap)> done);
+
+    // Splits 0 to count into one band per worker and calls body(first, end)
+    // for each, the calling thread doing bands too, and returns once every
+    // band is done. Fine to call from a job on a worker (loadCooked() does,
+    // for the mip levels): if the other workers are all busy, the caller
+    // just does every band itself. A ParallelFor, for CookedTexture::load().
+    void parallelFor(int count, const std::function<void(int first, int end)> & body);
+
+private:
+    void queue(std::function<void()> job);
+    void work();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+#endif
@@ -43,6 +43,73 @@
  */
 #include <stdint.h>
 
+/* bmpread_mmap() uses the platform's file mapping API where there is one, and
+ * otherwise falls back to reading the whole file into memory at once.
+ */
+#if defined(_WIN32)
+#define BMPREAD_MMAP_WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define BMPREAD_MMAP_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* BMPREAD_THREADED decodes on a few threads at once using the platform's
+ * native threads (on older glibc, that means linking with -pthread).  Define
+ * BMPREAD_NO_THREADS to leave threading out entirely, in which case the flag
+ * is quietly ignored.
+ */
+#if !defined(BMPREAD_NO_THREADS)
+#if defined(_WIN32)
+#define BMPREAD_THREADS_ENABLED
+#define BMPREAD_THREADS_WIN32
+#elif defined(BMPREAD_MMAP_POSIX)
+#define BMPREAD_THREADS_ENABLED
+#define BMPREAD_THREADS_POSIX
+#include <pthread.h>
+#endif
+#endif
+
+/* With BMPREAD_THREADED, the most threads we'll decode a bitmap with, and the
+ * least amount of output (in bytes) it's worth starting a thread for.
+ */
+#ifndef BMPREAD_MAX_THREADS
+#define BMPREAD_MAX_THREADS 8
+#endif
+#ifndef BMPREAD_THREAD_MIN_BYTES
+#define BMPREAD_THREAD_MIN_BYTES (1u << 20)
+#endif
+
+/* Set by bmpread_set_max_threads(); 0 for one thread per CPU. */
+static size_t max_threads = 0;
+
+/* On x86, the hottest decoders have SSSE3 and AVX2 versions, picked at run
+ * time based on what the CPU supports (see GetCpuFeatures()).  They're
+ * compiled with per-function target attributes, so the rest of the library
+ * doesn't need any special compiler flags.  Define BMPREAD_NO_SIMD to build
+ * only the portable decoders, or BMPREAD_NO_AVX2 to stop at SSSE3 even on
+ * CPUs with AVX2 (the test uses both to check every path against the
+ * portable one).
+ */
+#if !defined(BMPREAD_NO_SIMD) && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(_M_X64) || defined(_M_IX86))
+#if defined(__GNUC__) || defined(__clang__)
+#define BMPREAD_SIMD_X86
+#define BMPREAD_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER)
+#define BMPREAD_SIMD_X86
+#define BMPREAD_TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
 /* This code makes a number of assumptions about a byte being 8 bits, which is
  * technically not required by the C spec(s).  It's likely that not a whole lot
  * here would need to change if CHAR_BIT != 8, but I haven't taken the time to
@@ -119,37 +186,216 @@ static int CanNegate(int32_t x)
     return x != INT32_MIN;
 }
 
-/* Reads up to 4 little-endian bytes from fp and stores the result in the
- * uint32_t pointed to by dest in the host's byte order.  Returns 0 on EOF or
- * nonzero on success.
+/* How many bytes we try to read from a file at once while decoding pixels.
+ * Scan lines are read in chunks of about this size (but always whole lines),
+ * so a bitmap whose pixel array fits is read with a single fread().  Much
+ * bigger stops paying off: the chunk falls out of cache before it's decoded,
+ * and faulting in a fresh multi-megabyte buffer costs small files more than
+ * the reads it saves.
+ */
+#ifndef BMPREAD_READ_CHUNK
+#define BMPREAD_READ_CHUNK (256u << 10)
+#endif
+
+/* When decoding a region of a bitmap file, how many bytes of each scan line
+ * have to fall outside it before we read just the part of each line we need,
+ * one read per line, instead of reading whole lines in chunks.  Around here,
+ * skipping the bytes starts saving more than the extra reads cost.
+ */
+#ifndef BMPREAD_SKIP_MIN_BYTES
+#define BMPREAD_SKIP_MIN_BYTES (16u << 10)
+#endif
+
+/* The allocator used until bmpread_set_allocator() says otherwise: plain
+ * malloc() and free().
+ */
+static void * DefaultAlloc(void * user, size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void DefaultRelease(void * user, void * ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+static const bmpread_allocator_t default_allocator =
+{
+    DefaultAlloc, DefaultRelease, NULL
+};
+
+/* The allocator for calls that aren't given one. */
+static bmpread_allocator_t global_allocator =
+{
+    DefaultAlloc, DefaultRelease, NULL
+};
+
+/* Allocates size bytes with the given allocator.  Returns NULL if out of
+ * memory.
+ */
+static void * Allocate(const bmpread_allocator_t * allocator, size_t size)
+{
+    return allocator->alloc(allocator->user, size);
+}
+
+/* Allocates count * size bytes, all 0, with the given allocator.  Returns NULL
+ * if out of memory or the size overflows.
+ */
+static void * AllocateZeroed(const bmpread_allocator_t * allocator,
+                             size_t count,
+                             size_t size)
+{
+    void * ptr;
+
+    if(!CanMultiply(count, size)) return NULL;
+
+    if((ptr = Allocate(allocator, count * size)))
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+/* Gives memory from Allocate() back to its allocator, unless the allocator
+ * doesn't free individual blocks (e.g. an arena).
+ */
+static void Release(const bmpread_allocator_t * allocator, void * ptr)
+{
+    if(ptr && allocator->release)
+        allocator->release(allocator->user, ptr);
+}
+
+/* Where the bytes of a bitmap file come from: either a stdio file, or a block
+ * of memory holding the entire file (possibly an mmap'd view of one).  Either
+ * way, reads are served out of a window of contiguous bytes.  A memory
+ * source's window is the whole file, so nothing is copied; headers are parsed
+ * and scan lines are decoded straight out of the caller's buffer.  A file
+ * source's window is its own buffer, refilled with one big fread() whenever a
+ * read falls outside it.
+ */
+typedef struct bmp_source
+{
+    FILE          * fp;        /* File pointer, or NULL when reading memory. */
+    const uint8_t * data;      /* The window: bytes of the file from start. */
+    size_t          start;     /* File offset of data[0]. */
+    size_t          len;       /* How many bytes of the file are at data. */
+    size_t          pos;       /* Current read position, as a file offset. */
+    size_t          file_pos;  /* Where fp is positioned. */
+    size_t          readahead; /* How much a refill should try to read. */
+    uint8_t       * buf;       /* Backing store for a file source's window. */
+    size_t          buf_size;  /* Allocated size of buf. */
+
+    const bmpread_allocator_t * allocator; /* Where buf comes from. */
+
+} bmp_source;
+
+/* Sets up src to read the given block of memory.
+ */
+static void SourceInitMem(bmp_source * src, const uint8_t * mem, size_t size)
+{
+    memset(src, 0, sizeof(*src));
+    src->data = mem;
+    src->len  = size;
+}
+
+/* Sets up src to read from an open file, positioned at its beginning.  We do
+ * our own buffering, so stdio's is turned off; every refill then goes
+ * straight to the OS instead of being copied through another buffer.
+ */
+static void SourceInitFile(bmp_source * src,
+                           FILE * fp,
+                           const bmpread_allocator_t * allocator)
+{
+    memset(src, 0, sizeof(*src));
+    src->fp = fp;
+    src->allocator = allocator;
+    setvbuf(fp, NULL, _IONBF, 0);
+}
+
+/* Moves the read position of src to the given offset from the beginning of
+ * the file.  Returns 0 if the offset can't be represented or nonzero on
+ * success.  Whether there's anything to read there is up to SourceRead().
+ */
+static int SourceSeek(bmp_source * src, uint32_t offset)
+{
+    if(!CanMakeSizeT(offset)) return 0;
+    src->pos = offset;
+    return 1;
+}
+
+/* Refills a file source's window so it starts at the current read position
+ * and holds at least len bytes, reading up to readahead bytes if the file has
+ * them.  Returns 0 on EOF, i/o or allocation error, or nonzero on success.
  */
-static int ReadLittleBytes(uint32_t * dest, int bytes, FILE * fp)
+static int SourceFill(bmp_source * src, size_t len)
 {
-    uint32_t shift = 0;
+    size_t want = ((src->readahead > len) ? src->readahead : len);
+    size_t got;
 
-    *dest = 0;
+    if(want > src->buf_size)
+    {
+        Release(src->allocator, src->buf);
+        src->buf_size = 0;
+        src->data = NULL;
+        src->len = 0;
+        if(!(src->buf = (uint8_t *)Allocate(src->allocator, want))) return 0;
+        src->buf_size = want;
+    }
 
-    while(bytes--)
+    if(src->file_pos != src->pos)
     {
-        int byte;
-        if((byte = fgetc(fp)) == EOF) return 0;
+        if(!CanMakeLong(src->pos))                   return 0;
+        if(fseek(src->fp, (long)src->pos, SEEK_SET)) return 0;
+        src->file_pos = src->pos;
+    }
+
+    got = fread(src->buf, 1, want, src->fp);
+
+    src->file_pos += got;
+    src->data  = src->buf;
+    src->start = src->pos;
+    src->len   = got;
+
+    return got >= len;
+}
 
-        *dest += (uint32_t)byte << shift;
-        shift += 8;
+/* Reads len bytes from src's current position and advances past them.
+ * Returns a pointer to the bytes, valid until the next read, or NULL on EOF
+ * or error.
+ */
+static const uint8_t * SourceRead(bmp_source * src, size_t len)
+{
+    const uint8_t * p;
+    size_t offset = src->pos - src->start;
+
+    if(src->pos < src->start || offset > src->len ||
+       len > src->len - offset)
+    {
+        if(!src->fp)               return NULL;
+        if(!SourceFill(src, len))  return NULL;
+        offset = 0;
     }
 
-    return 1;
+    p = src->data + offset;
+    src->pos += len;
+    return p;
 }
 
-/* Reads a little-endian uint32_t from fp and stores the result in *dest in the
- * host's byte order.  Returns 0 on EOF or nonzero on success.
+/* Reads four bytes out of a memory buffer and converts it to a uint32_t.
+ */
+#define LoadLittleUint32(buf) (((uint32_t)(buf)[0]      ) + \
+                               ((uint32_t)(buf)[1] <<  8) + \
+                               ((uint32_t)(buf)[2] << 16) + \
+                               ((uint32_t)(buf)[3] << 24))
+
+/* Reads two bytes out of a memory buffer and converts it to a uint16_t.
  */
-#define ReadLittleUint32(dest, fp) ReadLittleBytes(dest, 4, fp)
+#define LoadLittleUint16(buf) (((uint16_t)(buf)[0]     ) + \
+                               ((uint16_t)(buf)[1] << 8))
 
-/* Reads a little-endian int32_t from fp and stores the result in *dest in the
- * host's byte order.  Returns 0 on EOF or nonzero on success.
+/* Reads four bytes out of a memory buffer and converts it to an int32_t.
  */
-static int ReadLittleInt32(int32_t * dest, FILE * fp)
+static int32_t LoadLittleInt32(const uint8_t * buf)
 {
     /* I *believe* casting unsigned -> signed is implementation-defined when
      * the unsigned value is out of range for the signed type, which would be
@@ -165,31 +411,8 @@ static int ReadLittleInt32(int32_t * dest, FILE * fp)
 
     } t;
 
-    if(!ReadLittleBytes(&t.uint32, 4, fp)) return 0;
-    *dest = t.int32;
-    return 1;
-}
-
-/* Reads a little-endian uint16_t from fp and stores the result in *dest in the
- * host's byte order.  Returns 0 on EOF or nonzero n success.
- */
-static int ReadLittleUint16(uint16_t * dest, FILE * fp)
-{
-    uint32_t t;
-    if(!ReadLittleBytes(&t, 2, fp)) return 0;
-    *dest = (uint16_t)t;
-    return 1;
-}
-
-/* Reads a uint8_t from fp and stores the result in *dest.  Returns 0 on EOF or
- * nonzero on success.
- */
-static int ReadUint8(uint8_t * dest, FILE * fp)
-{
-    int byte;
-    if((byte = fgetc(fp)) == EOF) return 0;
-    *dest = (uint8_t)byte;
-    return 1;
+    t.uint32 = LoadLittleUint32(buf);
+    return t.int32;
 }
 
 /* Bitmap file header, including magic bytes.
@@ -203,32 +426,35 @@ typedef struct bmp_header
 
 } bmp_header;
 
-/* Reads a bitmap header from fp into header.  Returns 0 on EOF or invalid
+/* How many bytes in the file are occupied by a header, by definition in the
+ * spec.  Note that even though our definition logically matches the spec's, C
+ * struct padding/packing rules mean it might not be the same as
+ * sizeof(bmp_header).
+ */
+#define BMP_HEADER_SIZE 14
+
+/* Reads a bitmap header from src into header.  Returns 0 on EOF or invalid
  * header, or nonzero on success.
  */
-static int ReadHeader(bmp_header * header, FILE * fp)
+static int ReadHeader(bmp_header * header, bmp_source * src)
 {
-    if(!ReadUint8(&header->magic[0], fp)) return 0;
-    if(!ReadUint8(&header->magic[1], fp)) return 0;
+    const uint8_t * p;
+    if(!(p = SourceRead(src, BMP_HEADER_SIZE))) return 0;
+
+    header->magic[0] = p[0];
+    header->magic[1] = p[1];
 
     /* If it doesn't look like a bitmap header, don't even bother. */
     if(header->magic[0] != 0x42 /* 'B' */) return 0;
     if(header->magic[1] != 0x4d /* 'M' */) return 0;
 
-    if(!ReadLittleUint32(&header->file_size,   fp)) return 0;
-    if(!ReadLittleUint32(&header->unused,      fp)) return 0;
-    if(!ReadLittleUint32(&header->data_offset, fp)) return 0;
+    header->file_size   = LoadLittleUint32(p +  2);
+    header->unused      = LoadLittleUint32(p +  6);
+    header->data_offset = LoadLittleUint32(p + 10);
 
     return 1;
 }
 
-/* How many bytes in the file are occupied by a header, by definition in the
- * spec.  Note that even though our definition logically matches the spec's, C
- * struct padding/packing rules mean it might not be the same as
- * sizeof(bmp_header).
- */
-#define BMP_HEADER_SIZE 14
-
 /* Bitmap info: comes immediately after the header and describes the image.
  */
 typedef struct bmp_info
@@ -261,36 +487,41 @@ typedef struct bmp_info
 #define BMP3_INFO_SIZE 40
 #define MIN_INFO_SIZE BMP3_INFO_SIZE
 
-/* Values for the compression field.  We only support COMPRESSION_NONE and
- * COMPRESSION_BITFIELDS so far.
+/* Values for the compression field.  We support all of these, though RLE8 and
+ * RLE4 only go with 8 and 4 bits, and BITFIELDS only with 16 and 32.
  */
 #define COMPRESSION_NONE      0
 #define COMPRESSION_RLE8      1
 #define COMPRESSION_RLE4      2
 #define COMPRESSION_BITFIELDS 3
 
-/* Reads bitmap metadata from fp into info.  Returns 0 on EOF or invalid info,
+/* Reads bitmap metadata from src into info.  Returns 0 on EOF or invalid info,
  * or nonzero on success.  info is assumed to be initialized to 0 already.
  */
-static int ReadInfo(bmp_info * info, FILE * fp)
+static int ReadInfo(bmp_info * info, bmp_source * src)
 {
-    if(!ReadLittleUint32(&info->info_size, fp)) return 0;
+    const uint8_t * p;
+    if(!(p = SourceRead(src, 4))) return 0;
+
+    info->info_size = LoadLittleUint32(p);
 
     /* Older formats might not have all the fields we require, so this check
      * comes first.
      */
     if(info->info_size < MIN_INFO_SIZE) return 0;
 
-    if(!ReadLittleInt32( &info->width,       fp)) return 0;
-    if(!ReadLittleInt32( &info->height,      fp)) return 0;
-    if(!ReadLittleUint16(&info->planes,      fp)) return 0;
-    if(!ReadLittleUint16(&info->bits,        fp)) return 0;
-    if(!ReadLittleUint32(&info->compression, fp)) return 0;
-    if(!ReadLittleUint32(&info->unused0[0],  fp)) return 0;
-    if(!ReadLittleUint32(&info->unused0[1],  fp)) return 0;
-    if(!ReadLittleUint32(&info->unused0[2],  fp)) return 0;
-    if(!ReadLittleUint32(&info->colors,      fp)) return 0;
-    if(!ReadLittleUint32(&info->unused1,     fp)) return 0;
+    if(!(p = SourceRead(src, MIN_INFO_SIZE - 4))) return 0;
+
+    info->width       = LoadLittleInt32( p +  0);
+    info->height      = LoadLittleInt32( p +  4);
+    info->planes      = LoadLittleUint16(p +  8);
+    info->bits        = LoadLittleUint16(p + 10);
+    info->compression = LoadLittleUint32(p + 12);
+    info->unused0[0]  = LoadLittleUint32(p + 16);
+    info->unused0[1]  = LoadLittleUint32(p + 20);
+    info->unused0[2]  = LoadLittleUint32(p + 24);
+    info->colors      = LoadLittleUint32(p + 28);
+    info->unused1     = LoadLittleUint32(p + 32);
 
     /* We don't bother to even try to read bitmasks if they aren't needed,
      * since they won't be present in Windows 3 format bitmap files.
@@ -302,29 +533,36 @@ static int ReadInfo(bmp_info * info, FILE * fp)
          */
         if(info->info_size == BMP3_INFO_SIZE) return 0;
 
-        if(!ReadLittleUint32(&info->masks[0], fp)) return 0;
-        if(!ReadLittleUint32(&info->masks[1], fp)) return 0;
-        if(!ReadLittleUint32(&info->masks[2], fp)) return 0;
-        if(!ReadLittleUint32(&info->masks[3], fp)) return 0;
+        if(!(p = SourceRead(src, 16))) return 0;
+
+        info->masks[0] = LoadLittleUint32(p +  0);
+        info->masks[1] = LoadLittleUint32(p +  4);
+        info->masks[2] = LoadLittleUint32(p +  8);
+        info->masks[3] = LoadLittleUint32(p + 12);
     }
 
     return 1;
 }
 
 /* Bitfields for 16- and 32-bit files.  We track the first set bit (rightmost
- * being 0) and how many bits it spans.
+ * being 0) and how many bits it spans.  BuildBitfieldTable() then fills in
+ * the rest: the field's top 8 (or fewer) bits are (x >> shift) & mask, and
+ * table turns those into the 8-bit output.
  */
 typedef struct bitfield
 {
     uint32_t start;
     uint32_t span;
+    uint32_t shift;
+    uint32_t mask;
+    uint8_t  table[256];
 
 } bitfield;
 
-/* Applies a bitfield mask to a value, x.
+/* Expands a bitfield of a value, x, to 8 bits.
  */
-#define ApplyBitfield(x, bitfield) \
-        (((x) >> (bitfield).start) & ((UINT32_C(1) << (bitfield).span) - 1))
+#define ExpandBitfield(x, bitfield) \
+        ((bitfield).table[((x) >> (bitfield).shift) & (bitfield).mask])
 
 /* Turns a single mask component into a bitfield.  Returns 0 if the bitmask was
  * invalid, or nonzero if it's ok.  Span of 0 means the bitmask was absent.
@@ -370,56 +608,147 @@ typedef struct bmp_color
  */
 #define BMP_COLOR_SIZE 4
 
-/* Reads the given number of colors from fp into the palette array.  Returns 0
- * on EOF or nonzero on success.
+/* Reads the given number of colors from src into the palette array.  Returns
+ * 0 on EOF or nonzero on success.
  */
-static int ReadPalette(bmp_color * palette, int colors, FILE * fp)
+static int ReadPalette(bmp_color * palette, int colors, bmp_source * src)
 {
-    /* This isn't the guaranteed-fastest way to implement this, but it should
-     * perform quite well in practice due to compiler optimization and stdio
-     * input buffering.  It's implemented this way because of how simple the
-     * code is, while avoiding undefined and implementation-defined behavior or
-     * allocating any memory.  If you aren't averse to an extra allocation (or
-     * using a chunk of the stack), it might be made faster while still
-     * avoiding implementation-defined behavior by reading the entire palette
-     * into one big buffer up front, then copying bytes into place.
+    /* The whole palette is read at once (and a file source will already have
+     * fetched it in one go; see LoadPalette()), then the entries are copied
+     * into place a byte at a time, which avoids depending on how the compiler
+     * lays out bmp_color.
      */
+    const uint8_t * components;
     int i;
+
+    if(!(components = SourceRead(src, (size_t)colors * BMP_COLOR_SIZE)))
+        return 0;
+
     for(i = 0; i < colors; i++)
     {
-        uint8_t components[BMP_COLOR_SIZE];
-        if(fread(components, 1, sizeof(components), fp) != sizeof(components))
-            return 0;
-
         palette[i].blue   = components[0];
         palette[i].green  = components[1];
         palette[i].red    = components[2];
         palette[i].unused = components[3];
+
+        components += BMP_COLOR_SIZE;
     }
     return 1;
 }
 
+/* A region of a bitmap to decode, for bmpread_rect().  y counts down from the
+ * top line, whatever order the file stores them in.
+ */
+typedef struct bmp_rect
+{
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+
+} bmp_rect;
+
+/* Function that adds len bytes of a decoded line into as many 16-bit running
+ * sums, for scaling.  See SelectSumColumns().
+ */
+typedef void (* sum_fn)(uint16_t * sums, const uint8_t * p_in, size_t len);
+
 /* Context shared between the below functions.
  */
 typedef struct read_context
 {
     unsigned int   flags;         /* Flags passed to bmpread. */
-    FILE         * fp;            /* File pointer. */
+    bmpread_allocator_t allocator; /* Where our memory comes from. */
+    bmp_source     src;           /* Where the file's bytes come from. */
     bmp_header     header;        /* Bitmap file header. */
     bmp_info       info;          /* Bitmap file info. */
     uint32_t       headers_size;  /* Total size of header + info. */
     uint32_t       after_headers; /* Size of space for palette. */
-    int32_t        lines;         /* How many scan lines (abs(height)). */
+    const bmp_rect * rect;        /* Region to decode, or NULL for all. */
+    int32_t        in_width;      /* Pixels to decode per line. */
+    int32_t        in_lines;      /* How many scan lines to decode. */
+    int32_t        width;         /* Pixels to output per line. */
+    int32_t        lines;         /* How many scan lines to output. */
+    int32_t        pot_width;     /* width after any BMPREAD_POT_* flag. */
+    int32_t        pot_lines;     /* lines after any BMPREAD_POT_* flag. */
+    size_t         pot_line_len;  /* out_line_len after it. */
+    size_t         scale;         /* Pixels (and lines) per output one. */
+    size_t         first_line;    /* File line of the first to decode. */
+    size_t         first_byte;    /* Where in a file line the pixels start. */
+    size_t         lead_pixels;   /* Pixels to drop out of that first byte. */
+    size_t         span_len;      /* Bytes of each file line we need. */
     size_t         file_line_len; /* How many bytes each scan line is. */
     size_t         out_channels;  /* Output color channels (3, or 4=alpha). */
     size_t         out_line_len;  /* Bytes in each output line. */
     bitfield       bitfields[4];  /* How to decode 16- and 32-bits. */
+    uint32_t       file_colors;   /* Palette entries stored in the file. */
     bmp_color    * palette;       /* Enough entries for our bit depth. */
-    uint8_t      * file_data;     /* A line of data in the file. */
+    uint8_t      * expansion;     /* Output pixels for each byte of file. */
     uint8_t      * data_out;      /* RGB(A) data output buffer. */
+    int            caller_out;    /* Whether data_out is the caller's. */
+    size_t         caller_size;   /* Size of the caller's data_out. */
+    uint8_t      * scratch;       /* One decoded line, when scaling. */
+    uint16_t     * sums;          /* Column totals, when scaling. */
+    sum_fn         sum_columns;   /* Adds a line into sums. */
+    bmpread_band_fn band_fn;      /* Where bands go when streaming. */
+    void         * band_user;     /* Passed along to band_fn. */
+    size_t         band_lines;    /* Lines data_out holds when streaming. */
 
 } read_context;
 
+/* Evenly distribute a value that spans a given number of bits into 8 bits.
+ */
+static uint32_t Make8Bits(uint32_t value, uint32_t bitspan)
+{
+    uint32_t output = 0;
+
+    if(bitspan == 8)
+        return value;
+    if(bitspan > 8)
+        return value >> (bitspan - 8);
+
+    value <<= (8 - bitspan); /* Shift it up into the most significant bits. */
+    while(value)
+    {
+        /* Repeat the bit pattern down into the least significant bits.  This
+         * gives an even distribution when extrapolating from [0, 2^bitspan-1]
+         * into [0, 2^8-1], and avoids both floating point and awkward integer
+         * multiplication.  Unfortunately, because we don't enforce a whitelist
+         * of bit patterns we support and can hard-code for, it necessitates a
+         * loop, which is why the general decoders look the results up in
+         * tables built ahead of time by BuildBitfieldTable() instead.
+         */
+        output |= value;
+        value >>= bitspan;
+    }
+
+    return output;
+}
+
+/* Fills in a parsed bitfield's shift, mask and table for ExpandBitfield().
+ * Fields wider than 8 bits only keep their top 8, so the table never needs
+ * more than 256 entries.
+ */
+static void BuildBitfieldTable(bitfield * field)
+{
+    uint32_t value;
+
+    if(field->span > 8)
+    {
+        field->shift = field->start + field->span - 8;
+        field->mask  = 0xff;
+    }
+    else
+    {
+        field->shift = field->start;
+        field->mask  = (UINT32_C(1) << field->span) - 1;
+    }
+
+    for(value = 0; value <= field->mask; value++)
+        field->table[value] = (uint8_t)Make8Bits(value, (field->span > 8) ?
+                                                 8 : field->span);
+}
+
 /* A sub-function to Validate() that handles the bitfields.  Returns 0 on
  * invalid bitfields or nonzero on success.  Note that we don't treat odd
  * bitmasks such as R8G8 or A1G1B1 as invalid, even though they may not load in
@@ -447,6 +776,8 @@ static int ValidateBitfields(read_context * p_ctx)
 
         /* Make sure we fit in our bit size. */
         if(bf[i].start + bf[i].span > p_ctx->info.bits) return 0;
+
+        BuildBitfieldTable(&bf[i]);
     }
 
     if(!total_mask) return 0;
@@ -457,23 +788,81 @@ static int ValidateBitfields(read_context * p_ctx)
     return 1;
 }
 
-/* A sub-function to Validate() that handles the palette.  Returns 0 on EOF or
- * invalid palette, or nonzero on success.
+/* A sub-function to ValidateHeaders() that handles the palette's size.
+ * Returns 0 on invalid palette, or nonzero on success.  Doesn't touch the
+ * palette itself, which LoadPalette() reads later.
  */
-static int ValidateAndReadPalette(read_context * p_ctx)
+static int ValidatePalette(read_context * p_ctx)
 {
-    uint32_t colors = UINT32_C(1) << p_ctx->info.bits;
-    uint32_t file_colors = p_ctx->info.colors;
+    uint32_t colors;
 
     if(p_ctx->info.bits > 8)
         return 1;
 
-    if(file_colors > colors) return 0;
-    if(!file_colors)
-        file_colors = colors;
+    colors = UINT32_C(1) << p_ctx->info.bits;
+    p_ctx->file_colors = p_ctx->info.colors;
+
+    if(p_ctx->file_colors > colors) return 0;
+    if(!p_ctx->file_colors)
+        p_ctx->file_colors = colors;
 
     /* Make sure we actually have space in the file for all the colors. */
-    if(p_ctx->after_headers / BMP_COLOR_SIZE < file_colors) return 0;
+    if(p_ctx->after_headers / BMP_COLOR_SIZE < p_ctx->file_colors)
+        return 0;
+
+    return 1;
+}
+
+/* Builds the table the 1-, 4- and 8-bit decoders expand pixels with: for
+ * each possible byte of the file, the output of all the pixels it holds (one
+ * for 8 bits, two for 4, eight for 1), laid out as they'll be in the output
+ * buffer.  Each entry is 32 / bits bytes, room for that many RGBA pixels;
+ * without alpha, the leftover bytes at the end are 0.  The biggest table, for
+ * 1 bit, is 8KiB.  Returns 0 if out of memory or nonzero on success.
+ */
+static int BuildExpansion(read_context * p_ctx)
+{
+    size_t bits  = p_ctx->info.bits;
+    size_t entry = 32 / bits;
+    size_t mask  = ((size_t)1 << bits) - 1;
+
+    uint8_t * p_out;
+    unsigned int byte;
+    size_t i;
+
+    if(!(p_ctx->expansion = (uint8_t *)
+         AllocateZeroed(&p_ctx->allocator, 256, entry))) return 0;
+
+    for(byte = 0, p_out = p_ctx->expansion; byte < 256; byte++)
+    {
+        uint8_t * p_pixel = p_out;
+
+        /* The leftmost pixel is in the most significant bits. */
+        for(i = 8 / bits; i-- > 0; )
+        {
+            const bmp_color * color = &p_ctx->palette[(byte >> (i * bits)) &
+                                                     mask];
+
+            *p_pixel++ = color->red;
+            *p_pixel++ = color->green;
+            *p_pixel++ = color->blue;
+            if(p_ctx->out_channels == 4)
+                *p_pixel++ = BMPREAD_DEFAULT_ALPHA;
+        }
+
+        p_out += entry;
+    }
+
+    return 1;
+}
+
+/* A sub-function to Validate() that reads the palette ValidatePalette()
+ * approved.  Returns 0 on EOF or out of memory, or nonzero on success.
+ */
+static int LoadPalette(read_context * p_ctx)
+{
+    if(p_ctx->info.bits > 8)
+        return 1;
 
     /* We always allocate a full palette even if the file only claims to
      * contain a smaller number, so we don't have to check for out of bound
@@ -482,13 +871,16 @@ static int ValidateAndReadPalette(read_context * p_ctx)
      * lookups beyond the file's palette get set to black.
      */
     if(!(p_ctx->palette = (bmp_color *)
-         calloc(colors, sizeof(p_ctx->palette[0])))) return 0;
+         AllocateZeroed(&p_ctx->allocator, (size_t)1 << p_ctx->info.bits,
+                sizeof(p_ctx->palette[0])))) return 0;
 
-    if(!CanMakeLong(p_ctx->headers_size))                    return 0;
-    if(fseek(p_ctx->fp, p_ctx->headers_size, SEEK_SET))      return 0;
-    if(!ReadPalette(p_ctx->palette, file_colors, p_ctx->fp)) return 0;
+    p_ctx->src.readahead = (size_t)p_ctx->file_colors * BMP_COLOR_SIZE;
 
-    return 1;
+    if(!SourceSeek(&p_ctx->src, p_ctx->headers_size)) return 0;
+    if(!ReadPalette(p_ctx->palette, p_ctx->file_colors, &p_ctx->src))
+        return 0;
+
+    return BuildExpansion(p_ctx);
 }
 
 /* Returns whether a non-negative integer is a power of 2.
@@ -507,6 +899,32 @@ static int IsPowerOf2(uint32_t x)
     return 0;
 }
 
+/* The biggest width or height the BMPREAD_POT_* flags will output. */
+#define MAX_POT_SIZE (INT32_C(1) << 30)
+
+/* Returns the power of 2 that the BMPREAD_POT_* flag in flags brings a
+ * positive width or height to, or 0 if that's more than MAX_POT_SIZE.
+ * BMPREAD_POT_NEAREST goes down rather than up when size is below the
+ * geometric mean of the two, i.e. when shrinking changes it by less in
+ * proportion than growing would.
+ */
+static int32_t GetPowerOf2Size(int32_t size, unsigned int flags)
+{
+    int32_t pot = 1;
+
+    while(pot < size)
+    {
+        if(pot >= MAX_POT_SIZE) return 0;
+        pot = pot << 1;
+    }
+
+    if((flags & BMPREAD_POT_MASK) == BMPREAD_POT_NEAREST && pot > size &&
+       (double)size < (double)pot * 0.70710678118654752 /* 1/sqrt(2) */)
+        pot = pot >> 1;
+
+    return pot;
+}
+
 /* Returns the byte length of a scan line padded as necessary to be divisible
  * by four.  For example, 3 pixels wide at 24 bpp would yield 12 (3 pixels * 3
  * bytes each = 9 bytes, padded by 3 to the next multiple of 4).  bpp is *bits*
@@ -528,14 +946,20 @@ static size_t GetLineLength(size_t width, size_t bpp)
     return (bits + pad_bits) / 8;
 }
 
-/* Reads and validates the bitmap header metadata from the context's file
- * object.  Assumes the file pointer is at the start of the file.  Returns 1 if
- * ok or 0 if error or invalid file.
+/* Reads and validates the bitmap header metadata from the context's source,
+ * without reading anything past the headers or allocating anything.  Assumes
+ * the source is positioned at the start of the file.  Returns 1 if ok or 0 if
+ * error or invalid file.
  */
-static int Validate(read_context * p_ctx)
+static int ValidateHeaders(read_context * p_ctx)
 {
-    if(!ReadHeader(&p_ctx->header, p_ctx->fp)) return 0;
-    if(!ReadInfo(  &p_ctx->info,   p_ctx->fp)) return 0;
+    /* A file source picks up the header, the info and any bitmasks with one
+     * read (the rest of the info, if any, we don't care about).
+     */
+    p_ctx->src.readahead = BMP_HEADER_SIZE + MIN_INFO_SIZE + 16;
+
+    if(!ReadHeader(&p_ctx->header, &p_ctx->src)) return 0;
+    if(!ReadInfo(  &p_ctx->info,   &p_ctx->src)) return 0;
 
     if(p_ctx->info.info_size > UINT32_MAX - BMP_HEADER_SIZE) return 0;
     p_ctx->headers_size = BMP_HEADER_SIZE + p_ctx->info.info_size;
@@ -550,14 +974,59 @@ static int Validate(read_context * p_ctx)
     p_ctx->lines = ((p_ctx->info.height < 0) ?
                     -p_ctx->info.height :
                      p_ctx->info.height);
+    p_ctx->width = p_ctx->info.width;
+
+    if(p_ctx->rect)
+    {
+        const bmp_rect * rect = p_ctx->rect;
+
+        /* Written this way around so nothing can overflow. */
+        if(rect->x < 0 || rect->width  <= 0 ||
+           rect->width  > p_ctx->width - rect->x) return 0;
+        if(rect->y < 0 || rect->height <= 0 ||
+           rect->height > p_ctx->lines - rect->y) return 0;
+
+        /* Lines in a bottom-up file count up from the bottom. */
+        p_ctx->first_line = ((p_ctx->info.height < 0) ?
+                             (size_t)rect->y :
+                             (size_t)(p_ctx->lines - rect->y - rect->height));
+        p_ctx->width = rect->width;
+        p_ctx->lines = rect->height;
+    }
+
+    /* When scaling down, an output pixel averages a box of scale x scale
+     * pixels, the ones along the right and bottom edges however many are
+     * left over.
+     */
+    p_ctx->in_width = p_ctx->width;
+    p_ctx->in_lines = p_ctx->lines;
+    p_ctx->scale = (size_t)1 << ((p_ctx->flags & BMPREAD_SCALE_MASK) /
+                                 BMPREAD_SCALE_1_2);
+    p_ctx->width = p_ctx->in_width / p_ctx->scale +
+                   (p_ctx->in_width % p_ctx->scale != 0);
+    p_ctx->lines = p_ctx->in_lines / p_ctx->scale +
+                   (p_ctx->in_lines % p_ctx->scale != 0);
+
+    /* Whatever size the BMPREAD_POT_* flags turn it into is a power of 2,
+     * but only once the whole image is decoded.
+     */
+    p_ctx->pot_width = p_ctx->width;
+    p_ctx->pot_lines = p_ctx->lines;
+    if(p_ctx->flags & BMPREAD_POT_MASK)
+    {
+        if(p_ctx->caller_out || p_ctx->band_fn) return 0;
 
-    if(!(p_ctx->flags & BMPREAD_ANY_SIZE))
+        p_ctx->pot_width = GetPowerOf2Size(p_ctx->width, p_ctx->flags);
+        p_ctx->pot_lines = GetPowerOf2Size(p_ctx->lines, p_ctx->flags);
+        if(!p_ctx->pot_width || !p_ctx->pot_lines) return 0;
+    }
+    else if(!(p_ctx->flags & BMPREAD_ANY_SIZE))
     {
         /* Both of these values have just been checked against being negative,
          * and thus it's safe to pass them on as uint32_t.
          */
-        if(!IsPowerOf2(p_ctx->info.width)) return 0;
-        if(!IsPowerOf2(p_ctx->lines))      return 0;
+        if(!IsPowerOf2(p_ctx->width)) return 0;
+        if(!IsPowerOf2(p_ctx->lines)) return 0;
     }
 
     switch(p_ctx->info.compression)
@@ -571,89 +1040,146 @@ static int Validate(read_context * p_ctx)
             if(p_ctx->info.bits != 16 && p_ctx->info.bits != 32) return 0;
             break;
 
-        default: /* No compression supported yet (TODO: handle RLE). */
+        /* The spec doesn't allow top-down RLE bitmaps.  There's also no way
+         * to find where a line starts without decoding everything before it,
+         * so we don't do regions of them.
+         */
+        case COMPRESSION_RLE8:
+            if(p_ctx->info.bits != 8 || p_ctx->info.height < 0) return 0;
+            if(p_ctx->rect) return 0;
+            break;
+
+        case COMPRESSION_RLE4:
+            if(p_ctx->info.bits != 4 || p_ctx->info.height < 0) return 0;
+            if(p_ctx->rect) return 0;
+            break;
+
+        default:
             return 0;
     }
 
     p_ctx->file_line_len = GetLineLength(p_ctx->info.width, p_ctx->info.bits);
     if(p_ctx->file_line_len == 0) return 0;
 
+    /* GetLineLength() made sure width * bits can't overflow, so neither can
+     * these.  Pixels narrower than a byte may start partway into one.
+     */
+    if(p_ctx->rect)
+    {
+        size_t first_bit = (size_t)p_ctx->rect->x * p_ctx->info.bits;
+        size_t end_bit   = first_bit +
+                           (size_t)p_ctx->in_width * p_ctx->info.bits;
+
+        p_ctx->first_byte  = first_bit / 8;
+        p_ctx->lead_pixels = (first_bit % 8) / p_ctx->info.bits;
+        p_ctx->span_len    = (end_bit + 7) / 8 - p_ctx->first_byte;
+    }
+    else
+        p_ctx->span_len = p_ctx->file_line_len;
+
     p_ctx->out_channels = ((p_ctx->flags & BMPREAD_ALPHA) ? 4 : 3);
 
     /* This check happens outside the following if, where it would seem to
-     * belong, because we make the same computation again in the future.
+     * belong, because we make the same computation again in the future.  The
+     * decoded width is never less than the output width.
      */
-    if(!CanMultiply(p_ctx->info.width, p_ctx->out_channels)) return 0;
+    if(!CanMultiply(p_ctx->in_width, p_ctx->out_channels)) return 0;
 
-    if(p_ctx->flags & BMPREAD_BYTE_ALIGN)
-        p_ctx->out_line_len = (size_t)p_ctx->info.width * p_ctx->out_channels;
+    if(p_ctx->caller_out)
+    {
+        /* The caller picked the line length (already in out_line_len), and
+         * it has to at least fit the pixels.
+         */
+        if(p_ctx->out_line_len <
+           (size_t)p_ctx->width * p_ctx->out_channels) return 0;
+    }
+    else if(p_ctx->flags & BMPREAD_BYTE_ALIGN)
+        p_ctx->out_line_len = (size_t)p_ctx->width * p_ctx->out_channels;
     else
     {
-        p_ctx->out_line_len = GetLineLength(p_ctx->info.width,
+        p_ctx->out_line_len = GetLineLength(p_ctx->width,
                                             p_ctx->out_channels * 8);
         if(p_ctx->out_line_len == 0) return 0;
     }
 
-    if(!ValidateBitfields(p_ctx))      return 0;
-    if(!ValidateAndReadPalette(p_ctx)) return 0;
+    /* The same again for the size the BMPREAD_POT_* flags give.  It's at
+     * most 2^30 (and the channels have been checked above), so the
+     * multiplication can't overflow.
+     */
+    if(p_ctx->flags & BMPREAD_BYTE_ALIGN)
+        p_ctx->pot_line_len = (size_t)p_ctx->pot_width * p_ctx->out_channels;
+    else
+    {
+        p_ctx->pot_line_len = GetLineLength(p_ctx->pot_width,
+                                            p_ctx->out_channels * 8);
+        if(p_ctx->pot_line_len == 0) return 0;
+    }
 
-    /* Set things up for decoding. */
-    if(!(p_ctx->file_data = (uint8_t *)malloc(p_ctx->file_line_len))) return 0;
+    if(!ValidateBitfields(p_ctx)) return 0;
+    if(!ValidatePalette(p_ctx))   return 0;
 
     if(!CanMakeSizeT(p_ctx->lines))                           return 0;
     if(!CanMultiply( p_ctx->lines, p_ctx->out_line_len))      return 0;
-    if(!(p_ctx->data_out = (uint8_t *)
-         malloc((size_t)p_ctx->lines * p_ctx->out_line_len))) return 0;
+    if(!CanMultiply( p_ctx->pot_lines, p_ctx->pot_line_len))  return 0;
 
     return 1;
 }
 
-/* Evenly distribute a value that spans a given number of bits into 8 bits.
+/* Validates the bitmap's headers, then reads its palette and sets things up
+ * for decoding.  Returns 1 if ok or 0 if error or invalid file.
  */
-static uint32_t Make8Bits(uint32_t value, uint32_t bitspan)
+static int Validate(read_context * p_ctx)
 {
-    uint32_t output = 0;
+    if(!ValidateHeaders(p_ctx)) return 0;
+    if(!LoadPalette(p_ctx))     return 0;
 
-    if(bitspan == 8)
-        return value;
-    if(bitspan > 8)
-        return value >> (bitspan - 8);
+    /* Streaming only ever holds one band of lines. */
+    if(p_ctx->band_fn && p_ctx->band_lines > (size_t)p_ctx->lines)
+        p_ctx->band_lines = p_ctx->lines;
 
-    value <<= (8 - bitspan); /* Shift it up into the most significant bits. */
-    while(value)
+    if(p_ctx->caller_out)
     {
-        /* Repeat the bit pattern down into the least significant bits.  This
-         * gives an even distribution when extrapolating from [0, 2^bitspan-1]
-         * into [0, 2^8-1], and avoids both floating point and awkward integer
-         * multiplication.  Unfortunately, because we don't enforce a whitelist
-         * of bit patterns we support and can hard-code for, it necessitates a
-         * loop.  I believe this is a fairly efficient way to express the idea,
-         * but it'd still be nice if the compiler could optimize this whole
-         * function heavily, since it's called in a tight decode loop.
-         */
-        output |= value;
-        value >>= bitspan;
+        /* The last line doesn't need any padding after its pixels. */
+        if(p_ctx->caller_size <
+           ((size_t)p_ctx->lines - 1) * p_ctx->out_line_len +
+           (size_t)p_ctx->width * p_ctx->out_channels) return 0;
     }
+    else if(!(p_ctx->data_out = (uint8_t *)
+              Allocate(&p_ctx->allocator,
+                       (p_ctx->band_fn ? p_ctx->band_lines :
+                                         (size_t)p_ctx->lines) *
+                       p_ctx->out_line_len))) return 0;
+
+    /* Scaling decodes each line off to the side, then adds it into the sums
+     * of each column.
+     */
+    if(p_ctx->scale > 1)
+    {
+        size_t sums_len = (size_t)p_ctx->in_width * p_ctx->out_channels;
 
-    return output;
+        if(!(p_ctx->scratch = (uint8_t *)
+             Allocate(&p_ctx->allocator, sums_len)))                 return 0;
+        if(!(p_ctx->sums = (uint16_t *)
+             AllocateZeroed(&p_ctx->allocator, sums_len,
+                            sizeof(p_ctx->sums[0]))))                return 0;
+    }
+
+    return 1;
 }
 
-/* Reads four bytes out of a memory buffer and converts it to a uint32_t.
+/* The signature shared by all the decoders below.  Each decodes one scan line
+ * and takes a pointer to an output buffer scan line (p_out), a pointer to the
+ * end of the *pixel data* of this scan line (p_out_end), a pointer to the
+ * source scan line of file data (p_file), and our context.
  */
-#define LoadLittleUint32(buf) (((uint32_t)(buf)[0]      ) + \
-                               ((uint32_t)(buf)[1] <<  8) + \
-                               ((uint32_t)(buf)[2] << 16) + \
-                               ((uint32_t)(buf)[3] << 24))
-
-/* Decodes 32-bit bitmap data by applying bitmasks.  The 16- and 32-bit
- * decoders could be made more efficient by whitelisting supported bit patterns
- * ahead of time and special-casing their decoding here, but this allows us to
- * support more bitmask patterns, and shouldn't be *too* inefficient in any
- * case.
- *
- * Takes a pointer to an output buffer scan line (p_out), a pointer to the end
- * of the *pixel data* of this scan line (p_out_end), a pointer to the source
- * scan line of file data (p_file), and our context.
+typedef void (* decoder_fn)(uint8_t * p_out,
+                            const uint8_t * p_out_end,
+                            const uint8_t * p_file,
+                            const read_context * p_ctx);
+
+/* Decodes 32-bit bitmap data by applying bitmasks.  This and Decode16() are
+ * the general case, which supports any bitmask pattern; the common patterns
+ * are whitelisted and get faster, hard-coded decoders further down.
  */
 static void Decode32(uint8_t * p_out,
                      const uint8_t * p_out_end,
@@ -666,13 +1192,13 @@ static void Decode32(uint8_t * p_out,
     {
         uint32_t value = LoadLittleUint32(p_file);
 
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[0]), bf[0].span);
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[1]), bf[1].span);
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[2]), bf[2].span);
+        *p_out++ = ExpandBitfield(value, bf[0]);
+        *p_out++ = ExpandBitfield(value, bf[1]);
+        *p_out++ = ExpandBitfield(value, bf[2]);
         if(p_ctx->out_channels == 4)
         {
             if(bf[3].span)
-                *p_out++ = Make8Bits(ApplyBitfield(value, bf[3]), bf[3].span);
+                *p_out++ = ExpandBitfield(value, bf[3]);
             else
                 *p_out++ = BMPREAD_DEFAULT_ALPHA;
         }
@@ -701,10 +1227,289 @@ static void Decode24(uint8_t * p_out,
     }
 }
 
-/* Reads two bytes out of a memory buffer and converts it to a uint16_t.
+#ifdef BMPREAD_SIMD_X86
+
+/* CPU features the SIMD decoders need, as returned by GetCpuFeatures(). */
+#define CPU_SSSE3 1u
+#define CPU_AVX2  2u
+
+/* Asks the CPU (and OS, for AVX2's wider registers) which of the CPU_*
+ * features above we can use.  This is cheap enough to do once per bitmap, so
+ * there's no cached global to worry about when decoding on several threads.
  */
-#define LoadLittleUint16(buf) (((uint16_t)(buf)[0]     ) + \
-                               ((uint16_t)(buf)[1] << 8))
+static unsigned int GetCpuFeatures(void)
+{
+    unsigned int features = 0;
+
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+
+    __cpuid(regs, 0);
+    if(regs[0] < 1) return 0;
+
+    __cpuid(regs, 1);
+    if(regs[2] & (1 << 9))
+        features |= CPU_SSSE3;
+
+    /* AVX2 also needs the OS to save the upper halves of the registers, as
+     * advertised by OSXSAVE and XCR0.
+     */
+    if((regs[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuid(regs, 0);
+        if(regs[0] >= 7)
+        {
+            __cpuidex(regs, 7, 0);
+            if(regs[1] & (1 << 5))
+                features |= CPU_AVX2;
+        }
+    }
+#else
+    if(__builtin_cpu_supports("ssse3"))
+        features |= CPU_SSSE3;
+    if(__builtin_cpu_supports("avx2"))
+        features |= CPU_AVX2;
+#endif
+
+#ifdef BMPREAD_NO_AVX2
+    features &= ~CPU_AVX2;
+#endif
+
+    return features;
+}
+
+/* pshufb masks that swap BGR to RGB across 48 bytes (16 pixels) held in three
+ * 16-byte registers.  Since each pixel's red and blue trade places, a few
+ * bytes near each register boundary come from the neighboring register.
+ * Output register n is the OR of the masks "n from" each source register;
+ * 0x80 zeroes a byte.
+ */
+static const uint8_t bgr_to_rgb_masks[7][16] =
+{
+    /* 0 from 0 */ { 0x02, 0x01, 0x00, 0x05, 0x04, 0x03, 0x08, 0x07,
+                     0x06, 0x0b, 0x0a, 0x09, 0x0e, 0x0d, 0x0c, 0x80 },
+    /* 0 from 1 */ { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 },
+    /* 1 from 0 */ { 0x80, 0x0f, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    /* 1 from 1 */ { 0x00, 0x80, 0x04, 0x03, 0x02, 0x07, 0x06, 0x05,
+                     0x0a, 0x09, 0x08, 0x0d, 0x0c, 0x0b, 0x80, 0x0f },
+    /* 1 from 2 */ { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x80 },
+    /* 2 from 1 */ { 0x0e, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    /* 2 from 2 */ { 0x80, 0x03, 0x02, 0x01, 0x06, 0x05, 0x04, 0x09,
+                     0x08, 0x07, 0x0c, 0x0b, 0x0a, 0x0f, 0x0e, 0x0d }
+};
+
+/* pshufb mask that expands four BGR pixels in the low 12 bytes of a register
+ * into RGB0 (the zeroes are ORed with alpha afterward).
+ */
+static const uint8_t bgr_to_rgba_mask[16] =
+{
+    0x02, 0x01, 0x00, 0x80, 0x05, 0x04, 0x03, 0x80,
+    0x08, 0x07, 0x06, 0x80, 0x0b, 0x0a, 0x09, 0x80
+};
+
+#define LoadMask128(mask) _mm_loadu_si128((const __m128i *)(mask))
+
+/* Decode24() for RGB output with SSSE3, 16 pixels at a time.  Whatever's left
+ * over at the end of the line goes through Decode24().
+ */
+BMPREAD_TARGET("ssse3")
+static void Decode24RgbSsse3(uint8_t * p_out,
+                             const uint8_t * p_out_end,
+                             const uint8_t * p_file,
+                             const read_context * p_ctx)
+{
+    const __m128i m00 = LoadMask128(bgr_to_rgb_masks[0]);
+    const __m128i m01 = LoadMask128(bgr_to_rgb_masks[1]);
+    const __m128i m10 = LoadMask128(bgr_to_rgb_masks[2]);
+    const __m128i m11 = LoadMask128(bgr_to_rgb_masks[3]);
+    const __m128i m12 = LoadMask128(bgr_to_rgb_masks[4]);
+    const __m128i m21 = LoadMask128(bgr_to_rgb_masks[5]);
+    const __m128i m22 = LoadMask128(bgr_to_rgb_masks[6]);
+
+    while(p_out_end - p_out >= 48)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p_file     ));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p_file + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p_file + 32));
+
+        _mm_storeu_si128((__m128i *)(p_out     ),
+                         _mm_or_si128(_mm_shuffle_epi8(a, m00),
+                                      _mm_shuffle_epi8(b, m01)));
+        _mm_storeu_si128((__m128i *)(p_out + 16),
+                         _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m10),
+                                                   _mm_shuffle_epi8(b, m11)),
+                                      _mm_shuffle_epi8(c, m12)));
+        _mm_storeu_si128((__m128i *)(p_out + 32),
+                         _mm_or_si128(_mm_shuffle_epi8(b, m21),
+                                      _mm_shuffle_epi8(c, m22)));
+
+        p_out  += 48;
+        p_file += 48;
+    }
+
+    Decode24(p_out, p_out_end, p_file, p_ctx);
+}
+
+/* Decode24() for RGBA output with SSSE3, 16 pixels at a time.
+ */
+BMPREAD_TARGET("ssse3")
+static void Decode24RgbaSsse3(uint8_t * p_out,
+                              const uint8_t * p_out_end,
+                              const uint8_t * p_file,
+                              const read_context * p_ctx)
+{
+    const __m128i mask  = LoadMask128(bgr_to_rgba_mask);
+    const __m128i alpha = _mm_slli_epi32(_mm_set1_epi32(BMPREAD_DEFAULT_ALPHA),
+                                         24);
+
+    while(p_out_end - p_out >= 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p_file     ));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p_file + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p_file + 32));
+
+        /* Line each group of four pixels up at the bottom of a register. */
+        __m128i p0 = a;
+        __m128i p1 = _mm_alignr_epi8(b, a, 12);
+        __m128i p2 = _mm_alignr_epi8(c, b, 8);
+        __m128i p3 = _mm_srli_si128(c, 4);
+
+        _mm_storeu_si128((__m128i *)(p_out     ),
+                         _mm_or_si128(_mm_shuffle_epi8(p0, mask), alpha));
+        _mm_storeu_si128((__m128i *)(p_out + 16),
+                         _mm_or_si128(_mm_shuffle_epi8(p1, mask), alpha));
+        _mm_storeu_si128((__m128i *)(p_out + 32),
+                         _mm_or_si128(_mm_shuffle_epi8(p2, mask), alpha));
+        _mm_storeu_si128((__m128i *)(p_out + 48),
+                         _mm_or_si128(_mm_shuffle_epi8(p3, mask), alpha));
+
+        p_out  += 64;
+        p_file += 48;
+    }
+
+    Decode24(p_out, p_out_end, p_file, p_ctx);
+}
+
+/* Loads two unaligned 16-byte halves into one 32-byte register. */
+#define LoadHalves256(lo, hi) \
+        _mm256_inserti128_si256( \
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(lo))), \
+            _mm_loadu_si128((const __m128i *)(hi)), 1)
+
+/* Stores a 32-byte register as two unaligned 16-byte halves. */
+#define StoreHalves256(lo, hi, x) \
+        (_mm_storeu_si128((__m128i *)(lo), _mm256_castsi256_si128(x)), \
+         _mm_storeu_si128((__m128i *)(hi), _mm256_extracti128_si256(x, 1)))
+
+/* Decode24() for RGB output with AVX2, 32 pixels at a time.  pshufb can't
+ * cross the 128-bit halves of a register, so each half runs the same
+ * three-register shuffle as Decode24RgbSsse3() on its own 48 bytes.
+ */
+BMPREAD_TARGET("avx2")
+static void Decode24RgbAvx2(uint8_t * p_out,
+                            const uint8_t * p_out_end,
+                            const uint8_t * p_file,
+                            const read_context * p_ctx)
+{
+    const __m256i m00 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[0]));
+    const __m256i m01 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[1]));
+    const __m256i m10 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[2]));
+    const __m256i m11 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[3]));
+    const __m256i m12 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[4]));
+    const __m256i m21 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[5]));
+    const __m256i m22 = _mm256_broadcastsi128_si256(
+                            LoadMask128(bgr_to_rgb_masks[6]));
+
+    while(p_out_end - p_out >= 96)
+    {
+        __m256i a = LoadHalves256(p_file,      p_file + 48);
+        __m256i b = LoadHalves256(p_file + 16, p_file + 64);
+        __m256i c = LoadHalves256(p_file + 32, p_file + 80);
+
+        __m256i o0 = _mm256_or_si256(_mm256_shuffle_epi8(a, m00),
+                                     _mm256_shuffle_epi8(b, m01));
+        __m256i o1 = _mm256_or_si256(
+                         _mm256_or_si256(_mm256_shuffle_epi8(a, m10),
+                                         _mm256_shuffle_epi8(b, m11)),
+                         _mm256_shuffle_epi8(c, m12));
+        __m256i o2 = _mm256_or_si256(_mm256_shuffle_epi8(b, m21),
+                                     _mm256_shuffle_epi8(c, m22));
+
+        StoreHalves256(p_out,      p_out + 48, o0);
+        StoreHalves256(p_out + 16, p_out + 64, o1);
+        StoreHalves256(p_out + 32, p_out + 80, o2);
+
+        p_out  += 96;
+        p_file += 96;
+    }
+
+    Decode24RgbSsse3(p_out, p_out_end, p_file, p_ctx);
+}
+
+/* Decode24() for RGBA output with AVX2, 8 pixels at a time.  The low half of
+ * the register gets pixels 0-3 from the first 12 bytes, and the high half
+ * gets pixels 4-7 from bytes 12-23, loaded from byte 8 (with a mask offset to
+ * match) so we never read past the 24 bytes we're decoding.
+ */
+BMPREAD_TARGET("avx2")
+static void Decode24RgbaAvx2(uint8_t * p_out,
+                             const uint8_t * p_out_end,
+                             const uint8_t * p_file,
+                             const read_context * p_ctx)
+{
+    const __m256i mask  = _mm256_add_epi8(
+                              _mm256_broadcastsi128_si256(
+                                  LoadMask128(bgr_to_rgba_mask)),
+                              _mm256_setr_epi32(0, 0, 0, 0,
+                                                0x00040404, 0x00040404,
+                                                0x00040404, 0x00040404));
+    const __m256i alpha = _mm256_slli_epi32(
+                              _mm256_set1_epi32(BMPREAD_DEFAULT_ALPHA), 24);
+
+    while(p_out_end - p_out >= 32)
+    {
+        __m256i x = LoadHalves256(p_file, p_file + 8);
+
+        _mm256_storeu_si256((__m256i *)p_out,
+                            _mm256_or_si256(_mm256_shuffle_epi8(x, mask),
+                                            alpha));
+
+        p_out  += 32;
+        p_file += 24;
+    }
+
+    Decode24RgbaSsse3(p_out, p_out_end, p_file, p_ctx);
+}
+
+#endif /* BMPREAD_SIMD_X86 */
+
+/* Picks the fastest 24-bit decoder this CPU can run for the requested output.
+ */
+static decoder_fn SelectDecode24(const read_context * p_ctx)
+{
+#ifdef BMPREAD_SIMD_X86
+    unsigned int cpu = GetCpuFeatures();
+    int alpha = (p_ctx->out_channels == 4);
+
+    if(cpu & CPU_AVX2)
+        return (alpha ? Decode24RgbaAvx2 : Decode24RgbAvx2);
+    if(cpu & CPU_SSSE3)
+        return (alpha ? Decode24RgbaSsse3 : Decode24RgbSsse3);
+#endif
+
+    (void)p_ctx; /* Unused without SIMD. */
+    return Decode24;
+}
 
 /* Decodes 16-bit bitmap data by applying bitmasks.
  */
@@ -719,13 +1524,13 @@ static void Decode16(uint8_t * p_out,
     {
         uint16_t value = LoadLittleUint16(p_file);
 
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[0]), bf[0].span);
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[1]), bf[1].span);
-        *p_out++ = Make8Bits(ApplyBitfield(value, bf[2]), bf[2].span);
+        *p_out++ = ExpandBitfield(value, bf[0]);
+        *p_out++ = ExpandBitfield(value, bf[1]);
+        *p_out++ = ExpandBitfield(value, bf[2]);
         if(p_ctx->out_channels == 4)
         {
             if(bf[3].span)
-                *p_out++ = Make8Bits(ApplyBitfield(value, bf[3]), bf[3].span);
+                *p_out++ = ExpandBitfield(value, bf[3]);
             else
                 *p_out++ = BMPREAD_DEFAULT_ALPHA;
         }
@@ -734,223 +1539,2368 @@ static void Decode16(uint8_t * p_out,
     }
 }
 
-/* Decodes 8-bit bitmap data by looking colors up in the palette.
+/* Bitfield layouts common enough to get their own decoders, as returned by
+ * GetBitfieldLayout().  Anything else goes through Decode16() or Decode32().
  */
-static void Decode8(uint8_t * p_out,
-                    const uint8_t * p_out_end,
-                    const uint8_t * p_file,
-                    const read_context * p_ctx)
+#define LAYOUT_OTHER    0 /* Something else; use the general decoder. */
+#define LAYOUT_RGB565   1 /* 16-bit R5G6B5. */
+#define LAYOUT_XRGB1555 2 /* 16-bit X1R5G5B5 (or A1R5G5B5 without alpha). */
+#define LAYOUT_ARGB1555 3 /* 16-bit A1R5G5B5. */
+#define LAYOUT_XRGB8888 4 /* 32-bit X8R8G8B8 (or A8R8G8B8 without alpha). */
+#define LAYOUT_ARGB8888 5 /* 32-bit A8R8G8B8. */
+
+/* Matches the file's bitmasks against the whitelist above.  Without
+ * BMPREAD_ALPHA, a file's alpha mask doesn't affect the output, so the
+ * A-layouts are reported as the equivalent X-layouts.
+ */
+static int GetBitfieldLayout(const read_context * p_ctx)
 {
-    while(p_out < p_out_end) {
-        *p_out++ = p_ctx->palette[*p_file].red;
-        *p_out++ = p_ctx->palette[*p_file].green;
-        *p_out++ = p_ctx->palette[*p_file].blue;
-        if(p_ctx->out_channels == 4)
-            *p_out++ = BMPREAD_DEFAULT_ALPHA;
+    const uint32_t * masks = p_ctx->info.masks;
+    int alpha = (p_ctx->out_channels == 4);
 
-        p_file++;
+    if(p_ctx->info.bits == 16)
+    {
+        if(masks[0] == 0xf800 && masks[1] == 0x07e0 && masks[2] == 0x001f &&
+           masks[3] == 0)
+            return LAYOUT_RGB565;
+
+        if(masks[0] == 0x7c00 && masks[1] == 0x03e0 && masks[2] == 0x001f)
+        {
+            if(masks[3] == 0)
+                return LAYOUT_XRGB1555;
+            if(masks[3] == 0x8000)
+                return (alpha ? LAYOUT_ARGB1555 : LAYOUT_XRGB1555);
+        }
     }
+    else if(p_ctx->info.bits == 32)
+    {
+        if(masks[0] == UINT32_C(0x00ff0000) &&
+           masks[1] == UINT32_C(0x0000ff00) &&
+           masks[2] == UINT32_C(0x000000ff))
+        {
+            if(masks[3] == 0)
+                return LAYOUT_XRGB8888;
+            if(masks[3] == UINT32_C(0xff000000))
+                return (alpha ? LAYOUT_ARGB8888 : LAYOUT_XRGB8888);
+        }
+    }
+
+    return LAYOUT_OTHER;
 }
 
-/* Decodes 4-bit bitmap data by looking colors up in the palette.
+/* What Make8Bits() works out to for 5- and 6-bit values. */
+#define Expand5To8(x) (((x) << 3) | ((x) >> 2))
+#define Expand6To8(x) (((x) << 2) | ((x) >> 4))
+
+/* Decodes LAYOUT_RGB565 bitmap data.
  */
-static void Decode4(uint8_t * p_out,
-                    const uint8_t * p_out_end,
-                    const uint8_t * p_file,
-                    const read_context * p_ctx)
+static void Decode16Rgb565(uint8_t * p_out,
+                           const uint8_t * p_out_end,
+                           const uint8_t * p_file,
+                           const read_context * p_ctx)
 {
     while(p_out < p_out_end)
     {
-        unsigned int lookup = (*p_file & 0xf0U) >> 4;
-
-        *p_out++ = p_ctx->palette[lookup].red;
-        *p_out++ = p_ctx->palette[lookup].green;
-        *p_out++ = p_ctx->palette[lookup].blue;
+        uint32_t value = LoadLittleUint16(p_file);
+        uint32_t r = (value >> 11);
+        uint32_t g = (value >>  5) & 0x3f;
+        uint32_t b = (value      ) & 0x1f;
+
+        *p_out++ = (uint8_t)Expand5To8(r);
+        *p_out++ = (uint8_t)Expand6To8(g);
+        *p_out++ = (uint8_t)Expand5To8(b);
         if(p_ctx->out_channels == 4)
             *p_out++ = BMPREAD_DEFAULT_ALPHA;
 
-        if(p_out < p_out_end)
-        {
-            lookup = *p_file++ & 0x0fU;
-
-            *p_out++ = p_ctx->palette[lookup].red;
-            *p_out++ = p_ctx->palette[lookup].green;
-            *p_out++ = p_ctx->palette[lookup].blue;
-            if(p_ctx->out_channels == 4)
-                *p_out++ = BMPREAD_DEFAULT_ALPHA;
-        }
+        p_file += 2;
     }
 }
 
-/* Decodes 1-bit bitmap data by looking colors up in the two-color palette.
+/* Decodes LAYOUT_XRGB1555 and LAYOUT_ARGB1555 bitmap data.
  */
-static void Decode1(uint8_t * p_out,
-                    const uint8_t * p_out_end,
-                    const uint8_t * p_file,
-                    const read_context * p_ctx)
+static void Decode16Rgb555(uint8_t * p_out,
+                           const uint8_t * p_out_end,
+                           const uint8_t * p_file,
+                           const read_context * p_ctx)
 {
+    int has_alpha = (p_ctx->bitfields[3].span != 0);
+
     while(p_out < p_out_end)
     {
-        unsigned int bit;
-        for(bit = 0; bit < 8 && p_out < p_out_end; bit++)
+        uint32_t value = LoadLittleUint16(p_file);
+        uint32_t r = (value >> 10) & 0x1f;
+        uint32_t g = (value >>  5) & 0x1f;
+        uint32_t b = (value      ) & 0x1f;
+
+        *p_out++ = (uint8_t)Expand5To8(r);
+        *p_out++ = (uint8_t)Expand5To8(g);
+        *p_out++ = (uint8_t)Expand5To8(b);
+        if(p_ctx->out_channels == 4)
         {
-            unsigned int lookup = (*p_file >> (7 - bit)) & 1;
-
-            *p_out++ = p_ctx->palette[lookup].red;
-            *p_out++ = p_ctx->palette[lookup].green;
-            *p_out++ = p_ctx->palette[lookup].blue;
-            if(p_ctx->out_channels == 4)
+            if(has_alpha)
+                *p_out++ = ((value & 0x8000) ? 255 : 0);
+            else
                 *p_out++ = BMPREAD_DEFAULT_ALPHA;
         }
 
-        p_file++;
+        p_file += 2;
     }
 }
 
-/* Selects an above decoder and runs it for each scan line of the file.
- * Returns 0 if there's an error or 1 if it's gravy.
+/* Decodes LAYOUT_XRGB8888 and LAYOUT_ARGB8888 bitmap data--like 24-bit, just
+ * swapping color components around.
  */
-static int Decode(read_context * p_ctx)
+static void Decode32Rgb888(uint8_t * p_out,
+                           const uint8_t * p_out_end,
+                           const uint8_t * p_file,
+                           const read_context * p_ctx)
 {
-    void (* decoder)(uint8_t *, const uint8_t *, const uint8_t *,
-                     const read_context *);
+    int has_alpha = (p_ctx->bitfields[3].span != 0);
 
-    uint8_t * p_out;      /* Pointer to current scan line in output buffer. */
-    uint8_t * p_out_end;  /* End marker for output buffer. */
-    uint8_t * p_line_end; /* Pointer to end of current scan line in output. */
+    while(p_out < p_out_end)
+    {
+        *p_out++ = *(p_file + 2);
+        *p_out++ = *(p_file + 1);
+        *p_out++ = *(p_file    );
+        if(p_ctx->out_channels == 4)
+            *p_out++ = (has_alpha ? *(p_file + 3) : BMPREAD_DEFAULT_ALPHA);
 
-    /* out_inc is an incrementor for p_out to advance it one scan line.  I'm
-     * not exactly sure what the correct type for it would be, perhaps ssize_t,
-     * but that's not C standard.  I went with ptrdiff_t because its value
-     * will be equivalent to the difference between two pointers, whether it
-     * was derived that way or not.
-     */
-    ptrdiff_t out_inc;
+        p_file += 4;
+    }
+}
 
-    /* Double check this won't overflow.  Who knows, man. */
-#if SIZE_MAX > PTRDIFF_MAX
-    if(p_ctx->out_line_len > PTRDIFF_MAX) return 0;
-#endif
-    out_inc = p_ctx->out_line_len;
+#ifdef BMPREAD_SIMD_X86
+
+/* pshufb masks for 32-bit pixels: BGRA to RGBA, BGRX to RGB0 (ORed with alpha
+ * afterward), and BGRX to RGB packed into the low 12 bytes.
+ */
+static const uint8_t bgra_to_rgba_mask[16] =
+{
+    0x02, 0x01, 0x00, 0x03, 0x06, 0x05, 0x04, 0x07,
+    0x0a, 0x09, 0x08, 0x0b, 0x0e, 0x0d, 0x0c, 0x0f
+};
+static const uint8_t bgrx_to_rgb0_mask[16] =
+{
+    0x02, 0x01, 0x00, 0x80, 0x06, 0x05, 0x04, 0x80,
+    0x0a, 0x09, 0x08, 0x80, 0x0e, 0x0d, 0x0c, 0x80
+};
+static const uint8_t bgrx_to_rgb_mask[16] =
+{
+    0x02, 0x01, 0x00, 0x06, 0x05, 0x04, 0x0a, 0x09,
+    0x08, 0x0e, 0x0d, 0x0c, 0x80, 0x80, 0x80, 0x80
+};
+
+/* pshufb mask that drops the alpha from four RGBA pixels, packing the RGB
+ * into the low 12 bytes.
+ */
+static const uint8_t rgba_to_rgb_mask[16] =
+{
+    0x00, 0x01, 0x02, 0x04, 0x05, 0x06, 0x08, 0x09,
+    0x0a, 0x0c, 0x0d, 0x0e, 0x80, 0x80, 0x80, 0x80
+};
+
+/* Stores 16 RGB pixels, given as four registers each holding four pixels in
+ * their low 12 bytes (and zeroes above), as 48 contiguous bytes.
+ */
+BMPREAD_TARGET("ssse3")
+static void StoreRgb48Ssse3(uint8_t * p_out,
+                            __m128i s0, __m128i s1, __m128i s2, __m128i s3)
+{
+    _mm_storeu_si128((__m128i *)(p_out     ),
+                     _mm_or_si128(s0, _mm_slli_si128(s1, 12)));
+    _mm_storeu_si128((__m128i *)(p_out + 16),
+                     _mm_or_si128(_mm_srli_si128(s1, 4),
+                                  _mm_slli_si128(s2, 8)));
+    _mm_storeu_si128((__m128i *)(p_out + 32),
+                     _mm_or_si128(_mm_srli_si128(s2, 8),
+                                  _mm_slli_si128(s3, 4)));
+}
+
+/* Expands eight 16-bit pixels into two registers of four RGBA pixels each.
+ * Channels are widened to 8 bits in 16-bit lanes, the same way Make8Bits()
+ * does it, then interleaved.  rgb565 picks between LAYOUT_RGB565 and the 1555
+ * layouts; a is the alpha of each pixel in the low byte of its 16-bit lane.
+ */
+BMPREAD_TARGET("ssse3")
+static void Expand16Ssse3(__m128i v, int rgb565, __m128i a,
+                          __m128i * p_lo, __m128i * p_hi)
+{
+    const __m128i five = _mm_set1_epi16(0x1f);
+    __m128i r, g, b, rg, ba;
 
-    if(!(p_ctx->info.height < 0) == !(p_ctx->flags & BMPREAD_TOP_DOWN))
+    if(rgb565)
     {
-        /* We're keeping scan lines in order.  These and subsequent operations
-         * have all been checked earlier.
-         */
-        p_out     = p_ctx->data_out;
-        p_out_end = p_ctx->data_out +
-                    ((size_t)p_ctx->lines * p_ctx->out_line_len);
+        r = _mm_srli_epi16(v, 11);
+        g = _mm_and_si128(_mm_srli_epi16(v, 5), _mm_set1_epi16(0x3f));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
     }
-    else /* We're reversing scan lines. */
+    else
     {
-        /* TODO: I'm not 100% sure about the legality, purely C spec-wise, of
-         * this subtraction.
-         */
-        p_out_end = p_ctx->data_out - p_ctx->out_line_len;
-        p_out     = p_ctx->data_out +
-                    (((size_t)p_ctx->lines - 1) * p_ctx->out_line_len);
-
-        /* Always safe, given two's complement, since it was positive. */
-        out_inc = -out_inc;
+        r = _mm_and_si128(_mm_srli_epi16(v, 10), five);
+        g = _mm_and_si128(_mm_srli_epi16(v, 5), five);
+        g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
     }
+    b = _mm_and_si128(v, five);
 
-    p_line_end = p_out + (size_t)p_ctx->info.width * p_ctx->out_channels;
+    r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+    b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
 
-    switch(p_ctx->info.bits)
-    {
-        case 32: decoder = Decode32; break;
-        case 24: decoder = Decode24; break;
-        case 16: decoder = Decode16; break;
-        case 8:  decoder = Decode8;  break;
-        case 4:  decoder = Decode4;  break;
-        case 1:  decoder = Decode1;  break;
-        default: return 0;
-    }
+    rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+    ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+
+    *p_lo = _mm_unpacklo_epi16(rg, ba);
+    *p_hi = _mm_unpackhi_epi16(rg, ba);
+}
+
+/* Decodes the 16-bit layouts with SSSE3, 16 pixels at a time.  Whatever's
+ * left over at the end of the line goes through the scalar decoder.
+ */
+BMPREAD_TARGET("ssse3")
+static void Decode16Ssse3(uint8_t * p_out,
+                          const uint8_t * p_out_end,
+                          const uint8_t * p_file,
+                          const read_context * p_ctx)
+{
+    int rgb565    = (GetBitfieldLayout(p_ctx) == LAYOUT_RGB565);
+    int has_alpha = (GetBitfieldLayout(p_ctx) == LAYOUT_ARGB1555);
+
+    const __m128i default_alpha = _mm_set1_epi16(BMPREAD_DEFAULT_ALPHA);
+    const __m128i drop_alpha = LoadMask128(rgba_to_rgb_mask);
 
-    if(!CanMakeLong(p_ctx->header.data_offset))               return 0;
-    if(fseek(p_ctx->fp, p_ctx->header.data_offset, SEEK_SET)) return 0;
+    ptrdiff_t span = (ptrdiff_t)p_ctx->out_channels * 16;
 
-    while(p_out != p_out_end &&
-          fread(p_ctx->file_data, 1, p_ctx->file_line_len, p_ctx->fp) ==
-          p_ctx->file_line_len)
+    while(p_out_end - p_out >= span)
     {
-        decoder(p_out, p_line_end, p_ctx->file_data, p_ctx);
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p_file     ));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p_file + 16));
+        __m128i a0 = default_alpha;
+        __m128i a1 = default_alpha;
+        __m128i q0, q1, q2, q3;
+
+        if(has_alpha)
+        {
+            /* Smear the top bit across the lane: 0 or 0xffff. */
+            a0 = _mm_srli_epi16(_mm_srai_epi16(v0, 15), 8);
+            a1 = _mm_srli_epi16(_mm_srai_epi16(v1, 15), 8);
+        }
+
+        Expand16Ssse3(v0, rgb565, a0, &q0, &q1);
+        Expand16Ssse3(v1, rgb565, a1, &q2, &q3);
 
-        p_out      += out_inc;
-        p_line_end += out_inc;
+        if(p_ctx->out_channels == 4)
+        {
+            _mm_storeu_si128((__m128i *)(p_out     ), q0);
+            _mm_storeu_si128((__m128i *)(p_out + 16), q1);
+            _mm_storeu_si128((__m128i *)(p_out + 32), q2);
+            _mm_storeu_si128((__m128i *)(p_out + 48), q3);
+        }
+        else
+            StoreRgb48Ssse3(p_out,
+                            _mm_shuffle_epi8(q0, drop_alpha),
+                            _mm_shuffle_epi8(q1, drop_alpha),
+                            _mm_shuffle_epi8(q2, drop_alpha),
+                            _mm_shuffle_epi8(q3, drop_alpha));
+
+        p_out  += span;
+        p_file += 32;
     }
 
-    return (p_out == p_out_end);
+    if(rgb565)
+        Decode16Rgb565(p_out, p_out_end, p_file, p_ctx);
+    else
+        Decode16Rgb555(p_out, p_out_end, p_file, p_ctx);
 }
 
-/* Frees resources allocated by various functions along the way.  Only frees
- * data_out if !leave_data_out (if the bitmap loads successfully, you want the
- * data to remain until THEY free it).
+/* Decodes the 32-bit layouts with SSSE3, 16 pixels at a time.
  */
-static void FreeContext(read_context * p_ctx, int leave_data_out)
+BMPREAD_TARGET("ssse3")
+static void Decode32Ssse3(uint8_t * p_out,
+                          const uint8_t * p_out_end,
+                          const uint8_t * p_file,
+                          const read_context * p_ctx)
 {
-    if(p_ctx->fp)
-        fclose(p_ctx->fp);
-    if(p_ctx->palette)
-        free(p_ctx->palette);
-    if(p_ctx->file_data)
-        free(p_ctx->file_data);
+    if(p_ctx->out_channels == 4)
+    {
+        int has_alpha = (p_ctx->bitfields[3].span != 0);
+        const __m128i mask  = LoadMask128(has_alpha ? bgra_to_rgba_mask :
+                                                      bgrx_to_rgb0_mask);
+        const __m128i alpha = (has_alpha ? _mm_setzero_si128() :
+                               _mm_slli_epi32(
+                                   _mm_set1_epi32(BMPREAD_DEFAULT_ALPHA), 24));
+
+        while(p_out_end - p_out >= 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)p_file);
+
+            _mm_storeu_si128((__m128i *)p_out,
+                             _mm_or_si128(_mm_shuffle_epi8(x, mask), alpha));
 
-    if(!leave_data_out && p_ctx->data_out)
-        free(p_ctx->data_out);
+            p_out  += 16;
+            p_file += 16;
+        }
+    }
+    else
+    {
+        const __m128i mask = LoadMask128(bgrx_to_rgb_mask);
+
+        while(p_out_end - p_out >= 48)
+        {
+            __m128i x0 = _mm_loadu_si128((const __m128i *)(p_file     ));
+            __m128i x1 = _mm_loadu_si128((const __m128i *)(p_file + 16));
+            __m128i x2 = _mm_loadu_si128((const __m128i *)(p_file + 32));
+            __m128i x3 = _mm_loadu_si128((const __m128i *)(p_file + 48));
+
+            StoreRgb48Ssse3(p_out,
+                            _mm_shuffle_epi8(x0, mask),
+                            _mm_shuffle_epi8(x1, mask),
+                            _mm_shuffle_epi8(x2, mask),
+                            _mm_shuffle_epi8(x3, mask));
+
+            p_out  += 48;
+            p_file += 64;
+        }
+    }
+
+    Decode32Rgb888(p_out, p_out_end, p_file, p_ctx);
 }
 
-int bmpread(const char * bmp_file, unsigned int flags, bmpread_t * p_bmp_out)
+/* Decodes the 32-bit layouts with AVX2, 8 pixels at a time.  For RGB output,
+ * each 128-bit half packs its four pixels into its low 12 bytes, and a
+ * cross-lane permute then closes the gap in the middle.
+ */
+BMPREAD_TARGET("avx2")
+static void Decode32Avx2(uint8_t * p_out,
+                         const uint8_t * p_out_end,
+                         const uint8_t * p_file,
+                         const read_context * p_ctx)
 {
-    int success = 0;
+    if(p_ctx->out_channels == 4)
+    {
+        int has_alpha = (p_ctx->bitfields[3].span != 0);
+        const __m256i mask  = _mm256_broadcastsi128_si256(
+                                  LoadMask128(has_alpha ? bgra_to_rgba_mask :
+                                                          bgrx_to_rgb0_mask));
+        const __m256i alpha = (has_alpha ? _mm256_setzero_si256() :
+                               _mm256_slli_epi32(
+                                   _mm256_set1_epi32(BMPREAD_DEFAULT_ALPHA),
+                                   24));
+
+        while(p_out_end - p_out >= 32)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)p_file);
 
-    read_context ctx;
-    memset(&ctx, 0, sizeof(ctx));
+            _mm256_storeu_si256((__m256i *)p_out,
+                                _mm256_or_si256(_mm256_shuffle_epi8(x, mask),
+                                                alpha));
 
-    do
+            p_out  += 32;
+            p_file += 32;
+        }
+    }
+    else
     {
-        if(!bmp_file)  break;
-        if(!p_bmp_out) break;
-        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+        const __m256i mask = _mm256_broadcastsi128_si256(
+                                 LoadMask128(bgrx_to_rgb_mask));
+        const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
 
-        ctx.flags = flags;
+        while(p_out_end - p_out >= 24)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)p_file);
 
-        if(!(ctx.fp = fopen(bmp_file, "rb"))) break;
-        if(!Validate(&ctx))                   break;
-        if(!Decode(&ctx))                     break;
+            x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, mask),
+                                            pack);
 
-        /* Finally, make sure we can stuff these into ints.  I feel like this
-         * is slightly justified by how it keeps the header definition dead
-         * simple (including, well, no #includes).  I suppose this could also
-         * be done way earlier and maybe save some disk reads, but I like
-         * keeping the check with the code it's checking.
-         */
-#if INT32_MAX > INT_MAX
-        if(ctx.info.width > INT_MAX) break;
-        if(ctx.lines      > INT_MAX) break;
-#endif
+            _mm_storeu_si128((__m128i *)p_out, _mm256_castsi256_si128(x));
+            _mm_storel_epi64((__m128i *)(p_out + 16),
+                             _mm256_extracti128_si256(x, 1));
 
-        p_bmp_out->width  = ctx.info.width;
-        p_bmp_out->height = ctx.lines;
-        p_bmp_out->flags  = ctx.flags;
-        p_bmp_out->data   = ctx.data_out;
+            p_out  += 24;
+            p_file += 32;
+        }
+    }
 
-        success = 1;
-    } while(0);
+    Decode32Ssse3(p_out, p_out_end, p_file, p_ctx);
+}
 
-    FreeContext(&ctx, success);
+#endif /* BMPREAD_SIMD_X86 */
 
-    return success;
+/* Picks the fastest decoder this CPU can run for the file's bitfields,
+ * falling back to the general Decode16() or Decode32() for unusual ones.
+ * Must be called after ValidateBitfields().
+ */
+static decoder_fn SelectDecodeBitfields(const read_context * p_ctx)
+{
+    int layout = GetBitfieldLayout(p_ctx);
+
+#ifdef BMPREAD_SIMD_X86
+    unsigned int cpu = GetCpuFeatures();
+
+    switch(layout)
+    {
+        case LAYOUT_RGB565:
+        case LAYOUT_XRGB1555:
+        case LAYOUT_ARGB1555:
+            if(cpu & CPU_SSSE3) return Decode16Ssse3;
+            break;
+
+        case LAYOUT_XRGB8888:
+        case LAYOUT_ARGB8888:
+            if(cpu & CPU_AVX2)  return Decode32Avx2;
+            if(cpu & CPU_SSSE3) return Decode32Ssse3;
+            break;
+    }
+#endif
+
+    switch(layout)
+    {
+        case LAYOUT_RGB565:   return Decode16Rgb565;
+        case LAYOUT_XRGB1555:
+        case LAYOUT_ARGB1555: return Decode16Rgb555;
+        case LAYOUT_XRGB8888:
+        case LAYOUT_ARGB8888: return Decode32Rgb888;
+    }
+
+    return ((p_ctx->info.bits == 32) ? Decode32 : Decode16);
 }
 
-void bmpread_free(bmpread_t * p_bmp)
+/* Decodes 1-, 4- or 8-bit bitmap data with the context's expansion table
+ * (see BuildExpansion()), turning each byte of the file into all its pixels
+ * with one store of entry bytes, then moving on by step, the output size of
+ * those pixels.  When step < entry, each store runs over into the next
+ * pixels, which the following store overwrites; the last few pixels of the
+ * line are copied exactly so nothing past p_out_end gets touched.
+ */
+static void DecodeIndexed(uint8_t * p_out,
+                          const uint8_t * p_out_end,
+                          const uint8_t * p_file,
+                          const read_context * p_ctx,
+                          size_t entry,
+                          size_t step)
 {
-    if(p_bmp)
+    const uint8_t * table = p_ctx->expansion;
+
+    while((size_t)(p_out_end - p_out) >= entry)
     {
-        if(p_bmp->data)
-            free(p_bmp->data);
+        memcpy(p_out, table + *p_file++ * entry, entry);
+        p_out += step;
+    }
 
-        memset(p_bmp, 0, sizeof(*p_bmp));
+    while(p_out < p_out_end)
+    {
+        size_t len = (size_t)(p_out_end - p_out);
+        if(len > step)
+            len = step;
+
+        memcpy(p_out, table + *p_file++ * entry, len);
+        p_out += len;
     }
 }
+
+/* Decodes 8-bit bitmap data by looking colors up in the palette.  Entries are
+ * one RGBA pixel; without alpha, each store's last byte is overwritten by the
+ * next pixel.
+ */
+static void Decode8(uint8_t * p_out,
+                    const uint8_t * p_out_end,
+                    const uint8_t * p_file,
+                    const read_context * p_ctx)
+{
+    if(p_ctx->out_channels == 4)
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 4, 4);
+    else
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 4, 3);
+}
+
+/* Decodes 4-bit bitmap data by looking colors up in the palette, a pair of
+ * pixels at a time.
+ */
+static void Decode4(uint8_t * p_out,
+                    const uint8_t * p_out_end,
+                    const uint8_t * p_file,
+                    const read_context * p_ctx)
+{
+    if(p_ctx->out_channels == 4)
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 8, 8);
+    else
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 8, 6);
+}
+
+/* Decodes 1-bit bitmap data by looking colors up in the two-color palette,
+ * eight pixels at a time.
+ */
+static void Decode1(uint8_t * p_out,
+                    const uint8_t * p_out_end,
+                    const uint8_t * p_file,
+                    const read_context * p_ctx)
+{
+    if(p_ctx->out_channels == 4)
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 32, 32);
+    else
+        DecodeIndexed(p_out, p_out_end, p_file, p_ctx, 32, 24);
+}
+
+/* Returns a pointer to where the given scan line of the file (counting in file
+ * order, from 0) goes in the output buffer.
+ */
+static uint8_t * GetOutLine(const read_context * p_ctx, size_t line)
+{
+    int reverse = (!(p_ctx->info.height < 0) !=
+                   !(p_ctx->flags & BMPREAD_TOP_DOWN));
+
+    /* When streaming, data_out holds just the current band, in the same
+     * order as the output.
+     */
+    if(p_ctx->band_fn)
+    {
+        line %= p_ctx->band_lines;
+        if(reverse)
+            line = p_ctx->band_lines - 1 - line;
+
+        return p_ctx->data_out + line * p_ctx->out_line_len;
+    }
+
+    /* We're reversing scan lines.  This and the multiplication below have
+     * been checked back in Validate().
+     */
+    if(reverse)
+        line = (size_t)p_ctx->lines - 1 - line;
+
+    return p_ctx->data_out + line * p_ctx->out_line_len;
+}
+
+/* Called once each output line (counting in file order, as for GetOutLine())
+ * is complete.  When streaming, hands the band to the callback once its last
+ * line, or the image's, is done.  Lines are completed in file order, so the
+ * band fills up from one end to the other before it's reused.
+ */
+static void FinishLine(const read_context * p_ctx, size_t line)
+{
+    bmpread_band_t band;
+    size_t count;
+    int reverse;
+
+    if(!p_ctx->band_fn) return;
+
+    count = line % p_ctx->band_lines + 1;
+    if(count < p_ctx->band_lines && line != (size_t)p_ctx->lines - 1) return;
+
+    reverse = (!(p_ctx->info.height < 0) !=
+               !(p_ctx->flags & BMPREAD_TOP_DOWN));
+
+    /* A short last band sits at the end of data_out when reversed. */
+    band.width      = p_ctx->width;
+    band.height     = p_ctx->lines;
+    band.flags      = p_ctx->flags;
+    band.first_line = (int)(reverse ? (size_t)p_ctx->lines - 1 - line :
+                                      line + 1 - count);
+    band.lines      = (int)count;
+    band.line_len   = p_ctx->out_line_len;
+    band.data       = p_ctx->data_out +
+                      (reverse ? p_ctx->band_lines - count : 0) *
+                      p_ctx->out_line_len;
+
+    p_ctx->band_fn(p_ctx->band_user, &band);
+}
+
+/* A run of consecutive scan lines to decode, e.g. one thread's share.
+ */
+typedef struct decode_band
+{
+    const read_context * p_ctx;   /* The bitmap we're decoding. */
+    decoder_fn           decoder; /* Decoder for its bit depth. */
+    const uint8_t      * p_file;  /* First pixel of the band's first line. */
+    size_t               first;   /* Index of the first line, in file order. */
+    size_t               count;   /* How many lines in the band. */
+
+} decode_band;
+
+/* Decodes one scan line, starting at the byte of the file holding its first
+ * pixel.  If that pixel isn't the first in its byte (only possible for a
+ * region of a 1- or 4-bit bitmap), the whole byte is decoded off to the side
+ * and just the pixels we want are copied out of it.
+ */
+static void DecodeLine(const read_context * p_ctx,
+                       decoder_fn decoder,
+                       uint8_t * p_out,
+                       const uint8_t * p_file)
+{
+    uint8_t * p_out_end = p_out +
+                          (size_t)p_ctx->in_width * p_ctx->out_channels;
+
+    if(p_ctx->lead_pixels)
+    {
+        uint8_t byte_out[32] = { 0 }; /* Eight 4-channel pixels at most. */
+
+        size_t pixels = 8 / p_ctx->info.bits;
+        size_t len = (pixels - p_ctx->lead_pixels) * p_ctx->out_channels;
+
+        if(len > (size_t)(p_out_end - p_out))
+            len = (size_t)(p_out_end - p_out);
+
+        decoder(byte_out, byte_out + pixels * p_ctx->out_channels, p_file,
+                p_ctx);
+        memcpy(p_out,
+               byte_out + p_ctx->lead_pixels * p_ctx->out_channels, len);
+
+        p_out += len;
+        p_file++;
+    }
+
+    decoder(p_out, p_out_end, p_file, p_ctx);
+}
+
+/* Adds a decoded line into the column sums, one channel value at a time.
+ */
+static void SumColumns(uint16_t * sums, const uint8_t * p_in, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; i++)
+        sums[i] += p_in[i];
+}
+
+#ifdef BMPREAD_SIMD_X86
+
+/* Adds a decoded line into the column sums, 16 channel values at a time.
+ */
+BMPREAD_TARGET("ssse3")
+static void SumColumnsSsse3(uint16_t * sums, const uint8_t * p_in, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for(i = 0; len - i >= 16; i += 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(p_in + i));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(sums + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(sums + i + 8));
+
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(in, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(in, zero));
+
+        _mm_storeu_si128((__m128i *)(sums + i),     lo);
+        _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+    }
+
+    SumColumns(sums + i, p_in + i, len - i);
+}
+
+/* Adds a decoded line into the column sums, 32 channel values at a time.
+ */
+BMPREAD_TARGET("avx2")
+static void SumColumnsAvx2(uint16_t * sums, const uint8_t * p_in, size_t len)
+{
+    size_t i;
+
+    for(i = 0; len - i >= 32; i += 32)
+    {
+        __m256i in_lo = _mm256_cvtepu8_epi16(
+                        _mm_loadu_si128((const __m128i *)(p_in + i)));
+        __m256i in_hi = _mm256_cvtepu8_epi16(
+                        _mm_loadu_si128((const __m128i *)(p_in + i + 16)));
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(sums + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(sums + i + 16));
+
+        _mm256_storeu_si256((__m256i *)(sums + i),
+                            _mm256_add_epi16(lo, in_lo));
+        _mm256_storeu_si256((__m256i *)(sums + i + 16),
+                            _mm256_add_epi16(hi, in_hi));
+    }
+
+    SumColumns(sums + i, p_in + i, len - i);
+}
+
+#endif /* BMPREAD_SIMD_X86 */
+
+/* Picks the fastest way this CPU has to add lines into the column sums.
+ */
+static sum_fn SelectSumColumns(void)
+{
+#ifdef BMPREAD_SIMD_X86
+    unsigned int cpu = GetCpuFeatures();
+
+    if(cpu & CPU_AVX2)  return SumColumnsAvx2;
+    if(cpu & CPU_SSSE3) return SumColumnsSsse3;
+#endif
+
+    return SumColumns;
+}
+
+/* Writes out the rounded averages of boxes of scale full columns and
+ * scale lines, holding a power of 2 pixels, by shifting.  Called with
+ * constant scale, shift and channels so the inner loops unroll.
+ */
+static void AverageFullBoxes(uint8_t * p_out,
+                             const uint16_t * sums,
+                             size_t boxes,
+                             size_t scale,
+                             unsigned int shift,
+                             size_t channels)
+{
+    uint32_t half = UINT32_C(1) << (shift - 1);
+    size_t x;
+    size_t i;
+    size_t j;
+
+    for(x = 0; x < boxes; x++)
+    {
+        for(i = 0; i < channels; i++)
+        {
+            uint32_t sum = half;
+            for(j = 0; j < scale; j++)
+                sum += sums[j * channels + i];
+
+            *p_out++ = (uint8_t)(sum >> shift);
+        }
+
+        sums += scale * channels;
+    }
+}
+
+/* Writes out the rounded averages of the column sums for one line of boxes,
+ * each box_height lines tall, and starts the sums over.  Each box adds up
+ * scale columns (fewer on the right edge).  Full boxes hold a power of 2
+ * pixels, so they're just shifted; only the boxes along the right and bottom
+ * edges need dividing.
+ */
+static void AverageSums(uint8_t * p_out,
+                        uint16_t * sums,
+                        const read_context * p_ctx,
+                        size_t box_height)
+{
+    size_t scale    = p_ctx->scale;
+    size_t channels = p_ctx->out_channels;
+    size_t boxes    = (size_t)p_ctx->width;
+    size_t x        = 0;
+    size_t i;
+    size_t j;
+
+    if(box_height == scale)
+    {
+        /* All but a short box on the right edge. */
+        x = (size_t)p_ctx->in_width / scale;
+
+        switch(scale * 8 + channels)
+        {
+            case 2 * 8 + 3: AverageFullBoxes(p_out, sums, x, 2, 2, 3); break;
+            case 2 * 8 + 4: AverageFullBoxes(p_out, sums, x, 2, 2, 4); break;
+            case 4 * 8 + 3: AverageFullBoxes(p_out, sums, x, 4, 4, 3); break;
+            case 4 * 8 + 4: AverageFullBoxes(p_out, sums, x, 4, 4, 4); break;
+            case 8 * 8 + 3: AverageFullBoxes(p_out, sums, x, 8, 6, 3); break;
+            case 8 * 8 + 4: AverageFullBoxes(p_out, sums, x, 8, 6, 4); break;
+        }
+    }
+
+    for(; x < boxes; x++)
+    {
+        size_t columns = (size_t)p_ctx->in_width - x * scale;
+        size_t pixels;
+
+        if(columns > scale)
+            columns = scale;
+        pixels = columns * box_height;
+
+        for(i = 0; i < channels; i++)
+        {
+            uint32_t sum = pixels / 2;
+            for(j = 0; j < columns; j++)
+                sum += sums[(x * scale + j) * channels + i];
+
+            p_out[x * channels + i] = (uint8_t)(sum / pixels);
+        }
+    }
+
+    memset(sums, 0, (size_t)p_ctx->in_width * channels * sizeof(sums[0]));
+}
+
+/* Adds a decoded scan line (counting in file order, from 0) into the running
+ * sums of each column, and once the last line of a line of boxes is in,
+ * averages the sums into the output.  Boxes line up with the top left of the
+ * image whichever order the file's lines are in, so an image scales the same
+ * stored top-down or bottom-up.  Sums of up to 8 x 8 pixels fit in 16 bits.
+ */
+static void ScaleLine(const read_context * p_ctx,
+                      size_t line,
+                      const uint8_t * p_in)
+{
+    size_t scale    = p_ctx->scale;
+    size_t in_lines = p_ctx->in_lines;
+    int top_down    = (p_ctx->info.height < 0);
+
+    /* Which line of the image this is, from the top, and its box's. */
+    size_t row        = (top_down ? line : in_lines - 1 - line);
+    size_t box_top    = row - row % scale;
+    size_t box_height = ((in_lines - box_top < scale) ?
+                         in_lines - box_top : scale);
+
+    /* Add the line into the column sums; AverageSums() does the rest. */
+    p_ctx->sum_columns(p_ctx->sums, p_in,
+                       (size_t)p_ctx->in_width * p_ctx->out_channels);
+
+    /* Top-down, the box's bottom line comes last; bottom-up, its top. */
+    if(top_down ? (row == box_top + box_height - 1) : (row == box_top))
+    {
+        size_t out_line = box_top / scale;
+
+        if(!top_down)
+            out_line = (size_t)p_ctx->lines - 1 - out_line;
+
+        AverageSums(GetOutLine(p_ctx, out_line), p_ctx->sums, p_ctx,
+                    box_height);
+        FinishLine(p_ctx, out_line);
+    }
+}
+
+/* Decodes each scan line of a band into its place in the output buffer, or
+ * into the box sums when scaling.
+ */
+static void DecodeBand(const decode_band * band)
+{
+    const read_context * p_ctx = band->p_ctx;
+    const uint8_t * p_file = band->p_file;
+
+    size_t line;
+
+    for(line = band->first; line < band->first + band->count; line++)
+    {
+        if(p_ctx->scale > 1)
+        {
+            DecodeLine(p_ctx, band->decoder, p_ctx->scratch, p_file);
+            ScaleLine(p_ctx, line, p_ctx->scratch);
+        }
+        else
+        {
+            DecodeLine(p_ctx, band->decoder, GetOutLine(p_ctx, line), p_file);
+            FinishLine(p_ctx, line);
+        }
+
+        p_file += p_ctx->file_line_len;
+    }
+}
+
+#ifdef BMPREAD_THREADS_ENABLED
+
+#if defined(BMPREAD_THREADS_WIN32)
+
+typedef HANDLE thread_handle;
+
+static DWORD WINAPI DecodeBandThread(LPVOID arg)
+{
+    DecodeBand((const decode_band *)arg);
+    return 0;
+}
+
+/* Starts decoding a band on a new thread.  Returns 0 if the thread couldn't
+ * be created or nonzero on success.
+ */
+static int StartBandThread(thread_handle * thread, decode_band * band)
+{
+    *thread = CreateThread(NULL, 0, DecodeBandThread, band, 0, NULL);
+    return (*thread != NULL);
+}
+
+/* Waits for a thread started by StartBandThread() to finish.
+ */
+static void JoinBandThread(thread_handle thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+/* Returns how many CPUs we could be running on.
+ */
+static size_t GetCpuCount(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+#else /* BMPREAD_THREADS_POSIX */
+
+typedef pthread_t thread_handle;
+
+static void * DecodeBandThread(void * arg)
+{
+    DecodeBand((const decode_band *)arg);
+    return NULL;
+}
+
+static int StartBandThread(thread_handle * thread, decode_band * band)
+{
+    return !pthread_create(thread, NULL, DecodeBandThread, band);
+}
+
+static void JoinBandThread(thread_handle thread)
+{
+    pthread_join(thread, NULL);
+}
+
+static size_t GetCpuCount(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return ((cpus > 0) ? (size_t)cpus : 1);
+}
+
+#endif
+
+/* Decides how many threads to decode the bitmap with, given the size of the
+ * output.  Starting a thread costs something, so each one has to get at
+ * least BMPREAD_THREAD_MIN_BYTES of output to be worth it; small bitmaps get
+ * just the one thread we're already on.
+ */
+static size_t GetDecodeThreads(const read_context * p_ctx)
+{
+    size_t threads = (max_threads ? max_threads : GetCpuCount());
+    size_t by_size = (size_t)p_ctx->lines * p_ctx->out_line_len /
+                     BMPREAD_THREAD_MIN_BYTES;
+
+    if(threads > BMPREAD_MAX_THREADS)
+        threads = BMPREAD_MAX_THREADS;
+    if(threads > by_size)
+        threads = by_size;
+
+    return ((threads < 1) ? 1 : threads);
+}
+
+/* Splits the pixel array, which is entirely in memory at p_file, into one
+ * band per thread and decodes them all at once.  The calling thread decodes
+ * the first band itself, along with any band whose thread fails to start.
+ */
+static void DecodeBands(const read_context * p_ctx,
+                        decoder_fn decoder,
+                        const uint8_t * p_file,
+                        size_t threads)
+{
+    decode_band   bands[BMPREAD_MAX_THREADS];
+    thread_handle handles[BMPREAD_MAX_THREADS];
+    int           started[BMPREAD_MAX_THREADS];
+
+    size_t per_band = (size_t)p_ctx->in_lines / threads;
+    size_t extra    = (size_t)p_ctx->in_lines % threads;
+    size_t first    = 0;
+    size_t i;
+
+    for(i = 0; i < threads; i++)
+    {
+        bands[i].p_ctx   = p_ctx;
+        bands[i].decoder = decoder;
+        bands[i].p_file  = p_file + first * p_ctx->file_line_len;
+        bands[i].first   = first;
+        bands[i].count   = per_band + (i < extra);
+
+        first += bands[i].count;
+    }
+
+    for(i = 1; i < threads; i++)
+        started[i] = StartBandThread(&handles[i], &bands[i]);
+
+    DecodeBand(&bands[0]);
+
+    for(i = 1; i < threads; i++)
+    {
+        if(started[i])
+            JoinBandThread(handles[i]);
+        else
+            DecodeBand(&bands[i]);
+    }
+}
+
+#endif /* BMPREAD_THREADS_ENABLED */
+
+/* Returns where an RLE bitmap's given scan line (counting in file order,
+ * from 0) gets decoded: its place in the output, or the scratch line when
+ * scaling.
+ */
+static uint8_t * GetRleLine(const read_context * p_ctx, size_t line)
+{
+    return ((p_ctx->scale > 1) ? p_ctx->scratch : GetOutLine(p_ctx, line));
+}
+
+/* Zeroes the output pixels an RLE bitmap skips over (with a delta, the end of
+ * a line, or the end of the bitmap), from pixel x of file line y up to but not
+ * including pixel to_x of line to_y.  Skipped pixels come out black, and fully
+ * transparent with BMPREAD_ALPHA.  Bytes after the last pixel of each line are
+ * left alone.  Lines before to_y are then finished: when scaling, they go
+ * into the box sums, and when streaming, out with their band.
+ */
+static void ClearRle(const read_context * p_ctx,
+                     size_t x,
+                     size_t y,
+                     size_t to_x,
+                     size_t to_y)
+{
+    size_t width = p_ctx->info.width;
+
+    for(; y <= to_y && y < (size_t)p_ctx->in_lines; y++, x = 0)
+    {
+        size_t end = ((y == to_y && to_x < width) ? to_x : width);
+
+        if(x < end)
+            memset(GetRleLine(p_ctx, y) + x * p_ctx->out_channels, 0,
+                   (end - x) * p_ctx->out_channels);
+
+        if(y < to_y)
+        {
+            if(p_ctx->scale > 1)
+                ScaleLine(p_ctx, y, p_ctx->scratch);
+            else
+                FinishLine(p_ctx, y);
+        }
+    }
+}
+
+/* Decodes an RLE8 or RLE4 bitmap straight into the output, reading the
+ * compressed stream in chunks as it goes.  Each run is handed to Decode8() or
+ * Decode4(): pixels given literally (absolute mode) are already laid out the
+ * way those expect, and a repeated color or pair of colors (encoded mode) is
+ * spread out into a small buffer first.  Pixels past the right edge are
+ * dropped.  Returns 0 if the stream is truncated or 1 if it's gravy.
+ */
+static int DecodeRle(read_context * p_ctx)
+{
+    decoder_fn decoder = ((p_ctx->info.compression == COMPRESSION_RLE8) ?
+                          Decode8 : Decode4);
+    size_t width = p_ctx->info.width;
+    size_t x = 0;
+    size_t y = 0;
+
+    uint8_t run[255]; /* Indexes for an encoded run; 255 is the most. */
+
+    p_ctx->src.readahead = BMPREAD_READ_CHUNK;
+    if(!SourceSeek(&p_ctx->src, p_ctx->header.data_offset)) return 0;
+
+    while(y < (size_t)p_ctx->in_lines)
+    {
+        const uint8_t * p_pixels;
+        const uint8_t * p;
+        size_t count;
+        size_t bytes;
+
+        if(!(p = SourceRead(&p_ctx->src, 2))) return 0;
+
+        if((count = p[0]) != 0) /* Encoded mode: count pixels of p[1]. */
+        {
+            bytes = ((decoder == Decode8) ? count : (count + 1) / 2);
+            memset(run, p[1], bytes);
+            p_pixels = run;
+        }
+        else if(p[1] == 0) /* End of line. */
+        {
+            ClearRle(p_ctx, x, y, 0, y + 1);
+            x = 0;
+            y++;
+            continue;
+        }
+        else if(p[1] == 1) /* End of bitmap. */
+            break;
+        else if(p[1] == 2) /* Delta: skip right and up. */
+        {
+            size_t to_x;
+            size_t to_y;
+
+            if(!(p = SourceRead(&p_ctx->src, 2))) return 0;
+
+            if(!CanAdd(x, p[0]) || !CanAdd(y, p[1])) return 0;
+            to_x = x + p[0];
+            to_y = y + p[1];
+
+            ClearRle(p_ctx, x, y, to_x, to_y);
+            x = to_x;
+            y = to_y;
+            continue;
+        }
+        else /* Absolute mode: p[1] pixels follow, padded to 16 bits. */
+        {
+            count = p[1];
+            bytes = ((decoder == Decode8) ? count : (count + 1) / 2);
+
+            if(!(p_pixels = SourceRead(&p_ctx->src, bytes + (bytes & 1))))
+                return 0;
+        }
+
+        if(x < width)
+        {
+            size_t end = ((count < width - x) ? x + count : width);
+            uint8_t * p_out = GetRleLine(p_ctx, y);
+
+            decoder(p_out + x   * p_ctx->out_channels,
+                    p_out + end * p_ctx->out_channels,
+                    p_pixels, p_ctx);
+            x = end;
+        }
+    }
+
+    /* Whatever's left when the bitmap ends early is skipped, too. */
+    ClearRle(p_ctx, x, y, 0, p_ctx->in_lines);
+
+    return 1;
+}
+
+/* Moves the source to the start of the first scan line we output.  Returns 0
+ * if the offset can't be represented or nonzero on success.
+ */
+static int SeekToPixels(read_context * p_ctx)
+{
+    size_t skip;
+
+    if(!SourceSeek(&p_ctx->src, p_ctx->header.data_offset))     return 0;
+    if(!CanMultiply(p_ctx->first_line, p_ctx->file_line_len))  return 0;
+    skip = p_ctx->first_line * p_ctx->file_line_len;
+    if(!CanAdd(p_ctx->src.pos, skip))                          return 0;
+
+    p_ctx->src.pos += skip;
+    return 1;
+}
+
+/* Selects an above decoder and runs it for each scan line of the file.
+ * Returns 0 if there's an error or 1 if it's gravy.
+ */
+static int Decode(read_context * p_ctx)
+{
+    decoder_fn decoder;
+    decode_band band;
+
+    size_t chunk_lines; /* How many scan lines to read from a file at once. */
+
+    if(p_ctx->scale > 1)
+        p_ctx->sum_columns = SelectSumColumns();
+
+    if(p_ctx->info.compression == COMPRESSION_RLE8 ||
+       p_ctx->info.compression == COMPRESSION_RLE4)
+        return DecodeRle(p_ctx);
+
+    switch(p_ctx->info.bits)
+    {
+        case 32: decoder = SelectDecodeBitfields(p_ctx); break;
+        case 24: decoder = SelectDecode24(p_ctx);        break;
+        case 16: decoder = SelectDecodeBitfields(p_ctx); break;
+        case 8:  decoder = Decode8;  break;
+        case 4:  decoder = Decode4;  break;
+        case 1:  decoder = Decode1;  break;
+        default: return 0;
+    }
+
+    if(!SeekToPixels(p_ctx)) return 0;
+
+#ifdef BMPREAD_THREADS_ENABLED
+    /* Scaling adds lines into the box sums one after another, and streaming
+     * hands out bands one after another, so both stay on this thread.
+     */
+    if((p_ctx->flags & BMPREAD_THREADED) && p_ctx->scale == 1 &&
+       !p_ctx->band_fn)
+    {
+        size_t threads = GetDecodeThreads(p_ctx);
+
+        /* The bands need the whole pixel array in memory at once, which
+         * means one big read for a file source.  If that doesn't work out
+         * (most likely it doesn't fit in memory), carry on a chunk at a time
+         * below instead.
+         */
+        if(threads > 1 && CanMultiply(p_ctx->in_lines, p_ctx->file_line_len))
+        {
+            const uint8_t * p_file;
+
+            p_ctx->src.readahead = (size_t)p_ctx->in_lines *
+                                   p_ctx->file_line_len;
+            if((p_file = SourceRead(&p_ctx->src, p_ctx->src.readahead)))
+            {
+                DecodeBands(p_ctx, decoder, p_file + p_ctx->first_byte,
+                            threads);
+                return 1;
+            }
+
+            if(!SeekToPixels(p_ctx)) return 0;
+        }
+    }
+#endif
+
+    band.p_ctx   = p_ctx;
+    band.decoder = decoder;
+
+    /* For a narrow region of a wide file, read only the part of each line
+     * we need.
+     */
+    if(p_ctx->src.fp &&
+       p_ctx->file_line_len - p_ctx->span_len >= BMPREAD_SKIP_MIN_BYTES)
+    {
+        size_t line_start = p_ctx->src.pos;
+
+        p_ctx->src.readahead = p_ctx->span_len;
+        band.count = 1;
+
+        for(band.first = 0; band.first < (size_t)p_ctx->in_lines; band.first++)
+        {
+            p_ctx->src.pos = line_start + p_ctx->first_byte;
+            band.p_file = SourceRead(&p_ctx->src, p_ctx->span_len);
+            if(!band.p_file) return 0;
+
+            DecodeBand(&band);
+
+            if(!CanAdd(line_start, p_ctx->file_line_len)) return 0;
+            line_start += p_ctx->file_line_len;
+        }
+
+        return 1;
+    }
+
+    /* Read the pixel array in chunks of whole scan lines, the whole thing at
+     * once if it fits, rather than a line at a time.  The readahead can't
+     * overflow, being at most the larger of BMPREAD_READ_CHUNK and one line.
+     */
+    chunk_lines = BMPREAD_READ_CHUNK / p_ctx->file_line_len;
+    if(chunk_lines < 1)
+        chunk_lines = 1;
+    if(chunk_lines > (size_t)p_ctx->in_lines)
+        chunk_lines = p_ctx->in_lines;
+    p_ctx->src.readahead = chunk_lines * p_ctx->file_line_len;
+
+    for(band.first = 0; band.first < (size_t)p_ctx->in_lines;
+        band.first += band.count)
+    {
+        band.count = (size_t)p_ctx->in_lines - band.first;
+        if(band.count > chunk_lines)
+            band.count = chunk_lines;
+
+        band.p_file = SourceRead(&p_ctx->src,
+                                 band.count * p_ctx->file_line_len);
+        if(!band.p_file) return 0;
+
+        band.p_file += p_ctx->first_byte;
+        DecodeBand(&band);
+    }
+
+    return 1;
+}
+
+/* One direction of the filter the BMPREAD_POT_* flags resample with.  Each
+ * output pixel (or line) is made of the same number of input ones, taps,
+ * listed one output after another: which input each is, already clamped to
+ * the edges of the image, and its weight, in 1/16384ths that add up to 1.
+ */
+typedef struct resample_filter
+{
+    size_t    taps;
+    size_t  * index;
+    int16_t * weights;
+
+} resample_filter;
+
+/* Weights are fixed point with this many fractional bits.  Columns come out
+ * of the first pass with RESAMPLE_MID_BITS of their own, which keeps the
+ * second pass's sums under 2^31.
+ */
+#define RESAMPLE_WEIGHT_BITS 14
+#define RESAMPLE_MID_BITS    7
+
+/* Function that blends taps lines, weighted, into the columns from start to
+ * len of one line of RESAMPLE_MID_BITS fixed point values.  See
+ * SelectResampleColumns().
+ */
+typedef void (* resample_fn)(int16_t * p_out,
+                             const uint8_t * const * lines,
+                             const int16_t * weights,
+                             size_t taps,
+                             size_t start,
+                             size_t len);
+
+/* Rounds down, for the few negative values a filter's edges can reach. */
+static long FloorToLong(double x)
+{
+    long i = (long)x;
+    return (i > x) ? i - 1 : i;
+}
+
+/* Builds the filter that resamples in pixels to out with a tent filter.  Its
+ * radius is one pixel, or when shrinking, one output pixel's worth of input,
+ * so each input pixel contributes to the result.  Output pixel centers line
+ * up with the input's so neither edge is favored.  Returns 0 if out of
+ * memory or nonzero if ok.
+ */
+static int BuildFilter(resample_filter * filter,
+                       size_t in,
+                       size_t out,
+                       const bmpread_allocator_t * allocator)
+{
+    double scale  = (double)in / (double)out;
+    double radius = (scale > 1.0) ? scale : 1.0;
+    size_t o;
+    size_t t;
+
+    /* Pixels strictly within the radius on either side of a center. */
+    filter->taps = (size_t)(2.0 * radius);
+    if((double)filter->taps < 2.0 * radius)
+        filter->taps++;
+    if(filter->taps > 3) return 0;
+
+    if(!CanMultiply(out, filter->taps)) return 0;
+    if(!CanMultiply(out * filter->taps, sizeof(filter->index[0]))) return 0;
+
+    if(!(filter->index = (size_t *)
+         Allocate(allocator, out * filter->taps *
+                             sizeof(filter->index[0]))))   return 0;
+    if(!(filter->weights = (int16_t *)
+         Allocate(allocator, out * filter->taps *
+                             sizeof(filter->weights[0])))) return 0;
+
+    for(o = 0; o < out; o++)
+    {
+        size_t  * index   = filter->index   + o * filter->taps;
+        int16_t * weights = filter->weights + o * filter->taps;
+
+        double center = ((double)o + 0.5) * scale - 0.5;
+        long   first  = FloorToLong(center - radius) + 1;
+        double w[3];   /* scale is under sqrt(2), so at most 3 taps. */
+        double total = 0.0;
+        int    sum = 0;
+        size_t biggest = 0;
+
+        for(t = 0; t < filter->taps; t++)
+        {
+            long   pos  = first + (long)t;
+            double away = ((double)pos > center) ? pos - center :
+                                                   center - pos;
+
+            w[t] = (away < radius) ? 1.0 - away / radius : 0.0;
+            total += w[t];
+
+            index[t] = ((pos < 0) ? 0 :
+                        ((size_t)pos >= in) ? in - 1 : (size_t)pos);
+        }
+
+        /* Rounding leaves the total a little off 1, so the biggest weight
+         * makes up the difference.
+         */
+        for(t = 0; t < filter->taps; t++)
+        {
+            weights[t] = (int16_t)(w[t] / total *
+                                   (1 << RESAMPLE_WEIGHT_BITS) + 0.5);
+            sum += weights[t];
+            if(weights[t] > weights[biggest])
+                biggest = t;
+        }
+        weights[biggest] = (int16_t)(weights[biggest] +
+                                     (1 << RESAMPLE_WEIGHT_BITS) - sum);
+    }
+
+    return 1;
+}
+
+/* Blends lines into columns, one channel value at a time.
+ */
+static void ResampleColumns(int16_t * p_out,
+                            const uint8_t * const * lines,
+                            const int16_t * weights,
+                            size_t taps,
+                            size_t start,
+                            size_t len)
+{
+    const int32_t round = 1 << (RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS - 1);
+    size_t i;
+    size_t t;
+
+    for(i = start; i < len; i++)
+    {
+        int32_t sum = round;
+        for(t = 0; t < taps; t++)
+            sum += weights[t] * lines[t][i];
+
+        p_out[i] = (int16_t)(sum >> (RESAMPLE_WEIGHT_BITS -
+                                     RESAMPLE_MID_BITS));
+    }
+}
+
+#ifdef BMPREAD_SIMD_X86
+
+/* Both weights of a pair of taps, as one 32-bit lane for pmaddwd.  An odd
+ * last tap is paired with itself at weight 0.
+ */
+static int32_t PairWeights(const int16_t * weights, size_t t, size_t taps)
+{
+    uint32_t second = (t + 1 < taps) ? (uint16_t)weights[t + 1] : 0;
+    return (int32_t)((uint16_t)weights[t] | second << 16);
+}
+
+/* Blends lines into columns, 8 channel values at a time.  Values from each
+ * pair of lines are interleaved, so one multiply-add weights and sums both.
+ */
+BMPREAD_TARGET("ssse3")
+static void ResampleColumnsSsse3(int16_t * p_out,
+                                 const uint8_t * const * lines,
+                                 const int16_t * weights,
+                                 size_t taps,
+                                 size_t start,
+                                 size_t len)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(
+        1 << (RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS - 1));
+    size_t i;
+    size_t t;
+
+    for(i = start; len - i >= 8; i += 8)
+    {
+        __m128i lo = round;
+        __m128i hi = round;
+
+        for(t = 0; t < taps; t += 2)
+        {
+            const uint8_t * second = lines[(t + 1 < taps) ? t + 1 : t];
+            __m128i w = _mm_set1_epi32(PairWeights(weights, t, taps));
+            __m128i a = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64((const __m128i *)(lines[t] + i)), zero);
+            __m128i b = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64((const __m128i *)(second + i)), zero);
+
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+
+        lo = _mm_srai_epi32(lo, RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS);
+        hi = _mm_srai_epi32(hi, RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS);
+        _mm_storeu_si128((__m128i *)(p_out + i), _mm_packs_epi32(lo, hi));
+    }
+
+    ResampleColumns(p_out, lines, weights, taps, i, len);
+}
+
+/* Blends lines into columns, 16 channel values at a time.  The unpacks and
+ * the pack all work within 128-bit lanes, which puts the values back in
+ * order.
+ */
+BMPREAD_TARGET("avx2")
+static void ResampleColumnsAvx2(int16_t * p_out,
+                                const uint8_t * const * lines,
+                                const int16_t * weights,
+                                size_t taps,
+                                size_t start,
+                                size_t len)
+{
+    const __m256i round = _mm256_set1_epi32(
+        1 << (RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS - 1));
+    size_t i;
+    size_t t;
+
+    for(i = start; len - i >= 16; i += 16)
+    {
+        __m256i lo = round;
+        __m256i hi = round;
+
+        for(t = 0; t < taps; t += 2)
+        {
+            const uint8_t * second = lines[(t + 1 < taps) ? t + 1 : t];
+            __m256i w = _mm256_set1_epi32(PairWeights(weights, t, taps));
+            __m256i a = _mm256_cvtepu8_epi16(
+                        _mm_loadu_si128((const __m128i *)(lines[t] + i)));
+            __m256i b = _mm256_cvtepu8_epi16(
+                        _mm_loadu_si128((const __m128i *)(second + i)));
+
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+                                      _mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+                                      _mm256_unpackhi_epi16(a, b), w));
+        }
+
+        lo = _mm256_srai_epi32(lo, RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS);
+        hi = _mm256_srai_epi32(hi, RESAMPLE_WEIGHT_BITS - RESAMPLE_MID_BITS);
+        _mm256_storeu_si256((__m256i *)(p_out + i),
+                            _mm256_packs_epi32(lo, hi));
+    }
+
+    ResampleColumns(p_out, lines, weights, taps, i, len);
+}
+
+#endif /* BMPREAD_SIMD_X86 */
+
+/* Picks the fastest way this CPU has to blend lines into columns.
+ */
+static resample_fn SelectResampleColumns(void)
+{
+#ifdef BMPREAD_SIMD_X86
+    unsigned int cpu = GetCpuFeatures();
+
+    if(cpu & CPU_AVX2)  return ResampleColumnsAvx2;
+    if(cpu & CPU_SSSE3) return ResampleColumnsSsse3;
+#endif
+
+    return ResampleColumns;
+}
+
+/* Blends the columns of one line, as they come out of the first pass, into
+ * its output pixels.  Called with constant taps and channels so the inner
+ * loops unroll.
+ */
+static void ResamplePixels(uint8_t * p_out,
+                           const int16_t * p_in,
+                           const resample_filter * across,
+                           size_t width,
+                           size_t taps,
+                           size_t channels)
+{
+    const int32_t round = INT32_C(1) << (RESAMPLE_WEIGHT_BITS +
+                                         RESAMPLE_MID_BITS - 1);
+    const size_t  * index   = across->index;
+    const int16_t * weights = across->weights;
+    size_t x;
+    size_t c;
+    size_t t;
+
+    for(x = 0; x < width; x++)
+    {
+        for(c = 0; c < channels; c++)
+        {
+            int32_t sum = round;
+            for(t = 0; t < taps; t++)
+                sum += weights[t] * p_in[index[t] * channels + c];
+
+            /* The weights are never negative, so neither is this too big. */
+            *p_out++ = (uint8_t)(sum >> (RESAMPLE_WEIGHT_BITS +
+                                         RESAMPLE_MID_BITS));
+        }
+
+        index   += taps;
+        weights += taps;
+    }
+}
+
+#ifdef BMPREAD_SIMD_X86
+
+/* Blends the columns of one line into its output pixels a pixel at a time,
+ * all channels at once: a pair of taps' pixels interleaved, so one
+ * multiply-add weights and sums both.  Each pixel loads and stores 4
+ * channels, so for RGB the load runs one column into the next pixel (or the
+ * spare column at the end of p_in), and the store runs one byte into the
+ * next pixel, which is written next anyway; the last pixel goes through
+ * ResamplePixels() instead.
+ */
+BMPREAD_TARGET("ssse3")
+static void ResamplePixelsSsse3(uint8_t * p_out,
+                                const int16_t * p_in,
+                                const resample_filter * across,
+                                size_t width,
+                                size_t taps,
+                                size_t channels)
+{
+    const __m128i round = _mm_set1_epi32(
+        INT32_C(1) << (RESAMPLE_WEIGHT_BITS + RESAMPLE_MID_BITS - 1));
+    const size_t  * index   = across->index;
+    const int16_t * weights = across->weights;
+    size_t x;
+    size_t t;
+    int    x4;
+
+    for(x = 0; x + 1 < width; x++)
+    {
+        __m128i sum = round;
+
+        for(t = 0; t < taps; t += 2)
+        {
+            size_t  second = index[(t + 1 < taps) ? t + 1 : t];
+            __m128i w = _mm_set1_epi32(PairWeights(weights, t, taps));
+            __m128i a = _mm_loadl_epi64((const __m128i *)
+                                        (p_in + index[t] * channels));
+            __m128i b = _mm_loadl_epi64((const __m128i *)
+                                        (p_in + second * channels));
+
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+                                                    w));
+        }
+
+        sum = _mm_srai_epi32(sum, RESAMPLE_WEIGHT_BITS + RESAMPLE_MID_BITS);
+        sum = _mm_packs_epi32(sum, sum);
+        sum = _mm_packus_epi16(sum, sum);
+        x4 = _mm_cvtsi128_si32(sum);
+        memcpy(p_out, &x4, 4);
+        p_out += channels;
+
+        index   += taps;
+        weights += taps;
+    }
+
+    if(x < width)
+    {
+        resample_filter last;
+        last.taps    = taps;
+        last.index   = (size_t *)index;
+        last.weights = (int16_t *)weights;
+        ResamplePixels(p_out, p_in, &last, 1, taps, channels);
+    }
+}
+
+#endif /* BMPREAD_SIMD_X86 */
+
+/* ResamplePixels() for whichever taps and channels the filter has, or its
+ * SIMD version where the CPU has one.
+ */
+static void ResampleLine(uint8_t * p_out,
+                         const int16_t * p_in,
+                         const resample_filter * across,
+                         size_t width,
+                         size_t channels,
+                         int simd)
+{
+#ifdef BMPREAD_SIMD_X86
+    if(simd)
+    {
+        switch(across->taps)
+        {
+            case 1: ResamplePixelsSsse3(p_out, p_in, across, width, 1, channels);
+                    break;
+            case 2: ResamplePixelsSsse3(p_out, p_in, across, width, 2, channels);
+                    break;
+            case 3: ResamplePixelsSsse3(p_out, p_in, across, width, 3, channels);
+                    break;
+        }
+        return;
+    }
+#else
+    (void)simd;
+#endif
+
+    switch(across->taps * 8 + channels)
+    {
+        case 1 * 8 + 3: ResamplePixels(p_out, p_in, across, width, 1, 3); break;
+        case 1 * 8 + 4: ResamplePixels(p_out, p_in, across, width, 1, 4); break;
+        case 2 * 8 + 3: ResamplePixels(p_out, p_in, across, width, 2, 3); break;
+        case 2 * 8 + 4: ResamplePixels(p_out, p_in, across, width, 2, 4); break;
+        case 3 * 8 + 3: ResamplePixels(p_out, p_in, across, width, 3, 3); break;
+        case 3 * 8 + 4: ResamplePixels(p_out, p_in, across, width, 3, 4); break;
+    }
+}
+
+/* Resamples the decoded image in data_out into p_out, sized for pot_width x
+ * pot_lines: each output line blends a few decoded lines into one line of
+ * columns, which is then blended across into pixels.  Returns 0 if out of
+ * memory or nonzero if ok.
+ */
+static int ResampleToPowerOf2(const read_context * p_ctx, uint8_t * p_out)
+{
+    int success = 0;
+    resample_filter across;
+    resample_filter down;
+    const uint8_t ** lines = NULL;
+    int16_t * columns = NULL;
+    resample_fn resample_columns = SelectResampleColumns();
+    size_t len = (size_t)p_ctx->width * p_ctx->out_channels;
+    size_t line;
+    size_t t;
+    int simd = 0;
+
+#ifdef BMPREAD_SIMD_X86
+    simd = (GetCpuFeatures() & CPU_SSSE3) != 0;
+#endif
+
+    memset(&across, 0, sizeof(across));
+    memset(&down,   0, sizeof(down));
+
+    do
+    {
+        if(!BuildFilter(&across, p_ctx->width, p_ctx->pot_width,
+                        &p_ctx->allocator)) break;
+        if(!BuildFilter(&down, p_ctx->lines, p_ctx->pot_lines,
+                        &p_ctx->allocator)) break;
+
+        /* Plus a spare column for ResamplePixelsSsse3() to read past the
+         * last RGB pixel into.
+         */
+        if(!CanAdd(len, 1) || !CanMultiply(len + 1, sizeof(columns[0])))
+            break;
+        if(!(lines = (const uint8_t **)
+             Allocate(&p_ctx->allocator, down.taps * sizeof(lines[0]))))
+            break;
+        if(!(columns = (int16_t *)
+             AllocateZeroed(&p_ctx->allocator, len + 1, sizeof(columns[0]))))
+            break;
+
+        for(line = 0; line < (size_t)p_ctx->pot_lines; line++)
+        {
+            for(t = 0; t < down.taps; t++)
+                lines[t] = p_ctx->data_out +
+                           down.index[line * down.taps + t] *
+                           p_ctx->out_line_len;
+
+            resample_columns(columns, lines, down.weights + line * down.taps,
+                             down.taps, 0, len);
+            ResampleLine(p_out + line * p_ctx->pot_line_len, columns,
+                         &across, p_ctx->pot_width, p_ctx->out_channels,
+                         simd);
+        }
+
+        success = 1;
+    } while(0);
+
+    Release(&p_ctx->allocator, across.index);
+    Release(&p_ctx->allocator, across.weights);
+    Release(&p_ctx->allocator, down.index);
+    Release(&p_ctx->allocator, down.weights);
+    Release(&p_ctx->allocator, (void *)lines);
+    Release(&p_ctx->allocator, columns);
+
+    return success;
+}
+
+/* Copies the decoded image in data_out into p_out, sized for pot_width x
+ * pot_lines, repeating the last pixel of each line and then the last line
+ * out to the edges.
+ */
+static void PadToPowerOf2(const read_context * p_ctx, uint8_t * p_out)
+{
+    size_t channels = p_ctx->out_channels;
+    size_t len      = (size_t)p_ctx->width     * channels;
+    size_t pot_len  = (size_t)p_ctx->pot_width * channels;
+    size_t line;
+    size_t i;
+
+    for(line = 0; line < (size_t)p_ctx->pot_lines; line++)
+    {
+        uint8_t * p_line = p_out + line * p_ctx->pot_line_len;
+
+        if(line < (size_t)p_ctx->lines)
+        {
+            memcpy(p_line, p_ctx->data_out + line * p_ctx->out_line_len, len);
+            for(i = len; i < pot_len; i++)
+                p_line[i] = p_line[i - channels];
+        }
+        else
+            memcpy(p_line, p_line - p_ctx->pot_line_len, pot_len);
+    }
+}
+
+/* Brings the decoded image to the size the BMPREAD_POT_* flags give, if it
+ * isn't already, swapping data_out for the result.  Returns 0 if out of
+ * memory or nonzero if ok.
+ */
+static int MakePowerOf2(read_context * p_ctx)
+{
+    uint8_t * p_out;
+
+    if(p_ctx->pot_width == p_ctx->width &&
+       p_ctx->pot_lines == p_ctx->lines) return 1;
+
+    if(!(p_out = (uint8_t *)
+         Allocate(&p_ctx->allocator,
+                  (size_t)p_ctx->pot_lines * p_ctx->pot_line_len))) return 0;
+
+    if((p_ctx->flags & BMPREAD_POT_MASK) == BMPREAD_POT_PAD)
+        PadToPowerOf2(p_ctx, p_out);
+    else if(!ResampleToPowerOf2(p_ctx, p_out))
+    {
+        Release(&p_ctx->allocator, p_out);
+        return 0;
+    }
+
+    Release(&p_ctx->allocator, p_ctx->data_out);
+    p_ctx->data_out     = p_out;
+    p_ctx->width        = p_ctx->pot_width;
+    p_ctx->lines        = p_ctx->pot_lines;
+    p_ctx->out_line_len = p_ctx->pot_line_len;
+
+    return 1;
+}
+
+/* Frees resources allocated by various functions along the way.  Only frees
+ * data_out if !leave_data_out (if the bitmap loads successfully, you want the
+ * data to remain until THEY free it), and never if it's the caller's buffer.
+ */
+static void FreeContext(read_context * p_ctx, int leave_data_out)
+{
+    if(p_ctx->src.fp)
+        fclose(p_ctx->src.fp);
+
+    Release(&p_ctx->allocator, p_ctx->palette);
+    Release(&p_ctx->allocator, p_ctx->expansion);
+    Release(&p_ctx->allocator, p_ctx->scratch);
+    Release(&p_ctx->allocator, p_ctx->sums);
+    Release(&p_ctx->allocator, p_ctx->src.buf);
+
+    if(!leave_data_out && !p_ctx->caller_out)
+        Release(&p_ctx->allocator, p_ctx->data_out);
+}
+
+/* A read-only view of an entire file, for bmpread_mmap() and bmpread_raw().
+ */
+typedef struct file_map
+{
+    const uint8_t * data; /* Start of the file's contents. */
+    size_t          size; /* Length of the file. */
+
+    /* Where buffer below, and the copy of this struct bmpread_raw() hands
+     * out, came from.
+     */
+    bmpread_allocator_t allocator;
+
+#if defined(BMPREAD_MMAP_WIN32)
+    HANDLE          file;    /* The file itself. */
+    HANDLE          mapping; /* The mapping object for the view. */
+#elif !defined(BMPREAD_MMAP_POSIX)
+    uint8_t       * buffer;  /* No mmap(), so we read the file into this. */
+#endif
+
+} file_map;
+
+/* Maps the named file into memory for reading.  Returns 0 on error (including
+ * an empty file, which can't be mapped and isn't a bitmap anyway) or nonzero
+ * on success, in which case the view must be released with UnmapFile().
+ */
+static int MapFile(file_map * map, const char * bmp_file)
+{
+#if defined(BMPREAD_MMAP_POSIX)
+
+    struct stat st;
+    void * view;
+    int fd;
+
+    map->allocator = global_allocator;
+
+    if((fd = open(bmp_file, O_RDONLY)) < 0) return 0;
+
+    if(fstat(fd, &st) || st.st_size <= 0 ||
+       (uintmax_t)st.st_size > SIZE_MAX)
+    {
+        close(fd);
+        return 0;
+    }
+
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* The mapping keeps its own reference to the file. */
+    if(view == MAP_FAILED) return 0;
+
+    map->data = (const uint8_t *)view;
+    map->size = (size_t)st.st_size;
+    return 1;
+
+#elif defined(BMPREAD_MMAP_WIN32)
+
+    LARGE_INTEGER size;
+    const void * view;
+
+    map->allocator = global_allocator;
+
+    map->file = CreateFileA(bmp_file, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(map->file == INVALID_HANDLE_VALUE) return 0;
+
+    if(!GetFileSizeEx(map->file, &size) || size.QuadPart <= 0 ||
+       (ULONGLONG)size.QuadPart > SIZE_MAX ||
+       !(map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY,
+                                           0, 0, NULL)))
+    {
+        CloseHandle(map->file);
+        return 0;
+    }
+
+    if(!(view = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0)))
+    {
+        CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return 0;
+    }
+
+    map->data = (const uint8_t *)view;
+    map->size = (size_t)size.QuadPart;
+    return 1;
+
+#else
+
+    /* Without a way to map files, the next best thing is one big read. */
+    FILE * fp;
+    long size;
+    int ok = 0;
+
+    map->allocator = global_allocator;
+
+    if(!(fp = fopen(bmp_file, "rb"))) return 0;
+
+    if(!fseek(fp, 0, SEEK_END) && (size = ftell(fp)) > 0 &&
+       (unsigned long)size <= SIZE_MAX && !fseek(fp, 0, SEEK_SET) &&
+       (map->buffer = (uint8_t *)Allocate(&map->allocator,
+                                          (size_t)size)) &&
+       fread(map->buffer, 1, (size_t)size, fp) == (size_t)size)
+    {
+        map->data = map->buffer;
+        map->size = (size_t)size;
+        ok = 1;
+    }
+
+    fclose(fp);
+    if(!ok)
+        Release(&map->allocator, map->buffer);
+    return ok;
+
+#endif
+}
+
+/* Releases a view created by MapFile().
+ */
+static void UnmapFile(file_map * map)
+{
+#if defined(BMPREAD_MMAP_POSIX)
+    munmap((void *)map->data, map->size);
+#elif defined(BMPREAD_MMAP_WIN32)
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    Release(&map->allocator, map->buffer);
+#endif
+}
+
+/* Validates and decodes the bitmap from the context's source, which must
+ * already be set up, and fills out p_bmp_out on success.  Returns 0 if there's
+ * an error or nonzero if the bitmap loaded ok.
+ */
+static int Load(read_context * p_ctx, bmpread_t * p_bmp_out)
+{
+    int32_t content_width;
+    int32_t content_lines;
+
+    if(!Validate(p_ctx)) return 0;
+    if(!Decode(p_ctx))   return 0;
+
+    /* Only padding leaves the decoded pixels as they were. */
+    content_width = p_ctx->pot_width;
+    content_lines = p_ctx->pot_lines;
+    if((p_ctx->flags & BMPREAD_POT_MASK) == BMPREAD_POT_PAD)
+    {
+        content_width = p_ctx->width;
+        content_lines = p_ctx->lines;
+    }
+
+    if(!MakePowerOf2(p_ctx)) return 0;
+
+    /* Finally, make sure we can stuff these into ints.  I feel like this is
+     * slightly justified by how it keeps the header definition dead simple
+     * (including, well, nothing but stddef.h).  I suppose this could also be
+     * done way earlier and maybe save some disk reads, but I like keeping the
+     * check with the code it's checking.
+     */
+#if INT32_MAX > INT_MAX
+    if(p_ctx->width > INT_MAX) return 0;
+    if(p_ctx->lines > INT_MAX) return 0;
+#endif
+
+    p_bmp_out->width          = p_ctx->width;
+    p_bmp_out->height         = p_ctx->lines;
+    p_bmp_out->flags          = p_ctx->flags;
+    p_bmp_out->data           = p_ctx->data_out;
+    p_bmp_out->content_width  = content_width;
+    p_bmp_out->content_height = content_lines;
+
+    /* So bmpread_free() knows where to give data back, or that it can't. */
+    if(!p_ctx->caller_out)
+        p_bmp_out->allocator = p_ctx->allocator;
+
+    return 1;
+}
+
+int bmpread(const char * bmp_file, unsigned int flags, bmpread_t * p_bmp_out)
+{
+    return bmpread_with_allocator(bmp_file, flags, &global_allocator,
+                                  p_bmp_out);
+}
+
+int bmpread_with_allocator(const char * bmp_file,
+                           unsigned int flags,
+                           const bmpread_allocator_t * allocator,
+                           bmpread_t * p_bmp_out)
+{
+    int success = 0;
+    FILE * fp;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_file)  break;
+        if(!p_bmp_out) break;
+        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+
+        if(!allocator || !allocator->alloc) break;
+
+        ctx.flags     = flags;
+        ctx.allocator = *allocator;
+
+        if(!(fp = fopen(bmp_file, "rb"))) break;
+        SourceInitFile(&ctx.src, fp, &ctx.allocator);
+
+        if(!Load(&ctx, p_bmp_out)) break;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, success);
+
+    return success;
+}
+
+int bmpread_mem(const void * bmp_data,
+                size_t bmp_size,
+                unsigned int flags,
+                bmpread_t * p_bmp_out)
+{
+    return bmpread_mem_with_allocator(bmp_data, bmp_size, flags,
+                                      &global_allocator, p_bmp_out);
+}
+
+int bmpread_mem_with_allocator(const void * bmp_data,
+                               size_t bmp_size,
+                               unsigned int flags,
+                               const bmpread_allocator_t * allocator,
+                               bmpread_t * p_bmp_out)
+{
+    int success = 0;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_data)  break;
+        if(!p_bmp_out) break;
+        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+
+        if(!allocator || !allocator->alloc) break;
+
+        ctx.flags     = flags;
+        ctx.allocator = *allocator;
+        SourceInitMem(&ctx.src, (const uint8_t *)bmp_data, bmp_size);
+
+        if(!Load(&ctx, p_bmp_out)) break;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, success);
+
+    return success;
+}
+
+int bmpread_mmap(const char * bmp_file,
+                 unsigned int flags,
+                 bmpread_t * p_bmp_out)
+{
+    int success = 0;
+
+    file_map map;
+    memset(&map, 0, sizeof(map));
+
+    if(bmp_file && p_bmp_out && MapFile(&map, bmp_file))
+    {
+        success = bmpread_mem(map.data, map.size, flags, p_bmp_out);
+        UnmapFile(&map);
+    }
+    else if(p_bmp_out)
+        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+
+    return success;
+}
+
+/* Whether the pixel array is already laid out the way glTexImage2D() takes
+ * GL_BGR or GL_BGRA pixels: 24-bit, or 32-bit with 8-bit fields in B, G, R, A
+ * byte order (alpha optional).
+ */
+static int IsRawCompatible(const read_context * p_ctx)
+{
+    const uint32_t * masks = p_ctx->info.masks;
+
+    if(p_ctx->info.compression == COMPRESSION_NONE)
+        return (p_ctx->info.bits == 24);
+
+    return (p_ctx->info.compression == COMPRESSION_BITFIELDS &&
+            p_ctx->info.bits == 32 &&
+            masks[0] == UINT32_C(0x00ff0000) &&
+            masks[1] == UINT32_C(0x0000ff00) &&
+            masks[2] == UINT32_C(0x000000ff) &&
+            (masks[3] == 0 || masks[3] == UINT32_C(0xff000000)));
+}
+
+int bmpread_raw(const char * bmp_file,
+                unsigned int flags,
+                bmpread_raw_t * p_raw_out)
+{
+    int success = 0;
+    int mapped = 0;
+
+    file_map map;
+    file_map * p_map;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&map, 0, sizeof(map));
+
+    do
+    {
+        if(!bmp_file)  break;
+        if(!p_raw_out) break;
+        memset(p_raw_out, 0, sizeof(*p_raw_out));
+
+        /* The rest of the flags are about decoding, which we don't do. */
+        if(flags & (BMPREAD_SCALE_MASK | BMPREAD_POT_MASK)) break;
+        ctx.flags     = flags & BMPREAD_ANY_SIZE;
+        ctx.allocator = global_allocator;
+
+        if(!(mapped = MapFile(&map, bmp_file))) break;
+        SourceInitMem(&ctx.src, map.data, map.size);
+
+        if(!ValidateHeaders(&ctx)) break;
+        if(!IsRawCompatible(&ctx)) break;
+
+        /* The pixel array has to be all there, since it's used in place. */
+        if(!CanMultiply(ctx.lines, ctx.file_line_len)) break;
+        if(ctx.header.data_offset > map.size) break;
+        if((size_t)ctx.lines * ctx.file_line_len >
+           map.size - ctx.header.data_offset) break;
+
+#if INT32_MAX > INT_MAX
+        if(ctx.width > INT_MAX) break;
+        if(ctx.lines > INT_MAX) break;
+#endif
+
+        /* The view has to outlive this call, so it's handed out by way of a
+         * copy of the struct that knows how to release it.
+         */
+        if(!(p_map = (file_map *)Allocate(&map.allocator, sizeof(map))))
+            break;
+        *p_map = map;
+
+        p_raw_out->width     = ctx.width;
+        p_raw_out->height    = ctx.lines;
+        p_raw_out->channels  = (int)(ctx.info.bits / 8);
+        p_raw_out->has_alpha = (ctx.info.bits == 32 &&
+                                ctx.info.masks[3] != 0);
+        p_raw_out->top_down  = (ctx.info.height < 0);
+        p_raw_out->line_len  = ctx.file_line_len;
+        p_raw_out->data      = map.data + ctx.header.data_offset;
+        p_raw_out->map       = p_map;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, 0);
+    if(!success && mapped)
+        UnmapFile(&map);
+
+    return success;
+}
+
+void bmpread_raw_free(bmpread_raw_t * p_raw)
+{
+    if(p_raw)
+    {
+        if(p_raw->map)
+        {
+            file_map map = *(file_map *)p_raw->map;
+
+            Release(&map.allocator, p_raw->map);
+            UnmapFile(&map);
+        }
+
+        memset(p_raw, 0, sizeof(*p_raw));
+    }
+}
+
+int bmpread_into(const char * bmp_file,
+                 unsigned int flags,
+                 void * dest,
+                 size_t dest_stride,
+                 size_t dest_size,
+                 bmpread_t * p_bmp_out)
+{
+    int success = 0;
+    FILE * fp;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_file)  break;
+        if(!dest)      break;
+        if(!p_bmp_out) break;
+        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+
+        ctx.flags        = flags;
+        ctx.allocator    = global_allocator;
+        ctx.data_out     = (uint8_t *)dest;
+        ctx.caller_out   = 1;
+        ctx.caller_size  = dest_size;
+        ctx.out_line_len = dest_stride;
+
+        if(!(fp = fopen(bmp_file, "rb"))) break;
+        SourceInitFile(&ctx.src, fp, &ctx.allocator);
+
+        if(!Load(&ctx, p_bmp_out)) break;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, success);
+
+    return success;
+}
+
+int bmpread_rect(const char * bmp_file,
+                 unsigned int flags,
+                 int x,
+                 int y,
+                 int width,
+                 int height,
+                 bmpread_t * p_bmp_out)
+{
+    int success = 0;
+    FILE * fp;
+
+    read_context ctx;
+    bmp_rect rect;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_file)  break;
+        if(!p_bmp_out) break;
+        memset(p_bmp_out, 0, sizeof(*p_bmp_out));
+
+#if INT_MAX > INT32_MAX
+        if(x > INT32_MAX || y > INT32_MAX) break;
+        if(width > INT32_MAX || height > INT32_MAX) break;
+#endif
+        rect.x      = x;
+        rect.y      = y;
+        rect.width  = width;
+        rect.height = height;
+
+        ctx.flags     = flags;
+        ctx.allocator = global_allocator;
+        ctx.rect      = &rect;
+
+        if(!(fp = fopen(bmp_file, "rb"))) break;
+        SourceInitFile(&ctx.src, fp, &ctx.allocator);
+
+        if(!Load(&ctx, p_bmp_out)) break;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, success);
+
+    return success;
+}
+
+int bmpread_stream(const char * bmp_file,
+                   unsigned int flags,
+                   int band_lines,
+                   bmpread_band_fn band_fn,
+                   void * user)
+{
+    int success = 0;
+    FILE * fp;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_file)       break;
+        if(!band_fn)        break;
+        if(band_lines <= 0) break;
+
+        ctx.flags      = flags;
+        ctx.allocator  = global_allocator;
+        ctx.band_fn    = band_fn;
+        ctx.band_user  = user;
+        ctx.band_lines = (size_t)band_lines;
+
+        if(!(fp = fopen(bmp_file, "rb"))) break;
+        SourceInitFile(&ctx.src, fp, &ctx.allocator);
+
+        if(!Validate(&ctx)) break;
+
+        /* Same deal as in Load(), but before any bands go out. */
+#if INT32_MAX > INT_MAX
+        if(ctx.width > INT_MAX) break;
+        if(ctx.lines > INT_MAX) break;
+#endif
+
+        if(!Decode(&ctx)) break;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, 0);
+
+    return success;
+}
+
+int bmpread_info(const char * bmp_file,
+                 unsigned int flags,
+                 bmpread_info_t * p_info_out)
+{
+    int success = 0;
+    FILE * fp;
+
+    read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    do
+    {
+        if(!bmp_file)   break;
+        if(!p_info_out) break;
+        memset(p_info_out, 0, sizeof(*p_info_out));
+
+        ctx.flags     = flags;
+        ctx.allocator = global_allocator;
+
+        if(!(fp = fopen(bmp_file, "rb"))) break;
+        SourceInitFile(&ctx.src, fp, &ctx.allocator);
+
+        if(!ValidateHeaders(&ctx)) break;
+
+        /* Same deal as in Load(). */
+#if INT32_MAX > INT_MAX
+        if(ctx.width > INT_MAX) break;
+        if(ctx.lines > INT_MAX) break;
+#endif
+
+        p_info_out->width       = ctx.pot_width;
+        p_info_out->height      = ctx.pot_lines;
+        p_info_out->flags       = ctx.flags;
+        p_info_out->bits        = ctx.info.bits;
+        p_info_out->has_alpha   = (ctx.info.compression ==
+                                   COMPRESSION_BITFIELDS &&
+                                   ctx.bitfields[3].span > 0);
+        p_info_out->top_down    = (ctx.info.height < 0);
+        p_info_out->data_offset = ctx.header.data_offset;
+        p_info_out->line_len    = ctx.pot_line_len;
+        p_info_out->data_size   = (size_t)ctx.pot_lines * ctx.pot_line_len;
+
+        success = 1;
+    } while(0);
+
+    FreeContext(&ctx, 0);
+
+    return success;
+}
+
+void bmpread_free(bmpread_t * p_bmp)
+{
+    if(p_bmp)
+    {
+        if(p_bmp->data)
+            Release(&p_bmp->allocator, p_bmp->data);
+
+        memset(p_bmp, 0, sizeof(*p_bmp));
+    }
+}
+
+void bmpread_set_allocator(const bmpread_allocator_t * allocator)
+{
+    if(allocator && allocator->alloc)
+        global_allocator = *allocator;
+    else
+        global_allocator = default_allocator;
+}
+
+void bmpread_set_max_threads(unsigned int threads)
+{
+    max_threads = threads;
+}
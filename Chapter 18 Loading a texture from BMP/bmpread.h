@@ -30,6 +30,8 @@
 #ifndef __bmpread_h__
 #define __bmpread_h__
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -51,6 +53,55 @@ extern "C"
 /* Load and output an alpha channel (default is just color channels). */
 #define BMPREAD_ALPHA 8u
 
+/* Decode large bitmaps on several threads at once (default is to decode on
+ * the calling thread only).  See the notes for bmpread().
+ */
+#define BMPREAD_THREADED 16u
+
+/* Decode at a reduced size, averaging each 2x2, 4x4, or 8x8 box of pixels into
+ * one (default is full size).  Use at most one of these.  See the notes for
+ * bmpread().
+ */
+#define BMPREAD_SCALE_1_2 32u
+#define BMPREAD_SCALE_1_4 64u
+#define BMPREAD_SCALE_1_8 96u
+
+/* All the bits the BMPREAD_SCALE_* flags use. */
+#define BMPREAD_SCALE_MASK 96u
+
+/* Bring a width or height that isn't a power of 2 to one instead of failing
+ * (default is to fail, or output it as-is with BMPREAD_ANY_SIZE): resample
+ * up to the next power of 2, resample to the nearest one (up or down), or
+ * pad up to the next one by repeating the last column and line.  Use at most
+ * one of these.  See the notes for bmpread().
+ */
+#define BMPREAD_POT_NEXT 128u
+#define BMPREAD_POT_NEAREST 256u
+#define BMPREAD_POT_PAD 384u
+
+/* All the bits the BMPREAD_POT_* flags use. */
+#define BMPREAD_POT_MASK 384u
+
+
+/* Where bmpread() gets its memory, for both the output and the buffers it
+ * uses along the way.  See bmpread_set_allocator().
+ */
+typedef struct bmpread_allocator_t
+{
+    /* Returns a block of at least size bytes, suitably aligned for any type,
+     * or NULL if out of memory.  Must not be NULL.
+     */
+    void * (* alloc)(void * user, size_t size);
+
+    /* Gives back a block from alloc.  May be NULL for allocators that don't
+     * free individual blocks, e.g. an arena reset between loads.
+     */
+    void (* release)(void * user, void * ptr);
+
+    void * user; /* Passed as-is to alloc and release. */
+
+} bmpread_allocator_t;
+
 
 /* The struct filled by bmpread().  Holds information about the image's pixels.
  */
@@ -87,6 +138,20 @@ typedef struct bmpread_t
      */
     unsigned char * data;
 
+    /* How much of the image is the bitmap's own pixels: the same as width
+     * and height, except with BMPREAD_POT_PAD, where they sit at the start
+     * of the first content_height lines and the rest is padding.  Scale
+     * texture coordinates by content_width / width and content_height /
+     * height to show just the bitmap.
+     */
+    int content_width;
+    int content_height;
+
+    /* The allocator data came from, so bmpread_free() can give it back.  All
+     * 0 when data belongs to the caller, as with bmpread_into().
+     */
+    bmpread_allocator_t allocator;
+
 } bmpread_t;
 
 
@@ -108,8 +173,10 @@ typedef struct bmpread_t
  *
  * Notes:
  * The file must be a Windows 3 (not NT) or higher format bitmap file with any
- * valid bit depth (1, 4, 8, 16, 24, or 32), and must not be compressed (no
- * RLE).
+ * valid bit depth (1, 4, 8, 16, 24, or 32).  8- and 4-bit files may be RLE
+ * compressed.  Pixels an RLE file skips over (with a delta or an early end of
+ * line or bitmap) are output as 0: black, and fully transparent with
+ * BMPREAD_ALPHA.
  *
  * Default behavior is for bmpread() to return data in a format directly usable
  * by OpenGL texture functions, e.g. glTexImage2D, format GL_RGB (or GL_RGBA if
@@ -120,7 +187,8 @@ typedef struct bmpread_t
  *  - Lines are padded to span a multiple of four bytes.  To return data with
  *    no padding, pass BMPREAD_BYTE_ALIGN in flags.
  *  - Images with a width or height that isn't a power of 2 will fail to load.
- *    To allow loading images of any size, pass BMPREAD_ANY_SIZE in flags.
+ *    To allow loading images of any size, pass BMPREAD_ANY_SIZE in flags, or
+ *    to bring them to a power of 2, one of the BMPREAD_POT_* flags.
  * Note that passing any of these flags may cause the output to be unusable as
  * an OpenGL texture, which may or may not matter to you.
  *
@@ -130,10 +198,356 @@ typedef struct bmpread_t
  * alpha values are output as 255 (this can be changed by redefining
  * BMPREAD_DEFAULT_ALPHA in bmpread.c).  This allows fully loading 16- and
  * 32-bit bitmaps, which *can* include an alpha channel.
+ *
+ * With BMPREAD_THREADED in flags, the scan lines of a large bitmap are split
+ * into bands that are decoded in parallel on a few short-lived threads, one
+ * per CPU (or as set by bmpread_set_max_threads()) up to BMPREAD_MAX_THREADS
+ * (8 by default).  Bitmaps too small to give each thread at least
+ * BMPREAD_THREAD_MIN_BYTES (1 MiB by default) of output are decoded on the
+ * calling thread as usual.  The bands need the whole pixel array in memory at
+ * once: bmpread() reads it in one go, while bmpread_mem() and bmpread_mmap()
+ * use it where it already is.  The output is the same either way.  RLE
+ * compressed bitmaps are always decoded on the calling thread, since where
+ * each line starts isn't known up front.
+ *
+ * With one of the BMPREAD_SCALE_* flags, the bitmap comes out at 1/2, 1/4, or
+ * 1/8 its size in each direction, rounded up, e.g. for a thumbnail or a
+ * distant level of detail.  Each output pixel is the average of a box of
+ * pixels, counting from the top left; boxes along the right and bottom edges
+ * average just the pixels that are left.  Lines are decoded one at a time and
+ * added into the boxes as they go, so only the reduced image is ever
+ * allocated.  Without BMPREAD_ANY_SIZE, the reduced width and height must be
+ * powers of 2.  Scaled decoding always runs on the calling thread.
+ *
+ * With one of the BMPREAD_POT_* flags, a width or height that isn't a power
+ * of 2 is brought to one after decoding (and after any BMPREAD_SCALE_* flag),
+ * so the image can be mipmapped and block compressed like any other texture.
+ * BMPREAD_POT_NEXT and BMPREAD_POT_NEAREST resample it with a tent filter,
+ * one direction at a time, widened when shrinking so every pixel still
+ * counts; BMPREAD_POT_NEAREST goes down when that's the smaller change in
+ * proportion.  BMPREAD_POT_PAD leaves the pixels alone and repeats the last
+ * column and line out to the new size, so filtering along the edges of the
+ * bitmap doesn't pick up anything else (see content_width in bmpread_t).
+ * Sizes that are already powers of 2 are left as they are, and sizes over
+ * 2^30 fail.  Neither bmpread_into() nor bmpread_stream() take these flags.
  */
 int bmpread(const char * bmp_file, unsigned int flags, bmpread_t * p_bmp_out);
 
 
+/* Like bmpread(), but decodes a bitmap file that's already in memory instead
+ * of opening one on disk.  The headers are parsed and the pixels decoded
+ * straight out of bmp_data, without any stdio calls or intermediate copies.
+ *
+ * Inputs:
+ * bmp_data - Pointer to the contents of an entire bitmap file.  It's only
+ *            read during the call, and may be released once bmpread_mem()
+ *            returns.
+ * bmp_size - The number of bytes at bmp_data.
+ * flags - Any BMPREAD_* flags, as for bmpread().
+ * p_bmp_out - Pointer to a bmpread_t struct to fill with information, as for
+ *             bmpread().  Must be freed with bmpread_free().
+ *
+ * Returns:
+ * 0 if there's an error (data is invalid or truncated, etc.), or nonzero if
+ * the bitmap loaded ok.  On success, the output is identical to what bmpread()
+ * would have produced for the same file.
+ */
+int bmpread_mem(const void * bmp_data,
+                size_t bmp_size,
+                unsigned int flags,
+                bmpread_t * p_bmp_out);
+
+
+/* Like bmpread(), but maps the file into memory and decodes it with
+ * bmpread_mem(), which avoids stdio's buffering and per-line reads entirely.
+ * The mapping is released before bmpread_mmap() returns.  On platforms
+ * without mmap() or MapViewOfFile(), the file is read into memory with one
+ * big read instead.
+ *
+ * Inputs and return value are the same as for bmpread().  Must be freed with
+ * bmpread_free().
+ */
+int bmpread_mmap(const char * bmp_file,
+                 unsigned int flags,
+                 bmpread_t * p_bmp_out);
+
+
+/* The struct filled by bmpread_raw().  Describes a bitmap's pixels exactly as
+ * they're stored in the file.
+ */
+typedef struct bmpread_raw_t
+{
+    int width;  /* Width in pixels. */
+    int height; /* Height in pixels. */
+
+    /* Bytes per pixel: 3 for blue, green, and red components in that order
+     * (OpenGL's GL_BGR), or 4 for blue, green, red, and alpha (GL_BGRA).
+     */
+    int channels;
+
+    /* Nonzero if the fourth byte of each pixel holds alpha.  With 4 channels
+     * and no alpha, the fourth byte is unused and should be ignored, e.g. by
+     * uploading with internal format GL_RGB.
+     */
+    int has_alpha;
+
+    /* Nonzero if the top line comes first.  Otherwise the bottom line comes
+     * first, the same as bmpread() without BMPREAD_TOP_DOWN.
+     */
+    int top_down;
+
+    /* Bytes from the start of one line to the start of the next: a multiple
+     * of four, so glTexImage2D() takes the lines as-is with
+     * GL_UNPACK_ALIGNMENT 4 and GL_UNPACK_ROW_LENGTH 0.
+     */
+    size_t line_len;
+
+    /* The first line's pixels, inside a read-only view of the file.  Valid
+     * until bmpread_raw_free().
+     */
+    const unsigned char * data;
+
+    void * map; /* Private; keeps the view alive. */
+
+} bmpread_raw_t;
+
+
+/* Maps a bitmap file into memory and, if its pixels are already in a format
+ * OpenGL can upload directly, points at them instead of decoding anything.
+ * This skips the conversion and the copy bmpread() makes, for the common case
+ * of uncompressed 24-bit files (and 32-bit files with 8-bit fields in B, G, R,
+ * A order).
+ *
+ * Inputs:
+ * bmp_file - The filename of the bitmap file to map.
+ * flags - BMPREAD_ANY_SIZE to allow sizes that aren't powers of 2.  The flags
+ *         that change decoded output don't apply and are ignored, except for
+ *         the BMPREAD_SCALE_* and BMPREAD_POT_* flags, which fail.
+ * p_raw_out - Pointer to a bmpread_raw_t struct to fill with information.
+ *             Its contents on input are ignored.  Must be freed with
+ *             bmpread_raw_free() when no longer needed.
+ *
+ * Returns:
+ * 0 if there's an error (as for bmpread()) or the file's pixels need
+ * decoding, e.g. it's palettized or compressed, or nonzero on success.  On
+ * failure, fall back to bmpread().
+ */
+int bmpread_raw(const char * bmp_file,
+                unsigned int flags,
+                bmpread_raw_t * p_raw_out);
+
+
+/* Releases the view held by a bmpread_raw_t struct, after which its data is
+ * no longer valid.
+ *
+ * Inputs:
+ * p_raw - The pointer you previously passed to bmpread_raw().
+ *
+ * Returns:
+ * void
+ */
+void bmpread_raw_free(bmpread_raw_t * p_raw);
+
+
+/* Like bmpread(), but decodes into a buffer the caller provides instead of
+ * allocating one, e.g. a mapped pixel unpack buffer or a slice of an arena,
+ * so the pixels land where they're needed without another copy.
+ *
+ * Inputs:
+ * bmp_file - The filename of the bitmap file to load.
+ * flags - Any BMPREAD_* flags, as for bmpread().  BMPREAD_BYTE_ALIGN has no
+ *         effect, since dest_stride decides the layout of lines instead.
+ *         The BMPREAD_POT_* flags fail, since dest is sized for the decoded
+ *         pixels.
+ * dest - Where to write the pixel data.  Pixels are laid out as described for
+ *        bmpread_t's data, except that each line starts dest_stride bytes
+ *        after the previous one.  Bytes between the end of one line's pixels
+ *        and the start of the next are left untouched.
+ * dest_stride - Bytes from the start of one line to the start of the next.
+ *               Must be at least width * 3 (or width * 4 with
+ *               BMPREAD_ALPHA).
+ * dest_size - The number of bytes at dest.  Must be at least
+ *             (height - 1) * dest_stride, plus the bytes in one line's
+ *             pixels.
+ * p_bmp_out - Pointer to a bmpread_t struct to fill with information.  Its
+ *             data member is set to dest.  Since the buffer is yours, don't
+ *             pass it to bmpread_free().
+ *
+ * Returns:
+ * 0 if there's an error (as for bmpread(), or if the bitmap doesn't fit in
+ * dest), or nonzero if the file loaded ok.  On error, dest may have been
+ * partially written.
+ */
+int bmpread_into(const char * bmp_file,
+                 unsigned int flags,
+                 void * dest,
+                 size_t dest_stride,
+                 size_t dest_size,
+                 bmpread_t * p_bmp_out);
+
+
+/* Like bmpread(), but decodes only a rectangular region of the bitmap, e.g. a
+ * tile of a big map or one cell of a sprite sheet.  Only the scan lines in
+ * the region are read from the file (and for a narrow region of a wide
+ * bitmap, only the part of each line inside it), and only the region's pixels
+ * are allocated and decoded.
+ *
+ * Inputs:
+ * bmp_file - The filename of the bitmap file to load.
+ * flags - Any BMPREAD_* flags, as for bmpread().  They apply to the region
+ *         as though it were the whole image: BMPREAD_TOP_DOWN and
+ *         BMPREAD_BYTE_ALIGN decide the layout of its lines, and without
+ *         BMPREAD_ANY_SIZE, the region's width and height (not the whole
+ *         bitmap's) must be powers of 2.
+ * x, y - Position of the region's top left pixel, counting right from the
+ *        left edge and down from the top line of the image.
+ * width, height - Size of the region in pixels.  The region must lie
+ *                 entirely within the bitmap.
+ * p_bmp_out - Pointer to a bmpread_t struct to fill with the region, as for
+ *             bmpread().  Its width and height are the region's.  Must be
+ *             freed with bmpread_free().
+ *
+ * Returns:
+ * 0 if there's an error (as for bmpread(), or if the region is empty or
+ * doesn't fit in the bitmap), or nonzero if the region loaded ok.  RLE
+ * compressed bitmaps aren't supported, since the only way to find a line in
+ * one is to decode every line before it.
+ */
+int bmpread_rect(const char * bmp_file,
+                 unsigned int flags,
+                 int x,
+                 int y,
+                 int width,
+                 int height,
+                 bmpread_t * p_bmp_out);
+
+
+/* The struct passed to a bmpread_stream() callback.  Describes one band of
+ * consecutive lines of the output.
+ */
+typedef struct bmpread_band_t
+{
+    int width;  /* Width in pixels, of the image and so of the band. */
+    int height; /* Height in pixels of the whole image. */
+
+    /* BMPREAD_* flags, as in bmpread_t. */
+    unsigned int flags;
+
+    /* Where the band's first line goes in the whole output, as an index into
+     * the lines of bmpread_t's data for the same flags, and how many lines
+     * follow it.  With default flags, first_line is the yoffset to give
+     * glTexSubImage2D().
+     */
+    int first_line;
+    int lines;
+
+    /* Bytes in each line of data, padding included, as for bmpread(). */
+    size_t line_len;
+
+    /* The band's pixels, formatted and ordered as in bmpread_t's data.  Only
+     * valid until the callback returns.
+     */
+    const unsigned char * data;
+
+} bmpread_band_t;
+
+/* Callback for bmpread_stream(), called with the user pointer passed to it
+ * and each band in turn.
+ */
+typedef void (* bmpread_band_fn)(void * user, const bmpread_band_t * band);
+
+
+/* Like bmpread(), but instead of holding the whole decoded image in memory at
+ * once, decodes band_lines lines at a time into a buffer of just that size
+ * and hands each band to a callback, e.g. to upload a huge bitmap with
+ * glTexSubImage2D() or pass it on to a tiler.  Memory use stays bounded by
+ * the band size no matter how big the bitmap.
+ *
+ * Inputs:
+ * bmp_file - The filename of the bitmap file to load.
+ * flags - Any BMPREAD_* flags, as for bmpread().  BMPREAD_THREADED is
+ *         ignored, since bands go out one at a time.  The BMPREAD_POT_*
+ *         flags fail, since resampling needs more than one band at once.
+ * band_lines - The most lines to pass the callback at once.  Must be at
+ *              least 1.
+ * band_fn - Function to call with each band.
+ * user - Passed along to band_fn.
+ *
+ * Returns:
+ * 0 if there's an error (as for bmpread()), or nonzero if the whole bitmap
+ * was decoded.  Bands already handed out before a truncated file is noticed
+ * aren't taken back.
+ *
+ * Notes:
+ * Bands go out in the order the file stores its lines, which for most
+ * bitmaps is bottom first.  Each band covers whole, consecutive output lines,
+ * in the same order as bmpread()'s output, and every band but the last in
+ * file order has band_lines lines.  Together the bands cover the output
+ * exactly once.
+ */
+int bmpread_stream(const char * bmp_file,
+                   unsigned int flags,
+                   int band_lines,
+                   bmpread_band_fn band_fn,
+                   void * user);
+
+
+/* The struct filled by bmpread_info().  Describes a bitmap file and the
+ * output bmpread() would produce for it, without any of the pixels.
+ */
+typedef struct bmpread_info_t
+{
+    int width;  /* Width in pixels. */
+    int height; /* Height in pixels. */
+
+    /* The flags passed to bmpread_info().  The width and height above (with
+     * a BMPREAD_SCALE_* flag) and line_len and data_size below depend on
+     * them.
+     */
+    unsigned int flags;
+
+    int bits;      /* Bits per pixel in the file: 1, 4, 8, 16, 24, or 32. */
+    int has_alpha; /* Nonzero if the file's pixels have an alpha channel. */
+    int top_down;  /* Nonzero if the file stores its top line first. */
+
+    /* Offset from the start of the file to its pixel array. */
+    unsigned long data_offset;
+
+    /* Bytes in each line of the output of bmpread() with the same flags,
+     * padding included, and in the whole output.  These are what to allocate
+     * (or to pass as dest_stride and dest_size) for bmpread_into(), without
+     * the BMPREAD_POT_* flags it doesn't take.
+     */
+    size_t line_len;
+    size_t data_size;
+
+} bmpread_info_t;
+
+
+/* Reads and validates just the headers of the specified bitmap file and fills
+ * out a bmpread_info_t struct with what they say, without decoding (or even
+ * reading) any pixels or allocating a buffer for them.  Only the small
+ * read-ahead buffer for the headers is allocated, through the global
+ * allocator, and it's freed before returning.  This is much cheaper than
+ * bmpread(), for sizing textures or buffers ahead of loading them.
+ *
+ * Inputs:
+ * bmp_file - The filename of the bitmap file to inspect.
+ * flags - Any BMPREAD_* flags, as for bmpread().  They decide which bitmaps
+ *         are accepted (e.g. BMPREAD_ANY_SIZE) and the output sizes reported.
+ * p_info_out - Pointer to a bmpread_info_t struct to fill with information.
+ *              Its contents on input are ignored.  Needs no freeing.
+ *
+ * Returns:
+ * 0 if there's an error (file doesn't exist, headers are invalid, etc.), or
+ * nonzero if the headers are ok.  A file that passes may still fail to load
+ * with bmpread() if its palette or pixels turn out to be truncated.
+ */
+int bmpread_info(const char * bmp_file,
+                 unsigned int flags,
+                 bmpread_info_t * p_info_out);
+
+
 /* Frees memory allocated during bmpread().  Call bmpread_free() when you are
  * done using the bmpread_t struct (e.g. after you have passed the data on to
  * OpenGL).
@@ -147,6 +561,58 @@ int bmpread(const char * bmp_file, unsigned int flags, bmpread_t * p_bmp_out);
 void bmpread_free(bmpread_t * p_bmp);
 
 
+/* Sets the allocator bmpread() and the rest use from now on, e.g. to keep
+ * texture loads out of the general heap or to carve them out of an arena that
+ * gets reset once a batch of textures is uploaded.  Set it up front, before
+ * loading anything: it isn't synchronized with loads in progress on other
+ * threads.  Bitmaps already loaded are still freed with the allocator they
+ * came from.
+ *
+ * Inputs:
+ * allocator - Pointer to the allocator to copy.  NULL (or a NULL alloc)
+ *             restores the default of malloc() and free().  With a NULL
+ *             release, the buffers used during a load are simply left in the
+ *             allocator along with the output.
+ *
+ * Returns:
+ * void
+ */
+void bmpread_set_allocator(const bmpread_allocator_t * allocator);
+
+
+/* Sets how many threads BMPREAD_THREADED decodes with from now on, at most:
+ * e.g. 1 to keep a load off the other cores while a game is running, or more
+ * than there are CPUs to measure how decoding scales.  Loads are still capped
+ * at BMPREAD_MAX_THREADS and split by BMPREAD_THREAD_MIN_BYTES as usual.  Like
+ * bmpread_set_allocator(), set it before loading anything.
+ *
+ * Inputs:
+ * threads - The most threads to decode with, or 0 to restore the default of
+ *           one per CPU.
+ *
+ * Returns:
+ * void
+ */
+void bmpread_set_max_threads(unsigned int threads);
+
+
+/* Like bmpread() and bmpread_mem(), but take their memory from the given
+ * allocator for just this call instead of the one set by
+ * bmpread_set_allocator(), e.g. a per-thread arena.  Fail if allocator or its
+ * alloc is NULL.  Free the output with bmpread_free() as usual.
+ */
+int bmpread_with_allocator(const char * bmp_file,
+                           unsigned int flags,
+                           const bmpread_allocator_t * allocator,
+                           bmpread_t * p_bmp_out);
+
+int bmpread_mem_with_allocator(const void * bmp_data,
+                               size_t bmp_size,
+                               unsigned int flags,
+                               const bmpread_allocator_t * allocator,
+                               bmpread_t * p_bmp_out);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,7 @@
 #include <GLFW/glfw3.h>
 #include <OpenGL/OpenGL.h>
 #include <math.h>
+#include "ShaderProgram.h"
 
 #define GL_SILENCE_DEPRECATION 1
 
@@ -78,56 +79,14 @@ int main()
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
     
-    const char* source;
-    GLint compilationStatus;
-    
-    // ------------- VERTEX SHADER
-    
-    source = vertex120;
-    
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-    
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
-    // ---------- FRAGMENT SHADER
-    
-    source = raster120;
-    
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
     // ------------- SHADER PROGRAM
     
-    GLint linkStatus;
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
+    GLuint shaderProgram = loadProgram(vertex120, raster120);
+    if (!shaderProgram)
         exit(1);
-    }
     
     glUseProgram(shaderProgram);
+    UniformTable & uniforms = ShaderCache::shared().uniforms(shaderProgram);
     
     // ---------------- VBOs
     
@@ -204,12 +163,10 @@ int main()
         0, 0, 0, 1
     };
     
-    GLuint attribMatrix;
-    attribMatrix = glGetUniformLocation(shaderProgram, "matrix");
-    glUniformMatrix4fv(attribMatrix, 1, GL_FALSE, matrix);
+    int uniformMatrix = uniforms.find("matrix");
+    uniforms.setMatrix(uniformMatrix, matrix);
     
-    GLuint uniformTime;
-    uniformTime = glGetUniformLocation(shaderProgram, "time");
+    int uniformTime = uniforms.find("time");
     
     glEnable(GL_CULL_FACE);
     
@@ -220,7 +177,7 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT);
         
         float time = glfwGetTime();
-        glUniform1f(uniformTime, time);
+        uniforms.set(uniformTime, time);
         
         glDrawElements(GL_TRIANGLES, sizeof(indices), GL_UNSIGNED_BYTE,0);
         
@@ -5,13 +5,20 @@
 #include <OpenGL/OpenGL.h>
 #include <math.h>
 #include "bmpread.h"
+#include "TextureLoader.h"
+#include "ShaderProgram.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #define GL_SILENCE_DEPRECATION 1
 
+// true: time, view and projection go up once a frame, in a uniform block
+// every program reads; false: they're set on each program, as uniforms
+static const bool useFrameBlock = true;
+
 // vertex shader source
+// (time, view and projection are declared by FrameUniforms::program())
 
 const GLchar* vertex120 = R"END(
 #version 120
@@ -20,9 +27,7 @@ attribute vec3 color;
 attribute vec2 inUvs;
 varying vec3 outColor;
 varying vec2 outUvs;
-uniform float time;
 uniform mat4 matrix;
-uniform mat4 projection;
 void main()
 {
     float theta = time;
@@ -45,7 +50,7 @@ void main()
 
     outColor = color;
     outUvs = inUvs;
-    gl_Position = matrix * rotationY * rotationX * vec4(position,1.f);
+    gl_Position = projection * view * matrix * rotationY * rotationX * vec4(position,1.f);
 }
 )END";
 
@@ -56,7 +61,6 @@ const GLchar* raster120 = R"END(
 varying vec3 outColor;
 varying vec2 outUvs;
 uniform sampler2D tex; // 1st texture slot by default
-uniform float time;
 void main()
 {
     gl_FragColor = vec4(texture2D(tex, outUvs)/2.f + vec4(outColor,1.f)/2.f);
@@ -65,6 +69,11 @@ void main()
 
 int main()
 {
+    // -------------- texture loading, in the background while GL gets set up
+    
+    TextureLoader loader;
+    std::future<CookedTexture> texture = loader.loadCooked("texture2.bmp");
+    
     // -------------- init
     
     GLFWwindow * window;
@@ -91,56 +100,12 @@ int main()
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
     
-    const char* source;
-    GLint compilationStatus;
-    
-    // ------------- VERTEX SHADER
-    
-    source = vertex120;
-    
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-    
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
-    // ---------- FRAGMENT SHADER
-    
-    source = raster120;
-    
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
     // ------------- SHADER PROGRAM
+    // (started now and collected further down, so the driver can compile it
+    // while the buffers go up and the texture decodes)
     
-    GLint linkStatus;
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
-        exit(1);
-    }
-    
-    glUseProgram(shaderProgram);
+    FrameUniforms frame(useFrameBlock);
+    frame.prepare(vertex120, raster120);
     
     // ----------------- VBOs
     
@@ -206,6 +171,15 @@ int main()
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesBuf);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
     
+    // ------------- SHADER PROGRAM, collected
+    
+    GLuint shaderProgram = frame.program(vertex120, raster120);
+    if (!shaderProgram)
+        exit(1);
+    
+    frame.use(shaderProgram);
+    UniformTable & uniforms = ShaderCache::shared().uniforms(shaderProgram);
+    
     // ----------------- attributes
     
     GLuint attribPosition;
@@ -227,23 +201,17 @@ int main()
         0,   0,   0,   1
     };
     
-    GLuint attribMatrix;
-    attribMatrix = glGetUniformLocation(shaderProgram, "matrix");
-    glUniformMatrix4fv(attribMatrix, 1, GL_FALSE, matrix);
-    
-    GLuint uniformTime;
-    uniformTime = glGetUniformLocation(shaderProgram, "time");
-    
+    int uniformMatrix = uniforms.find("matrix");
+    uniforms.setMatrix(uniformMatrix, matrix);
     
+    glm::mat4 viewMatrix = glm::mat4(1.f);
     glm::mat4 projectionMatrix = glm::mat4(1.f);// glm::perspective(glm::radians(60.f), 1.f, 0.f, 10.f);
-    GLint uniformProjection = glGetUniformLocation(shaderProgram, "projection");
-    glUniformMatrix4fv(uniformProjection, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
     
     // tex
     
-    bmpread_t bitmap;
+    CookedTexture bitmap = texture.get();
     
-    if (!bmpread("texture2.bmp",0, &bitmap)) {
+    if (!bitmap.loaded()) {
         std::cout << "Texture loading error";
         exit(-1);
     }
@@ -253,14 +221,17 @@ int main()
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texid);
     
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
-    glTexImage2D(GL_TEXTURE_2D,0,3,bitmap.width,bitmap.height,0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    
+    // every mip level, from the full size down to 1x1
+    for (int level = 0; level < bitmap.levels(); level++)
+        glTexImage2D(GL_TEXTURE_2D,level,3,bitmap.width(level),bitmap.height(level),0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.data(level));
     
-    GLuint attribTex = glGetAttribLocation(shaderProgram, "tex");
-    glUniform1i(attribTex, 0);
+    int uniformTex = uniforms.find("tex");
+    uniforms.set(uniformTex, 0);
     
     // uvs
 
@@ -299,7 +270,8 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT);
         
         float time = glfwGetTime();
-        glUniform1f(uniformTime, time);
+        frame.set(time, glm::value_ptr(viewMatrix), glm::value_ptr(projectionMatrix));
+        frame.use(shaderProgram);
         
         glDrawElements(GL_TRIANGLES, sizeof(indices),  GL_UNSIGNED_BYTE, 0);
         
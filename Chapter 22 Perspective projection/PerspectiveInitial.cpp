@@ -5,6 +5,8 @@
 #include <OpenGL/OpenGL.h>
 #include <math.h>
 #include "bmpread.h"
+#include "TextureLoader.h"
+#include "ShaderProgram.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -64,6 +66,20 @@ void main()
 
 int main()
 {
+    // -------------- texture loading, in the background while GL gets set up
+    
+    // 24- and 32-bit bitmaps need no decoding: the file is just mapped, and
+    // goes straight to GL as BGR(A). Anything else (or a top-down file) is
+    // decoded to RGB on the loader.
+    
+    bmpread_raw_t raw;
+    bool useRaw = bmpread_raw("texture2.bmp", 0, &raw) && !raw.top_down;
+    
+    TextureLoader loader;
+    std::future<Bitmap> texture;
+    if (!useRaw)
+        texture = loader.load("texture2.bmp");
+    
     // -------------- init
     
     GLFWwindow * window;
@@ -90,56 +106,11 @@ int main()
     msg = glGetString(GL_SHADING_LANGUAGE_VERSION);
     std::cout << msg << "\n";
     
-    const char* source;
-    GLint compilationStatus;
-    
-    // ------------- VERTEX SHADER
-    
-    source = vertex120;
-    
-    GLuint shaderVertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(shaderVertex,1,&source,0);
-    glCompileShader(shaderVertex);
-    
-    glGetShaderiv(shaderVertex, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderVertex, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
-    // ---------- FRAGMENT SHADER
-    
-    source = raster120;
-    
-    GLuint shaderFragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(shaderFragment,1,&source,0);
-    glCompileShader(shaderFragment);
-    
-    glGetShaderiv(shaderFragment, GL_COMPILE_STATUS, &compilationStatus);
-    if (compilationStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetShaderInfoLog(shaderFragment, sizeof(messages), 0, &messages[0]); std::cout << messages;
-        exit(1);
-    }
-    
     // ------------- SHADER PROGRAM
+    // (started now and collected further down, so the driver can compile it
+    // while the buffers go up and the texture decodes)
     
-    GLint linkStatus;
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram,shaderVertex);
-    glAttachShader(shaderProgram,shaderFragment);
-    glLinkProgram(shaderProgram);
-    
-    glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linkStatus);
-    if (linkStatus == GL_FALSE) {
-        GLchar messages[256];
-        glGetProgramInfoLog(shaderProgram,sizeof(messages),0,&messages[0]);
-        std::cout << messages;
-        exit(1);
-    }
-    
-    glUseProgram(shaderProgram);
+    ShaderCache::shared().prepare(vertex120, raster120);
     
     // ----------------- VBOs
     
@@ -205,6 +176,15 @@ int main()
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesBuf);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
     
+    // ------------- SHADER PROGRAM, collected
+    
+    GLuint shaderProgram = loadProgram(vertex120, raster120);
+    if (!shaderProgram)
+        exit(1);
+    
+    glUseProgram(shaderProgram);
+    UniformTable & uniforms = ShaderCache::shared().uniforms(shaderProgram);
+    
     // ----------------- attributes
     
     GLuint attribPosition;
@@ -226,17 +206,15 @@ int main()
         0,   0,   0,   1
     };
     
-    GLuint attribMatrix;
-    attribMatrix = glGetUniformLocation(shaderProgram, "matrix");
-    glUniformMatrix4fv(attribMatrix, 1, GL_FALSE, matrix);
+    int uniformMatrix = uniforms.find("matrix");
+    uniforms.setMatrix(uniformMatrix, matrix);
     
-    GLuint uniformTime;
-    uniformTime = glGetUniformLocation(shaderProgram, "time");
+    int uniformTime = uniforms.find("time");
     
     // ----------------- texture
     
-    bmpread_t bitmap;
-    if (!bmpread("texture2.bmp", 0, &bitmap)) {
+    Bitmap bitmap;
+    if (!useRaw && !(bitmap = texture.get()).loaded()) {
         std::cout << "texture loading error";
         exit(-1);
     }
@@ -248,12 +226,18 @@ int main()
     
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
-    glTexImage2D(GL_TEXTURE_2D,0,3,bitmap.width,bitmap.height,0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.data);
+    if (useRaw) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_RGB,raw.width,raw.height,0,raw.channels == 4 ? GL_BGRA : GL_BGR,GL_UNSIGNED_BYTE,raw.data);
+    } else {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D,0,3,bitmap.bmp.width,bitmap.bmp.height,0,GL_RGB,GL_UNSIGNED_BYTE,bitmap.bmp.data);
+    }
+    bmpread_raw_free(&raw);
     
-    GLuint attribTex = glGetAttribLocation(shaderProgram, "tex");
-    glUniform1i(attribTex, 0);
+    int uniformTex = uniforms.find("tex");
+    uniforms.set(uniformTex, 0);
     
     // ------------------ tex attrib
     
@@ -292,7 +276,7 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT);
         
         float time = glfwGetTime();
-        glUniform1f(uniformTime, time);
+        uniforms.set(uniformTime, time);
         
         glDrawElements(GL_TRIANGLES, sizeof(indices),  GL_UNSIGNED_BYTE, 0);
         